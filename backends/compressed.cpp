@@ -0,0 +1,258 @@
+//--------------------------------------------------------------------------------------
+// File: compressed.cpp
+//
+// Reading gzip and zstd compressed test files without decompressing them to disk
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "compressed.h"
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace io = boost::iostreams;
+
+static const unsigned char gzip_magic[] = { 0x1F, 0x8B };
+static const unsigned char zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+// Stream buffer fed by a thread that decompresses ahead of the reader, so decompression
+// runs in parallel with parsing. At most DECOMPRESS_QUEUE_BLOCKS blocks are buffered
+class ReadAheadBuffer : public streambuf
+{
+    unique_ptr<io::filtering_istream> source;
+    string filename;
+    boost::mutex lock;
+    boost::condition_variable changed;
+    deque<vector<char>> blocks; // decompressed and not yet handed to the reader
+    vector<char> current; // block the reader is on
+    bool finished; // the decompression thread has produced its last block
+    bool stopping; // the reader is gone
+    string error; // why decompression stopped early, if it did
+    boost::thread thread;
+
+    void decompress(void);
+
+protected:
+    virtual int_type underflow(void);
+
+public:
+    ReadAheadBuffer(unique_ptr<io::filtering_istream> decompressor, const string &name);
+    ~ReadAheadBuffer(void);
+};
+
+ReadAheadBuffer::ReadAheadBuffer(unique_ptr<io::filtering_istream> decompressor, const string &name) :
+    source(std::move(decompressor)), filename(name), finished(false), stopping(false)
+{
+    thread = boost::thread(&ReadAheadBuffer::decompress, this);
+}
+
+ReadAheadBuffer::~ReadAheadBuffer(void)
+{
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+// decompression thread
+void ReadAheadBuffer::decompress(void)
+{
+    string failure;
+
+    try
+    {
+        while(true)
+        {
+            vector<char> block(DECOMPRESS_BLOCK_SIZE);
+
+            source->read(block.data(), block.size());
+            block.resize(source->gcount());
+            if(block.empty())
+            {
+                break;
+            }
+
+            boost::unique_lock<boost::mutex> guard(lock);
+            while(blocks.size() >= DECOMPRESS_QUEUE_BLOCKS && !stopping)
+            {
+                changed.wait(guard);
+            }
+
+            if(stopping)
+            {
+                return;
+            }
+
+            blocks.push_back(std::move(block));
+            changed.notify_all();
+        }
+    }
+    catch(std::exception &e)
+    {
+        failure = e.what();
+    }
+
+    boost::lock_guard<boost::mutex> guard(lock);
+    finished = true;
+    error = failure;
+    changed.notify_all();
+}
+
+streambuf::int_type ReadAheadBuffer::underflow(void)
+{
+    boost::unique_lock<boost::mutex> guard(lock);
+
+    while(blocks.empty() && !finished)
+    {
+        changed.wait(guard);
+    }
+
+    if(blocks.empty())
+    {
+        if(!error.empty())
+        {
+            cout << "[-] Failed to decompress " << filename << ": " << error << endl;
+            error.clear();
+        }
+
+        return traits_type::eof();
+    }
+
+    current = std::move(blocks.front());
+    blocks.pop_front();
+    changed.notify_all();
+
+    setg(current.data(), current.data(), current.data() + current.size());
+
+    return traits_type::to_int_type(*gptr());
+}
+
+// istream that owns its ReadAheadBuffer
+class ReadAheadStream : public istream
+{
+    ReadAheadBuffer buffer;
+
+public:
+    ReadAheadStream(unique_ptr<io::filtering_istream> decompressor, const string &name) :
+        istream(nullptr), buffer(std::move(decompressor), name)
+    {
+        rdbuf(&buffer);
+    }
+};
+
+COMPRESSION get_compression(const string &filename)
+{
+    unsigned char magic[sizeof(zstd_magic)] = {};
+    std::ifstream f(filename, ios::binary);
+
+    f.read((char *)magic, sizeof(magic));
+
+    if(f.gcount() >= (streamsize)sizeof(gzip_magic) && memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0)
+    {
+        return COMPRESSION_GZIP;
+    }
+
+    if(f.gcount() == (streamsize)sizeof(zstd_magic) && memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0)
+    {
+        return COMPRESSION_ZSTD;
+    }
+
+    return COMPRESSION_NONE;
+}
+
+// decompressing stream over a compressed file, errors in the compressed data throw
+static unique_ptr<io::filtering_istream> open_decompressor(const string &filename, COMPRESSION compression)
+{
+    unique_ptr<io::filtering_istream> in(new io::filtering_istream());
+    io::file_source source(filename, ios::binary);
+
+    if(!source.is_open())
+    {
+        return nullptr;
+    }
+
+    if(compression == COMPRESSION_GZIP)
+    {
+        in->push(io::gzip_decompressor());
+    }
+    else
+    {
+        in->push(io::zstd_decompressor());
+    }
+    in->push(source);
+    in->exceptions(ios::badbit);
+
+    return in;
+}
+
+unique_ptr<istream> open_test_file(const string &filename, bool read_ahead)
+{
+    COMPRESSION compression = get_compression(filename);
+
+    if(compression == COMPRESSION_NONE)
+    {
+        unique_ptr<istream> f(new std::ifstream(filename, ios::binary));
+        return *f ? std::move(f) : nullptr;
+    }
+
+    unique_ptr<io::filtering_istream> decompressor = open_decompressor(filename, compression);
+    if(decompressor == nullptr)
+    {
+        return nullptr;
+    }
+
+    if(!read_ahead)
+    {
+        return decompressor;
+    }
+
+    return unique_ptr<istream>(new ReadAheadStream(std::move(decompressor), filename));
+}
+
+int read_test_file(const string &filename, vector<unsigned char> &contents)
+{
+    unique_ptr<istream> in = open_test_file(filename, false);
+
+    contents.clear();
+    if(in == nullptr)
+    {
+        cout << "[-] Failed to open " << filename << "!" << endl;
+        return -1;
+    }
+
+    try
+    {
+        while(true)
+        {
+            size_t offset = contents.size();
+
+            contents.resize(offset + DECOMPRESS_BLOCK_SIZE);
+            in->read((char *)contents.data() + offset, DECOMPRESS_BLOCK_SIZE);
+            contents.resize(offset + in->gcount());
+
+            if(in->gcount() == 0)
+            {
+                break;
+            }
+        }
+    }
+    catch(std::exception &e)
+    {
+        cout << "[-] Failed to decompress " << filename << ": " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+//--------------------------------------------------------------------------------------
+// File: compressed.h
+//
+// Reading gzip and zstd compressed test files without decompressing them to disk
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+// decompressed blocks are handed from the decompression thread to the reader in this size
+#define DECOMPRESS_BLOCK_SIZE (1024 * 1024)
+
+// how many blocks the decompression thread may run ahead of the reader
+#define DECOMPRESS_QUEUE_BLOCKS 4
+
+typedef enum _COMPRESSION
+{
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+} COMPRESSION;
+
+// detected from the file's magic bytes, not its name
+COMPRESSION get_compression(const string &filename);
+
+// Open a test file for reading, gzip and zstd are decompressed as the file is read.
+// With read_ahead a compressed file is decompressed on its own thread up to
+// DECOMPRESS_QUEUE_BLOCKS blocks ahead of the reader, which starts as soon as the file is
+// opened. Returns null if the file can't be opened
+unique_ptr<istream> open_test_file(const string &filename, bool read_ahead);
+
+// read a whole test file into memory, decompressing it if needed
+int read_test_file(const string &filename, vector<unsigned char> &contents);
@@ -10,89 +10,387 @@
 #include "json.h"
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include "compressed.h"
 
-int read_json_registers(json &state, map<std::string, unsigned int> &registers, map<std::string, std::string>& register_map);
-int read_json_memory(json &state, map<unsigned long long, unsigned char> &memory);
+// Nesting depths inside a test file:
+// [                                 1 - list of tests
+//   {                               2 - test
+//     "initial": {                  3 - state, registers live here
+//       "ram": [                    4 - list of ram entries
+//         [address, value]          5 - ram entry
+//     "cycles": [                   3 - list of bus cycles
+//       [address, value, "read"]    4 - cycle
+enum
+{
+    DEPTH_TEST_LIST = 1,
+    DEPTH_TEST = 2,
+    DEPTH_STATE = 3,
+    DEPTH_RAM_LIST = 4,
+    DEPTH_RAM_ENTRY = 5,
+    DEPTH_CYCLE = 4
+};
 
-// reads the json list of tests in json_filename. On success initial_states and final_states
-// are vectors of unit tests
-// The json file format is defined here: https://github.com/TomHarte/ProcessorTests
-int get_tests(TEST_PARAMS& test_params, vector<TEST_STATE> &initial_states, vector<TEST_STATE> &final_states)
+// SAX handler that builds tests straight from the parser's events without ever creating
+// a json DOM. Tests outside of [start_test, end_test) or in another shard are skipped
+// without being built and parsing stops as soon as end_test is reached
+class JsonTestSax : public json::json_sax_t
 {
-    try
+    TEST_PARAMS &test_params;
+    TEST_SINK &sink;
+    map<std::string, int> field_indexes; // json register name -> register index
+    TEST_CASE test_case;
+    TEST_STATE *state;      // state currently being filled in, null if not in initial/final
+    std::string section;    // last key seen inside the test object
+    std::string field;      // last key seen inside the state object
+    unsigned int depth;
+    unsigned int test_index;
+    unsigned int ram_field; // which element of the [address, value] pair is next
+    unsigned long long ram_address;
+    BUS_ACCESS cycle;       // cycle being read, only with bus_access
+    bool in_cycle;
+    bool cycle_valid;       // the cycle accessed memory, cycles without bus activity are dropped
+    bool skipping;          // current test is outside of the requested range
+    bool stopped;           // parsing was stopped on purpose, not due to an error
+    bool discover;          // add unknown registers to the register layout instead of failing
+
+    bool value(unsigned long long number);
+    int registerIndex(void);
+
+public:
+    JsonTestSax(TEST_PARAMS &params, TEST_SINK &test_sink, bool discover_registers) : test_params(params), sink(test_sink), state(nullptr),
+        depth(0), test_index(0), ram_field(0), ram_address(0), cycle(), in_cycle(false), cycle_valid(false), skipping(false), stopped(false), discover(discover_registers) {}
+
+    bool wasStopped(void) const { return stopped; }
+    unsigned int getTestCount(void) const { return test_index; }
+
+    bool null() override;
+    bool boolean(bool val) override { return true; }
+    bool number_integer(number_integer_t val) override { return value(val); }
+    bool number_unsigned(number_unsigned_t val) override { return value(val); }
+    bool number_float(number_float_t val, const string_t& s) override { return value(val); }
+    bool string(string_t& val) override;
+    bool binary(binary_t& val) override { return true; }
+    bool start_object(std::size_t elements) override;
+    bool end_object() override;
+    bool start_array(std::size_t elements) override;
+    bool end_array() override;
+    bool key(string_t& val) override;
+    bool parse_error(std::size_t position, const std::string& last_token, const nlohmann::detail::exception& ex) override;
+};
+
+bool JsonTestSax::string(string_t& val)
+{
+    if(depth == DEPTH_TEST && section == "name" && !skipping)
+    {
+        test_case.name = val;
+    }
+    else if(in_cycle && ram_field == 2)
+    {
+        // "read" and "write", or the pin states of the Z80 tests, r/w then memory request
+        if(val == "read" || val == "write")
+        {
+            cycle.write = val == "write";
+        }
+        else if(val.size() >= 3 && val[2] == 'm' && (val[0] == 'r' || val[1] == 'w'))
+        {
+            cycle.write = val[1] == 'w';
+        }
+        else
+        {
+            cycle_valid = false;
+        }
+
+        ram_field++;
+    }
+
+    return true;
+}
+
+bool JsonTestSax::null()
+{
+    // a cycle without an address or data on the bus
+    if(in_cycle)
     {
-        std::ifstream f(test_params.json_filename);
-        json data = json::parse(f);
+        cycle_valid = false;
+        ram_field++;
+    }
 
-        // loop through all of the tests
-        for (unsigned int i = 0; i < data.size(); i++)
+    return true;
+}
+
+bool JsonTestSax::start_object(std::size_t elements)
+{
+    depth++;
+
+    if(depth == DEPTH_TEST)
+    {
+        if(test_index >= test_params.end_test)
         {
-            TEST_STATE initial_state;
-            TEST_STATE final_state;
+            // reached the end of the requested range, no need to read the rest of the file
+            stopped = true;
+            return false;
+        }
 
-            json initial_registers = data[i]["initial"];
-            json initial_memory = data[i]["initial"]["ram"];
+        // the register layout always comes from the first test, whichever shard it's in
+        skipping = test_index < test_params.start_test || (!discover && !test_in_shard(test_params, test_index));
+        test_case = TEST_CASE();
+        test_case.test_id = test_index;
+        state = nullptr;
+    }
+    else if(depth == DEPTH_STATE && !skipping)
+    {
+        if(section == "initial")
+        {
+            state = &test_case.initial_state;
+        }
+        else if(section == "final")
+        {
+            state = &test_case.final_state;
+        }
+    }
 
-            json final_registers = data[i]["final"];
-            json final_memory = data[i]["final"]["ram"];
+    return true;
+}
 
-            read_json_registers(initial_registers, initial_state.registers, test_params.register_map);
-            read_json_registers(final_registers, final_state.registers, test_params.register_map);
+bool JsonTestSax::end_object()
+{
+    if(depth == DEPTH_STATE)
+    {
+        if(state != nullptr)
+        {
+            sort_memory(*state);
+        }
+        state = nullptr;
+    }
+    else if(depth == DEPTH_TEST)
+    {
+        if(!skipping && !sink(test_case))
+        {
+            stopped = true;
+            depth--;
+            return false;
+        }
+
+        test_index++;
+    }
 
-            read_json_memory(initial_memory, initial_state.memory);
-            read_json_memory(final_memory, final_state.memory);
+    depth--;
+    return true;
+}
 
-            initial_states.push_back(initial_state);
-            final_states.push_back(final_state);
+bool JsonTestSax::start_array(std::size_t elements)
+{
+    depth++;
+
+    if(depth == DEPTH_RAM_ENTRY)
+    {
+        ram_field = 0;
+    }
+    else if(depth == DEPTH_CYCLE && section == "cycles" && test_params.bus_access && !skipping)
+    {
+        // the same [address, value] fields as a ram entry, then the kind of access
+        ram_field = 0;
+        cycle = BUS_ACCESS();
+        in_cycle = true;
+        cycle_valid = true;
+    }
+
+    return true;
+}
+
+bool JsonTestSax::end_array()
+{
+    if(in_cycle && depth == DEPTH_CYCLE)
+    {
+        if(cycle_valid && ram_field == 3)
+        {
+            test_case.cycles.push_back(cycle);
         }
+        in_cycle = false;
+    }
+
+    depth--;
+    return true;
+}
+
+bool JsonTestSax::key(string_t& val)
+{
+    if(depth == DEPTH_TEST)
+    {
+        section = val;
+    }
+    else if(depth == DEPTH_STATE)
+    {
+        field = val;
+    }
 
+    return true;
+}
+
+// register index of the current json field, names are only resolved the first time a field is seen
+int JsonTestSax::registerIndex(void)
+{
+    auto cached = field_indexes.find(field);
+    if(cached != field_indexes.end())
+    {
+        return cached->second;
     }
-    catch(...)
+
+    // use the register map to map test registers to Ghidra registers
+    std::string register_name = field;
+    auto mapping = test_params.register_map.find(field);
+    if(mapping != test_params.register_map.end())
     {
-        cout << "[-] Failed to parse json file!" << endl;
-        return -1;
+        register_name = mapping->second;
     }
 
+    int index = -1;
+    auto found = test_params.register_indexes.find(register_name);
+    if(found != test_params.register_indexes.end())
+    {
+        index = found->second;
+    }
+    else if(discover)
+    {
+        index = add_test_register(test_params, register_name);
+        if(index < 0)
+        {
+            cout << "[-] Tests use more than " << MAX_TEST_REGISTERS << " registers!" << endl;
+        }
+    }
+    else
+    {
+        cout << "[-] Test " << test_index << " uses register " << field << " which is not in the first test!" << endl;
+    }
 
+    field_indexes[field] = index;
 
-    return 0;
+    return index;
 }
 
-int read_json_registers(json &state, map<std::string, unsigned int> &registers, map<std::string, std::string>& register_map)
+// registers are numbers directly in the state object, ram values are numbers in the
+// [address, value] pairs
+bool JsonTestSax::value(unsigned long long number)
 {
-    string reg_name;
+    if(in_cycle)
+    {
+        if(ram_field == 0)
+        {
+            cycle.address = number;
+        }
+        else if(ram_field == 1)
+        {
+            cycle.value = number;
+        }
+
+        ram_field++;
+        return true;
+    }
+
+    if(state == nullptr)
+    {
+        // name, cycles, or a skipped test
+        return true;
+    }
 
-    for (auto& [key, value] : state.items())
+    if(depth == DEPTH_STATE)
     {
-        if(key == "ram")
+        int index = registerIndex();
+        if(index < 0)
         {
-            continue;
+            return false;
         }
 
-        // use the register map to map test registers to Ghidra registers
-        if(register_map.find(key) != register_map.end())
+        state->registers[index] = number;
+        state->register_mask |= 1ULL << index;
+    }
+    else if(depth == DEPTH_RAM_ENTRY && field == "ram")
+    {
+        if(ram_field == 0)
         {
-            reg_name = register_map[key];
+            ram_address = number;
         }
-        else
+        else if(ram_field == 1)
         {
-            reg_name = key;
+            add_memory(*state, ram_address, number);
         }
 
-        // TODO: validate registers against .sla?
+        ram_field++;
+    }
+
+    return true;
+}
+
+bool JsonTestSax::parse_error(std::size_t position, const std::string& last_token, const nlohmann::detail::exception& ex)
+{
+    cout << "[-] JSON parse error at byte " << position << ": " << ex.what() << endl;
+    return false;
+}
+
+static int parse_tests(TEST_PARAMS& test_params, TEST_SINK sink, bool discover, istream *input)
+{
+    unique_ptr<istream> opened;
 
-        registers[reg_name] = value;
+    if(input == nullptr)
+    {
+        // discovery stops after the first test, decompressing ahead would be wasted
+        opened = open_test_file(test_params.json_filename, !discover);
+        if(opened == nullptr)
+        {
+            cout << "[-] Failed to open json file " << test_params.json_filename << "!" << endl;
+            return -1;
+        }
+        input = opened.get();
+    }
+
+    JsonTestSax sax(test_params, sink, discover);
+    bool result = false;
+
+    try
+    {
+        result = json::sax_parse(*input, &sax);
+    }
+    catch(...)
+    {
+        result = false;
+    }
+
+    if(!result && !sax.wasStopped())
+    {
+        cout << "[-] Failed to parse json file!" << endl;
+        return -1;
     }
 
     return 0;
 }
 
-int read_json_memory(json &state, map<unsigned long long, unsigned char> &memory)
+// Streams the json list of tests in json_filename, handing each test in
+// [start_test, end_test) to sink as soon as it has been parsed. Memory use does not depend
+// on the size of the file. gzip and zstd files are decompressed as they are parsed.
+// input is an already opened stream of json_filename, otherwise the file is opened here.
+// The json file format is defined here: https://github.com/TomHarte/ProcessorTests
+int get_tests(TEST_PARAMS& test_params, TEST_SINK sink, istream *input)
+{
+    return parse_tests(test_params, sink, false, input);
+}
+
+// Builds the register layout from the first test. Every later test must use a subset of
+// those registers
+int get_test_registers(TEST_PARAMS& test_params)
 {
-    for (unsigned int i = 0; i < state.size(); i++)
+    TEST_PARAMS first_test = test_params;
+
+    first_test.start_test = 0;
+    first_test.end_test = 1;
+
+    if(parse_tests(first_test, [](TEST_CASE &test_case) { return true; }, true, nullptr) != 0)
     {
-        memory[state[i][0]] = state[i][1];
+        return -1;
     }
 
+    test_params.registers = first_test.registers;
+    test_params.register_indexes = first_test.register_indexes;
+
     return 0;
 }
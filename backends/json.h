@@ -8,9 +8,15 @@
 //--------------------------------------------------------------------------------------
 #pragma once
 
+#include <functional>
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
 
 #include "../state.h"
 
-int get_tests(TEST_PARAMS& test_params, vector<TEST_STATE> &initial_states, vector<TEST_STATE> &final_states);
+// called for every test parsed in the [start_test, end_test) range.
+// return false to stop loading early
+typedef std::function<bool(TEST_CASE &test_case)> TEST_SINK;
+
+int get_tests(TEST_PARAMS& test_params, TEST_SINK sink, istream *input = nullptr);
+int get_test_registers(TEST_PARAMS& test_params);
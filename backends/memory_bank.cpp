@@ -0,0 +1,176 @@
+//--------------------------------------------------------------------------------------
+// File: memory_bank.cpp
+//
+// libsla MemoryBank tuned for unit tests
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "memory_bank.h"
+#include <cstring>
+
+// Words are always sizeof(uintb) so any access size libsla generates can be split into at most
+// two words. Storage is byte based, the word size only affects how libsla calls find/insert
+TestMemoryBank::TestMemoryBank(AddrSpace *spc) :
+    MemoryBank(spc, sizeof(uintb), spc->getHighest() < FLAT_MEMORY_MAX_SIZE ? 4096 : MEMORY_PAGE_SIZE), log_writes(false)
+{
+    space_mask = spc->getHighest();
+    wrap_is_mask = ((space_mask + 1) & space_mask) == 0;
+    flat = space_mask < FLAT_MEMORY_MAX_SIZE;
+
+    if(flat)
+    {
+        // rounded up to whole lines so reset never has to clip
+        line_dirty.resize((space_mask >> MEMORY_LINE_SHIFT) + 1, 0);
+        flat_memory.resize(line_dirty.size() << MEMORY_LINE_SHIFT, 0);
+    }
+}
+
+uint1 TestMemoryBank::readByte(uintb addr) const
+{
+    addr = wrap(addr);
+
+    if(flat)
+    {
+        return flat_memory[addr];
+    }
+
+    auto page = pages.find(addr >> MEMORY_PAGE_SHIFT);
+    if(page == pages.end())
+    {
+        return 0;
+    }
+
+    return page->second[addr & (MEMORY_PAGE_SIZE - 1)];
+}
+
+void TestMemoryBank::writeByte(uintb addr, uint1 value)
+{
+    addr = wrap(addr);
+
+    // libsla stores partial words as read-modify-write of the whole word, so only bytes
+    // that actually change are logged
+    if(log_writes && readByte(addr) != value)
+    {
+        write_log.push_back(addr);
+    }
+
+    if(flat)
+    {
+        uintb line = addr >> MEMORY_LINE_SHIFT;
+
+        if(!line_dirty[line])
+        {
+            line_dirty[line] = 1;
+            dirty_lines.push_back(line);
+        }
+
+        flat_memory[addr] = value;
+        return;
+    }
+
+    uintb page_number = addr >> MEMORY_PAGE_SHIFT;
+    uint1 *page = nullptr;
+
+    auto found = pages.find(page_number);
+    if(found != pages.end())
+    {
+        page = found->second;
+    }
+    else
+    {
+        // pages are recycled between tests, only allocate when the pool is empty
+        if(free_pages.empty())
+        {
+            page_pool.emplace_back(new uint1[MEMORY_PAGE_SIZE]());
+            free_pages.push_back(page_pool.back().get());
+        }
+
+        page = free_pages.back();
+        free_pages.pop_back();
+
+        pages[page_number] = page;
+        dirty_pages.push_back(page_number);
+    }
+
+    page[addr & (MEMORY_PAGE_SIZE - 1)] = value;
+}
+
+// clear everything written since the last reset
+void TestMemoryBank::reset(void)
+{
+    for(auto line : dirty_lines)
+    {
+        memset(&flat_memory[line << MEMORY_LINE_SHIFT], 0, MEMORY_LINE_SIZE);
+        line_dirty[line] = 0;
+    }
+    dirty_lines.clear();
+
+    for(auto page_number : dirty_pages)
+    {
+        auto page = pages.find(page_number);
+
+        memset(page->second, 0, MEMORY_PAGE_SIZE);
+        free_pages.push_back(page->second);
+        pages.erase(page);
+    }
+    dirty_pages.clear();
+}
+
+void TestMemoryBank::setWriteLogging(bool enabled)
+{
+    if(enabled)
+    {
+        write_log.clear();
+    }
+
+    log_writes = enabled;
+}
+
+// preload the test's sparse memory
+void TestMemoryBank::load(const vector<unsigned long long> &addresses, const vector<unsigned char> &values)
+{
+    for (size_t i = 0; i < addresses.size(); i++)
+    {
+        writeByte(addresses[i], values[i]);
+    }
+}
+
+void TestMemoryBank::read(uintb addr, uint1 *ptr, int4 size) const
+{
+    for(int4 i = 0; i < size; i++)
+    {
+        ptr[i] = readByte(addr + i);
+    }
+}
+
+uintb TestMemoryBank::find(uintb addr) const
+{
+    uint1 word[sizeof(uintb)];
+
+    read(addr, word, getWordSize());
+
+    return constructValue(word, getWordSize(), getSpace()->isBigEndian());
+}
+
+void TestMemoryBank::insert(uintb addr, uintb val)
+{
+    uint1 word[sizeof(uintb)];
+
+    deconstructValue(word, val, getWordSize(), getSpace()->isBigEndian());
+    setPage(addr, word, 0, getWordSize());
+}
+
+void TestMemoryBank::getPage(uintb addr, uint1 *res, int4 skip, int4 size) const
+{
+    read(addr + skip, res, size);
+}
+
+void TestMemoryBank::setPage(uintb addr, const uint1 *val, int4 skip, int4 size)
+{
+    for(int4 i = 0; i < size; i++)
+    {
+        writeByte(addr + skip + i, val[i]);
+    }
+}
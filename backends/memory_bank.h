@@ -0,0 +1,76 @@
+//--------------------------------------------------------------------------------------
+// File: memory_bank.h
+//
+// libsla MemoryBank tuned for unit tests
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include "emulate.hh"
+
+using namespace ghidra;
+
+// spaces up to this many bytes are backed by one flat array
+#define FLAT_MEMORY_MAX_SIZE 0x100000
+
+// flat spaces track dirty memory in lines of this many bytes
+#define MEMORY_LINE_SHIFT 6
+#define MEMORY_LINE_SIZE (1 << MEMORY_LINE_SHIFT)
+
+// larger spaces are split into pages of this many bytes, allocated on first write
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_SHIFT)
+
+// A unit test only touches a handful of bytes, so the bank remembers what was written and
+// reset() only clears that. Unwritten memory reads as zero. Addresses wrap modulo the size
+// of the address space.
+// Small spaces (6502's 64KB) are a direct mapped flat array. Larger spaces (24 bit and up)
+// use a page table so memory is only allocated for pages a test writes
+class TestMemoryBank : public MemoryBank
+{
+    uintb space_mask; // highest offset in the space
+    bool wrap_is_mask; // space size is a power of two so wrapping is a mask
+    bool flat;
+
+    // flat mode
+    vector<uint1> flat_memory;
+    vector<uint1> line_dirty; // one flag per line
+    vector<uintb> dirty_lines; // lines written since the last reset
+
+    // paged mode
+    boost::unordered_map<uintb, uint1 *> pages; // page number -> page
+    vector<uintb> dirty_pages; // pages allocated since the last reset
+    vector<uint1 *> free_pages;
+    vector<unique_ptr<uint1[]>> page_pool;
+
+    // addresses whose value changed while logging is enabled, may contain duplicates
+    bool log_writes;
+    vector<uintb> write_log;
+
+    uintb wrap(uintb addr) const { return wrap_is_mask ? (addr & space_mask) : (addr % (space_mask + 1)); }
+    uint1 readByte(uintb addr) const;
+    void writeByte(uintb addr, uint1 value);
+
+protected:
+    virtual void insert(uintb addr, uintb val);
+    virtual uintb find(uintb addr) const;
+    virtual void getPage(uintb addr, uint1 *res, int4 skip, int4 size) const;
+    virtual void setPage(uintb addr, const uint1 *val, int4 skip, int4 size);
+
+public:
+    TestMemoryBank(AddrSpace *spc);
+
+    void reset(void);
+    void load(const vector<unsigned long long> &addresses, const vector<unsigned char> &values);
+    void read(uintb addr, uint1 *ptr, int4 size) const;
+
+    // record every byte an instruction changes. Clears the previous log when enabled
+    void setWriteLogging(bool enabled);
+    const vector<uintb> &getWriteLog(void) const { return write_log; }
+};
@@ -0,0 +1,548 @@
+//--------------------------------------------------------------------------------------
+// File: pack.cpp
+//
+// Compact binary test corpus (.vpk). Converted once from json by verifier-pack, then
+// memory mapped by the verifier so tests can be read without parsing the whole file
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "pack.h"
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include "compressed.h"
+
+namespace bip = boost::interprocess;
+
+// the state encoding is shared with traces, register indexes are written unchanged,
+// the file's register table is the layout they index
+void write_packed_state(ostream &out, const TEST_STATE &state, unsigned int num_registers)
+{
+    vector<pair<unsigned long long, vector<unsigned char>>> runs;
+    uint16_t register_count = 0;
+
+    for(unsigned int i = 0; i < num_registers; i++)
+    {
+        if(state.register_mask & (1ULL << i))
+        {
+            register_count++;
+        }
+    }
+
+    write_value<uint16_t>(out, register_count);
+    for(unsigned int i = 0; i < num_registers; i++)
+    {
+        if(state.register_mask & (1ULL << i))
+        {
+            write_value<uint16_t>(out, i);
+            write_value<uint32_t>(out, state.registers[i]);
+        }
+    }
+
+    // memory is sorted by address, merge neighbouring bytes into runs
+    for (size_t i = 0; i < state.memory.size(); i++)
+    {
+        unsigned long long address = state.memory.addresses[i];
+
+        if(runs.empty() || runs.back().first + runs.back().second.size() != address)
+        {
+            runs.push_back(make_pair(address, vector<unsigned char>()));
+        }
+
+        runs.back().second.push_back(state.memory.values[i]);
+    }
+
+    write_value<uint32_t>(out, runs.size());
+    for (const auto & [address, bytes] : runs)
+    {
+        write_value<uint64_t>(out, address);
+        write_value<uint32_t>(out, bytes.size());
+        out.write((const char *)bytes.data(), bytes.size());
+    }
+}
+
+int read_packed_state(const unsigned char *&ptr, const unsigned char *end, const vector<unsigned int> &register_remap, TEST_STATE &state)
+{
+    uint16_t num_registers = 0;
+    uint32_t num_runs = 0;
+
+    if(!read_value(ptr, end, num_registers))
+    {
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < num_registers; i++)
+    {
+        uint16_t index = 0;
+        uint32_t value = 0;
+
+        if(!read_value(ptr, end, index) || !read_value(ptr, end, value) || index >= register_remap.size())
+        {
+            return -1;
+        }
+
+        state.registers[register_remap[index]] = value;
+        state.register_mask |= 1ULL << register_remap[index];
+    }
+
+    if(!read_value(ptr, end, num_runs))
+    {
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < num_runs; i++)
+    {
+        uint64_t address = 0;
+        uint32_t length = 0;
+
+        if(!read_value(ptr, end, address) || !read_value(ptr, end, length) || (size_t)(end - ptr) < length)
+        {
+            return -1;
+        }
+
+        for(unsigned int j = 0; j < length; j++)
+        {
+            add_memory(state, address + j, ptr[j]);
+        }
+        ptr += length;
+    }
+    sort_memory(state);
+
+    return 0;
+}
+
+void write_register_table(ostream &out, const vector<string> &register_names)
+{
+    for(auto &register_name : register_names)
+    {
+        write_value<uint16_t>(out, register_name.size());
+        out.write(register_name.data(), register_name.size());
+    }
+}
+
+int read_register_table(const unsigned char *&ptr, const unsigned char *end, unsigned int num_registers, vector<string> &register_names)
+{
+    for(unsigned int i = 0; i < num_registers; i++)
+    {
+        uint16_t length = 0;
+
+        if(!read_value(ptr, end, length) || (size_t)(end - ptr) < length)
+        {
+            return -1;
+        }
+
+        register_names.push_back(string((const char *)ptr, length));
+        ptr += length;
+    }
+
+    return 0;
+}
+
+int resolve_packed_registers(TEST_PARAMS &test_params, const vector<string> &register_names, bool discover, vector<unsigned int> &register_remap)
+{
+    register_remap.clear();
+
+    for(auto &register_name : register_names)
+    {
+        int index = -1;
+
+        auto found = test_params.register_indexes.find(register_name);
+        if(found != test_params.register_indexes.end())
+        {
+            index = found->second;
+        }
+        else if(discover)
+        {
+            index = add_test_register(test_params, register_name);
+        }
+
+        if(index < 0)
+        {
+            cout << "[-] Test pack register " << register_name << " could not be resolved!" << endl;
+            return -1;
+        }
+
+        register_remap.push_back(index);
+    }
+
+    return 0;
+}
+
+bool is_test_pack(const string &filename)
+{
+    char magic[PACK_MAGIC_SIZE];
+    unique_ptr<istream> f = open_test_file(filename, false);
+
+    try
+    {
+        if(f == nullptr || !f->read(magic, PACK_MAGIC_SIZE))
+        {
+            return false;
+        }
+    }
+    catch(std::exception &e)
+    {
+        return false;
+    }
+
+    return memcmp(magic, PACK_MAGIC, PACK_MAGIC_SIZE) == 0;
+}
+
+int TestPack::open(const string &pack_filename)
+{
+    if(get_compression(pack_filename) != COMPRESSION_NONE)
+    {
+        // packs are compact, a compressed one is decompressed into memory once
+        if(read_test_file(pack_filename, contents) != 0)
+        {
+            return -1;
+        }
+
+        base = contents.data();
+        size = contents.size();
+    }
+    else
+    {
+        try
+        {
+            mapping = bip::file_mapping(pack_filename.c_str(), bip::read_only);
+            region = bip::mapped_region(mapping, bip::read_only);
+        }
+        catch(bip::interprocess_exception &e)
+        {
+            cout << "[-] Failed to map " << pack_filename << ": " << e.what() << endl;
+            return -1;
+        }
+
+        base = (const unsigned char *)region.get_address();
+        size = region.get_size();
+    }
+
+    return parse(pack_filename);
+}
+
+int TestPack::open(vector<unsigned char> &&pack_contents, const string &pack_name)
+{
+    contents = std::move(pack_contents);
+    base = contents.data();
+    size = contents.size();
+
+    return parse(pack_name);
+}
+
+// validate the header and read the register table
+int TestPack::parse(const string &pack_filename)
+{
+    const unsigned char *ptr;
+    const unsigned char *end = base + size;
+
+    ptr = base;
+    if(!read_value(ptr, end, header) || memcmp(header.magic, PACK_MAGIC, PACK_MAGIC_SIZE) != 0)
+    {
+        cout << "[-] " << pack_filename << " is not a test pack!" << endl;
+        return -1;
+    }
+
+    if(header.version < PACK_MIN_VERSION || header.version > PACK_VERSION)
+    {
+        cout << "[-] Unsupported test pack version (" << header.version << ")!" << endl;
+        return -1;
+    }
+
+    // the index must fit in the file
+    if(header.index_offset > size || (size - header.index_offset) / sizeof(uint64_t) < (uint64_t)header.num_tests + 1)
+    {
+        cout << "[-] " << pack_filename << " is truncated!" << endl;
+        return -1;
+    }
+
+    if(header.register_table_offset > size)
+    {
+        cout << "[-] " << pack_filename << " is truncated!" << endl;
+        return -1;
+    }
+
+    ptr = base + header.register_table_offset;
+    if(read_register_table(ptr, end, header.num_registers, register_names) != 0)
+    {
+        cout << "[-] " << pack_filename << " has a corrupt register table!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+// map the pack's register table onto the run's register layout
+int TestPack::resolveRegisters(TEST_PARAMS &test_params, bool discover)
+{
+    if(test_params.bus_access && !(header.flags & PACK_FLAG_CYCLES))
+    {
+        cout << "[-] Test pack has no cycles, pack it again with verifier-pack --cycles for --bus-access!" << endl;
+        return -1;
+    }
+    keep_cycles = test_params.bus_access;
+
+    return resolve_packed_registers(test_params, register_names, discover, register_remap);
+}
+
+int TestPack::getTest(unsigned int test_id, TEST_CASE &test_case) const
+{
+    uint64_t record_start = 0;
+    uint64_t record_end = 0;
+    const unsigned char *index = base + header.index_offset;
+    const unsigned char *ptr;
+    const unsigned char *end;
+
+    if(test_id >= header.num_tests)
+    {
+        return -1;
+    }
+
+    memcpy(&record_start, index + test_id * sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&record_end, index + (test_id + 1) * sizeof(uint64_t), sizeof(uint64_t));
+    if(record_start > record_end || record_end > size)
+    {
+        return -1;
+    }
+
+    ptr = base + record_start;
+    end = base + record_end;
+
+    test_case = TEST_CASE();
+    test_case.test_id = test_id;
+
+    if(header.version >= 2)
+    {
+        uint16_t name_length = 0;
+
+        if(!read_value(ptr, end, name_length) || (size_t)(end - ptr) < name_length)
+        {
+            return -1;
+        }
+
+        test_case.name.assign((const char *)ptr, name_length);
+        ptr += name_length;
+    }
+
+    if(read_packed_state(ptr, end, register_remap, test_case.initial_state) != 0 || read_packed_state(ptr, end, register_remap, test_case.final_state) != 0)
+    {
+        return -1;
+    }
+
+    // without --bus-access the cycles are left alone, nothing is allocated for them
+    if(keep_cycles)
+    {
+        uint32_t num_cycles = 0;
+
+        if(!read_value(ptr, end, num_cycles))
+        {
+            return -1;
+        }
+
+        test_case.cycles.resize(num_cycles);
+        for(auto &cycle : test_case.cycles)
+        {
+            uint8_t write = 0;
+
+            if(!read_value(ptr, end, cycle.address) || !read_value(ptr, end, cycle.value) || !read_value(ptr, end, write))
+            {
+                return -1;
+            }
+            cycle.write = write != 0;
+        }
+    }
+
+    return 0;
+}
+
+// writes the tests in test_params.json_filename to out, returns the number of tests or -1
+static int write_pack(TEST_PARAMS &test_params, ostream &out)
+{
+    PACK_HEADER header;
+    vector<uint64_t> offsets;
+    int result = 0;
+
+    result = get_test_registers(test_params);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    // header is rewritten once the offsets are known
+    memset(&header, 0, sizeof(header));
+    write_value(out, header);
+
+    result = get_tests(test_params, [&](TEST_CASE &test_case)
+    {
+        uint16_t name_length = min(test_case.name.size(), (size_t)UINT16_MAX);
+
+        offsets.push_back(out.tellp());
+        write_value<uint16_t>(out, name_length);
+        out.write(test_case.name.data(), name_length);
+        write_packed_state(out, test_case.initial_state, test_params.registers.size());
+        write_packed_state(out, test_case.final_state, test_params.registers.size());
+
+        if(test_params.bus_access)
+        {
+            write_value<uint32_t>(out, test_case.cycles.size());
+            for(auto &cycle : test_case.cycles)
+            {
+                write_value<uint64_t>(out, cycle.address);
+                write_value<uint8_t>(out, cycle.value);
+                write_value<uint8_t>(out, cycle.write);
+            }
+        }
+
+        return (bool)out;
+    });
+
+    if(result != 0)
+    {
+        return result;
+    }
+
+    offsets.push_back(out.tellp());
+
+    header.register_table_offset = out.tellp();
+    write_register_table(out, test_params.registers);
+
+    header.index_offset = out.tellp();
+    for(auto offset : offsets)
+    {
+        write_value<uint64_t>(out, offset);
+    }
+
+    memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_SIZE);
+    header.version = PACK_VERSION;
+    header.num_tests = offsets.size() - 1;
+    header.num_registers = test_params.registers.size();
+    header.flags = test_params.bus_access ? PACK_FLAG_CYCLES : 0;
+
+    out.seekp(0);
+    write_value(out, header);
+
+    if(!out)
+    {
+        return -1;
+    }
+
+    return header.num_tests;
+}
+
+int write_test_pack(TEST_PARAMS &test_params, const string &pack_filename)
+{
+    int num_tests = 0;
+
+    std::ofstream out(pack_filename, std::ios::binary | std::ios::trunc);
+    if(!out)
+    {
+        cout << "[-] Failed to open " << pack_filename << " for writing!" << endl;
+        return -1;
+    }
+
+    num_tests = write_pack(test_params, out);
+    if(num_tests < 0)
+    {
+        cout << "[-] Failed to write " << pack_filename << "!" << endl;
+        return -1;
+    }
+
+    cout << "[*] " << pack_filename << ": Packed " << num_tests << " test cases" << endl;
+
+    return 0;
+}
+
+// Output stream buffer writing straight into a vector, the in memory pack is built in place
+// instead of in a stringstream copied out twice. Seeking back overwrites, as write_pack()
+// does for the header
+class VectorStreamBuf : public std::streambuf
+{
+    vector<unsigned char> &contents;
+    size_t position;
+
+protected:
+    virtual std::streamsize xsputn(const char *data, std::streamsize count)
+    {
+        size_t overlap = min((size_t)count, contents.size() - position);
+
+        memcpy(contents.data() + position, data, overlap);
+        contents.insert(contents.end(), data + overlap, data + count);
+        position += count;
+
+        return count;
+    }
+
+    virtual int_type overflow(int_type c)
+    {
+        char value = traits_type::to_char_type(c);
+
+        if(traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            return traits_type::not_eof(c);
+        }
+
+        xsputn(&value, 1);
+
+        return c;
+    }
+
+    virtual pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        off_type base = dir == std::ios_base::beg ? 0 : (dir == std::ios_base::cur ? position : contents.size());
+
+        if(!(which & std::ios_base::out) || base + offset < 0 || (size_t)(base + offset) > contents.size())
+        {
+            return pos_type(off_type(-1));
+        }
+
+        position = base + offset;
+
+        return pos_type(position);
+    }
+
+    virtual pos_type seekpos(pos_type target, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(target), std::ios_base::beg, which);
+    }
+
+public:
+    VectorStreamBuf(vector<unsigned char> &output) : contents(output), position(0) {}
+};
+
+int pack_tests(TEST_PARAMS &test_params, vector<unsigned char> &contents)
+{
+    contents.clear();
+
+    VectorStreamBuf buffer(contents);
+    ostream out(&buffer);
+
+    if(write_pack(test_params, out) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int pack_json_tests(TEST_PARAMS &test_params, const string &json_filename, unique_ptr<TestPack> &pack)
+{
+    TEST_PARAMS file_params = test_params;
+    vector<unsigned char> contents;
+
+    file_params.json_filename = json_filename;
+    file_params.start_test = 0;
+    file_params.shard_index = 0;
+    file_params.shard_count = 1;
+
+    pack.reset(new TestPack());
+    if(pack_tests(file_params, contents) != 0 || pack->open(std::move(contents), json_filename) != 0 ||
+       pack->resolveRegisters(test_params, true) != 0)
+    {
+        pack.reset();
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+//--------------------------------------------------------------------------------------
+// File: pack.h
+//
+// Compact binary test corpus (.vpk). Converted once from json by verifier-pack, then
+// memory mapped by the verifier so tests can be read without parsing the whole file
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "json.h"
+#include "../state.h"
+
+// File layout, all integers in host (little endian) byte order:
+//   PACK_HEADER
+//   test records, one after the other
+//   register table: num_registers x (uint16 length, name bytes)
+//   index: num_tests + 1 uint64 file offsets of the test records, last entry is the end
+//
+// Test record: uint16 name length and name bytes (version 2 and up), then the initial
+// state followed by the final state, each state is
+//   uint16 register count, count x (uint16 register index, uint32 value)
+//   uint32 run count, count x (uint64 address, uint32 length, length bytes)
+// With PACK_FLAG_CYCLES the final state is followed by the test's memory cycles,
+//   uint32 count, count x (uint64 address, uint8 value, uint8 write)
+// Register names are already mapped through the --register-map when the pack is built.
+// Register indexes in the pack are remapped to the run's register layout on load
+#define PACK_MAGIC "VPACK\0\0\0"
+#define PACK_MAGIC_SIZE 8
+#define PACK_VERSION 2
+#define PACK_MIN_VERSION 1 // version 1 records have no names
+
+// header flags
+#define PACK_FLAG_CYCLES 1 // packed for --bus-access, records end with the test's cycles
+
+typedef struct _PACK_HEADER
+{
+    char magic[PACK_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t num_tests;
+    uint32_t num_registers;
+    uint32_t flags; // PACK_FLAG_*, 0 in packs from before there were flags
+    uint64_t register_table_offset;
+    uint64_t index_offset;
+} PACK_HEADER, *PPACK_HEADER;
+
+// Read only view of a memory mapped .vpk. Test records are decoded on demand straight
+// from the mapping, any test can be fetched by id without touching the others.
+// gzip and zstd compressed packs are decompressed into memory when opened
+class TestPack
+{
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+    vector<unsigned char> contents; // a compressed pack decompressed, instead of the mapping
+    const unsigned char *base;
+    size_t size;
+    PACK_HEADER header;
+    vector<string> register_names;
+    vector<unsigned int> register_remap; // pack register index -> test register index
+    bool keep_cycles; // the run checks bus accesses, the records' cycles are decoded
+
+    int parse(const string &pack_filename);
+
+public:
+    TestPack(void) : base(nullptr), size(0), header(), keep_cycles(false) {}
+
+    int open(const string &pack_filename);
+    int open(vector<unsigned char> &&pack_contents, const string &pack_name); // a pack built in memory
+    int resolveRegisters(TEST_PARAMS &test_params, bool discover); // also takes test_params.bus_access
+    unsigned int getNumTests(void) const { return header.num_tests; }
+    int getTest(unsigned int test_id, TEST_CASE &test_case) const;
+};
+
+// read a T from ptr and advance, false if it would go past end
+template <typename T>
+inline bool read_value(const unsigned char *&ptr, const unsigned char *end, T &value)
+{
+    if((size_t)(end - ptr) < sizeof(T))
+    {
+        return false;
+    }
+
+    memcpy(&value, ptr, sizeof(T));
+    ptr += sizeof(T);
+
+    return true;
+}
+
+template <typename T>
+inline void write_value(ostream &out, T value)
+{
+    out.write((const char *)&value, sizeof(T));
+}
+
+// Building blocks of the file format, also used by traces (trace.h). A state is decoded
+// onto what state already holds, register indexes are remapped through register_remap
+void write_packed_state(ostream &out, const TEST_STATE &state, unsigned int num_registers);
+int read_packed_state(const unsigned char *&ptr, const unsigned char *end, const vector<unsigned int> &register_remap, TEST_STATE &state);
+void write_register_table(ostream &out, const vector<string> &register_names);
+int read_register_table(const unsigned char *&ptr, const unsigned char *end, unsigned int num_registers, vector<string> &register_names);
+
+// register_remap[i] is the run's register index of register_names[i]. With discover set
+// registers the run doesn't have yet are added to it
+int resolve_packed_registers(TEST_PARAMS &test_params, const vector<string> &register_names, bool discover, vector<unsigned int> &register_remap);
+
+// true if the file starts with the .vpk magic
+bool is_test_pack(const string &filename);
+
+// convert the json tests in test_params.json_filename into a .vpk
+int write_test_pack(TEST_PARAMS &test_params, const string &pack_filename);
+
+// same, into memory
+int pack_tests(TEST_PARAMS &test_params, vector<unsigned char> &contents);
+
+// Pack a json test file in memory and open it with the test registers resolved. Packed from
+// the first test so test ids are pack indexes, the caller applies the test range and shard
+int pack_json_tests(TEST_PARAMS &test_params, const string &json_filename, unique_ptr<TestPack> &pack);
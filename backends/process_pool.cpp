@@ -0,0 +1,1185 @@
+//--------------------------------------------------------------------------------------
+// File: process_pool.cpp
+//
+// Runs the tests in forked worker processes so a crash in the emulator only loses the
+// test it was running (--isolate), with checkpoints an interrupted run can resume from
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "process_pool.h"
+#include "../result_cache.h"
+#include "../result_writers.h"
+#include "../shard.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/filesystem.hpp>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// WORKER_SLOT.current between tests
+#define NO_TEST ULLONG_MAX
+
+// how long the supervisor waits for worker output before checking on the run
+#define SUPERVISOR_POLL_MS 100
+
+// size of a single read from a worker's result pipe
+#define RESULT_READ_SIZE (64 * 1024)
+
+// tests [first_test, first_test + count * stride) of one file, run as the sequences
+// [first_sequence, first_sequence + count)
+typedef struct _TEST_RANGE
+{
+    unsigned int file_index;
+    unsigned int first_test;
+    unsigned int stride;
+    unsigned int count;
+    unsigned long long first_sequence;
+} TEST_RANGE, *PTEST_RANGE;
+
+// What a worker process is doing. Lives in shared memory so the supervisor can still read
+// it after the worker died, and the replacement worker carries on with the same chunk
+typedef struct _WORKER_SLOT
+{
+    boost::atomic<unsigned long long> current; // sequence being run, NO_TEST between tests
+    boost::atomic<unsigned long long> next; // next sequence of the claimed chunk
+    boost::atomic<unsigned long long> end; // end of the claimed chunk
+} WORKER_SLOT, *PWORKER_SLOT;
+
+// Start of the anonymous MAP_SHARED mapping every worker inherits, followed by one
+// WORKER_SLOT per worker. Everything else is shared copy on write by fork()
+typedef struct _POOL_CONTROL
+{
+    boost::atomic<unsigned long long> next_sequence; // first sequence no worker has claimed
+    boost::atomic<bool> cancelled; // workers stop before their next test
+} POOL_CONTROL, *PPOOL_CONTROL;
+
+static_assert(boost::atomic<unsigned long long>::is_always_lock_free, "shared counters must not need a lock");
+
+// the supervisor's view of a worker process
+typedef struct _WORKER_PROCESS
+{
+    pid_t pid;
+    int fd; // read end of the worker's result pipe, -1 once the worker is reaped
+    string buffer; // bytes of a result message not completely read yet
+    unsigned long long last_result; // sequence of the last result received from this slot
+    unsigned int idle_crashes; // crashes in a row outside of any test
+} WORKER_PROCESS, *PWORKER_PROCESS;
+
+// a result the supervisor has seen but the checkpoint doesn't cover yet
+typedef struct _RESOLVED_TEST
+{
+    unsigned int file_index;
+    TEST_STATUS status;
+    DIVERGENCE divergence;
+    bool reported; // see is_reported()
+    bool counted; // false if the failure budget was already spent
+    nlohmann::ordered_json record; // --summary record of a counted failure
+} RESOLVED_TEST, *PRESOLVED_TEST;
+
+// what the supervisor asks of the spawner process
+typedef enum _SPAWN_COMMAND
+{
+    SPAWN_WORKER, // fork a worker, the reply carries the read end of its result pipe
+    SPAWN_WAIT // collect a worker that has exited
+} SPAWN_COMMAND;
+
+typedef struct _SPAWN_REQUEST
+{
+    uint32_t command;
+    uint32_t worker; // SPAWN_WORKER
+    pid_t pid; // SPAWN_WAIT
+} SPAWN_REQUEST, *PSPAWN_REQUEST;
+
+typedef struct _SPAWN_REPLY
+{
+    pid_t pid; // SPAWN_WORKER, -1 if the worker couldn't be started
+    int error; // errno when it couldn't
+    int status; // SPAWN_WAIT, as waitpid() returns it
+} SPAWN_REPLY, *PSPAWN_REPLY;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt_handler(int signal_number)
+{
+    (void)signal_number;
+    interrupted = 1;
+}
+
+// an outcome and how it relates to the result cache
+static void encode_judged(string &message, const TEST_RESULT &result)
+{
+    put_value(message, result.duration_ns);
+    put_value<uint8_t>(message, result.cached);
+    put_value<uint8_t>(message, result.cacheable);
+    put_value(message, result.cache_key);
+    encode_outcome(message, result);
+}
+
+static bool decode_judged(const char *&ptr, const char *end, TEST_RESULT &result)
+{
+    uint8_t cached = 0;
+    uint8_t cacheable = 0;
+
+    if(!get_value(ptr, end, result.duration_ns) || !get_value(ptr, end, cached) || !get_value(ptr, end, cacheable) ||
+       !get_value(ptr, end, result.cache_key) || !decode_outcome(ptr, end, result))
+    {
+        return false;
+    }
+
+    result.cached = cached != 0;
+    result.cacheable = cacheable != 0;
+
+    return true;
+}
+
+// Result message, a uint32 length followed by what the supervisor can't look up in the
+// corpus itself: the test's position and its outcome, in differential mode followed by
+// the divergence and the outcome on the baseline
+static string encode_result(const TEST_RESULT &result)
+{
+    string message;
+    uint32_t length = 0;
+
+    put_value(message, length);
+    put_value(message, result.sequence);
+    put_string(message, result.name);
+    encode_judged(message, result);
+
+    put_value<uint8_t>(message, result.baseline != nullptr);
+    if(result.baseline != nullptr)
+    {
+        put_value<uint32_t>(message, result.divergence);
+        encode_judged(message, *result.baseline);
+    }
+
+    length = message.size() - sizeof(length);
+    memcpy(&message[0], &length, sizeof(length));
+
+    return message;
+}
+
+static bool decode_result(const char *ptr, const char *end, TEST_RESULT &result)
+{
+    uint8_t has_baseline = 0;
+    uint32_t divergence = 0;
+
+    if(!get_value(ptr, end, result.sequence) || !get_string(ptr, end, result.name) || !decode_judged(ptr, end, result) ||
+       !get_value(ptr, end, has_baseline))
+    {
+        return false;
+    }
+
+    if(has_baseline != 0)
+    {
+        result.baseline.reset(new TEST_RESULT());
+        if(!get_value(ptr, end, divergence) || divergence > DIVERGENCE_CHANGED || !decode_judged(ptr, end, *result.baseline))
+        {
+            return false;
+        }
+
+        result.divergence = (DIVERGENCE)divergence;
+        result.baseline->name = result.name;
+    }
+
+    return ptr == end;
+}
+
+static int write_all(int fd, const char *data, size_t length)
+{
+    while(length != 0)
+    {
+        ssize_t written = write(fd, data, length);
+
+        if(written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(written <= 0)
+        {
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// one message on the spawner socket, with a file descriptor attached unless fd is -1
+static int send_message(int sock, const void *data, size_t length, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t sent = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = (void *)data;
+    iov.iov_len = length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(fd != -1)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+    do
+    {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while(sent < 0 && errno == EINTR);
+
+    return sent == (ssize_t)length ? 0 : -1;
+}
+
+// fd is set to the attached file descriptor, -1 if there is none
+static int receive_message(int sock, void *data, size_t length, int &fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t received = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    fd = -1;
+
+    do
+    {
+        received = recvmsg(sock, &msg, 0);
+    } while(received < 0 && errno == EINTR);
+
+    for(struct cmsghdr *header = CMSG_FIRSTHDR(&msg); received > 0 && header != nullptr; header = CMSG_NXTHDR(&msg, header))
+    {
+        if(header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        }
+    }
+
+    if(received != (ssize_t)length)
+    {
+        if(fd != -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// settings and files a checkpoint is only valid for
+static nlohmann::ordered_json checkpoint_run(const TEST_PARAMS &test_params)
+{
+    nlohmann::ordered_json run = summary_run(test_params);
+
+    run["shard_index"] = test_params.shard_index;
+    run["test_files"] = test_params.test_files;
+
+    return run;
+}
+
+// Supervises the worker processes. Only the thread that calls run() touches it, the
+// workers only see the shared POOL_CONTROL and their own copy of everything else.
+// Workers are forked by a spawner process that is itself forked before the result writer
+// thread starts. A worker forked straight from the supervisor could inherit the stdout lock
+// held by the writer and hang on its first print
+class ProcessPool
+{
+    TEST_PARAMS &test_params;
+    const SlaTranslator &translator;
+    const SlaTranslator *baseline; // differential mode only
+    vector<unique_ptr<TestPack>> &packs;
+    TestRun &run;
+    ResultPipeline &results;
+    vector<TEST_RANGE> ranges;
+    unsigned long long total;
+    POOL_CONTROL *control;
+    WORKER_SLOT *slots;
+    size_t control_size;
+    pid_t supervisor;
+    pid_t spawner; // in a worker, the process that forked it
+    int spawner_fd; // supervisor's end of the spawner socket
+    vector<WORKER_PROCESS> workers;
+
+    // checkpoint state, every test before watermark has a result
+    unsigned long long watermark;
+    map<unsigned long long, RESOLVED_TEST> resolved; // results after the watermark
+    vector<FILE_COUNTS> checkpoint_counts;
+    vector<nlohmann::ordered_json> checkpoint_records;
+    unsigned int checkpoint_failures;
+
+    const TEST_RANGE &findRange(unsigned long long sequence) const;
+    int getTestCase(unsigned long long sequence, TEST_CASE &test_case) const;
+    bool claim(WORKER_SLOT &slot, unsigned long long &sequence);
+    void workerMain(unsigned int worker, int fd);
+    void spawnerMain(int sock);
+    int spawn(unsigned int worker);
+    void reap(unsigned int worker);
+    int readResults(unsigned int worker);
+    void accept(unsigned int worker, unique_ptr<TEST_RESULT> result);
+    void recordCrash(unsigned int worker, int status);
+    void resolve(const TEST_RESULT &result, bool counted);
+    int writeCheckpoint(void);
+    int restore(void);
+
+public:
+    ProcessPool(TEST_PARAMS &params, const SlaTranslator &sla_translator, const SlaTranslator *baseline_translator,
+        vector<unique_ptr<TestPack>> &test_packs, TestRun &test_run,
+        ResultPipeline &result_pipeline);
+    ~ProcessPool(void);
+
+    int load(vector<unsigned int> &loaded, unsigned int &failed_files);
+    int startSpawner(void); // after load() and before the result pipeline starts
+    int execute(void);
+    unsigned long long getTotal(void) const { return total; }
+};
+
+ProcessPool::ProcessPool(TEST_PARAMS &params, const SlaTranslator &sla_translator, const SlaTranslator *baseline_translator,
+        vector<unique_ptr<TestPack>> &test_packs, TestRun &test_run,
+    ResultPipeline &result_pipeline) :
+    test_params(params), translator(sla_translator), baseline(baseline_translator), packs(test_packs), run(test_run), results(result_pipeline), total(0),
+    control(nullptr), slots(nullptr), control_size(0), supervisor(getpid()), spawner(-1), spawner_fd(-1), watermark(0),
+    checkpoint_counts(params.test_files.size(), FILE_COUNTS()), checkpoint_failures(0)
+{
+}
+
+ProcessPool::~ProcessPool(void)
+{
+    // the spawner exits once its socket closes, any worker still left dies with it
+    if(spawner_fd != -1)
+    {
+        int status = 0;
+
+        close(spawner_fd);
+        while(waitpid(spawner, &status, 0) < 0 && errno == EINTR)
+        {
+        }
+    }
+
+    if(control != nullptr)
+    {
+        munmap(control, control_size);
+    }
+}
+
+// Json files are packed into memory, then every file is dealt into a TEST_RANGE the same
+// way load_tests() deals out a pack
+int ProcessPool::load(vector<unsigned int> &loaded, unsigned int &failed_files)
+{
+    for(unsigned int file_index = 0; file_index < test_params.test_files.size(); file_index++)
+    {
+        // the range and shard are applied below
+        if(packs[file_index] == nullptr && pack_json_tests(test_params, test_params.test_files[file_index], packs[file_index]) != 0)
+        {
+            cout << "[-] Failed to load " << test_params.test_files[file_index] << "!" << endl;
+            failed_files++;
+            continue;
+        }
+
+        const TestPack *pack = packs[file_index].get();
+        unsigned long long end_test = min(test_params.end_test, pack->getNumTests());
+        unsigned int stride = test_params.shard_by_file ? 1 : test_params.shard_count;
+        unsigned long long first_test = test_params.start_test;
+        TEST_RANGE range;
+
+        while(first_test < end_test && !test_in_shard(test_params, first_test))
+        {
+            first_test++;
+        }
+
+        range.file_index = file_index;
+        range.first_test = first_test;
+        range.stride = stride;
+        range.count = first_test < end_test ? (end_test - first_test + stride - 1) / stride : 0;
+        range.first_sequence = total;
+
+        loaded[file_index] = range.count;
+        if(range.count != 0)
+        {
+            ranges.push_back(range);
+            total += range.count;
+        }
+    }
+
+    control_size = sizeof(POOL_CONTROL) + test_params.num_threads * sizeof(WORKER_SLOT);
+    void *shared = mmap(nullptr, control_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED)
+    {
+        cout << "[-] Failed to map the worker control block: " << strerror(errno) << endl;
+        control_size = 0;
+        return -1;
+    }
+
+    control = new(shared) POOL_CONTROL();
+    control->next_sequence = 0;
+    control->cancelled = false;
+
+    slots = (WORKER_SLOT *)(control + 1);
+    for(unsigned int i = 0; i < test_params.num_threads; i++)
+    {
+        new(&slots[i]) WORKER_SLOT();
+        slots[i].current = NO_TEST;
+        slots[i].next = 0;
+        slots[i].end = 0;
+    }
+
+    return restore();
+}
+
+const TEST_RANGE &ProcessPool::findRange(unsigned long long sequence) const
+{
+    auto found = upper_bound(ranges.begin(), ranges.end(), sequence, [](unsigned long long value, const TEST_RANGE &range)
+    {
+        return value < range.first_sequence;
+    });
+
+    return *(found - 1);
+}
+
+// the test at a position in the run, its ids are set even if it can't be decoded
+int ProcessPool::getTestCase(unsigned long long sequence, TEST_CASE &test_case) const
+{
+    const TEST_RANGE &range = findRange(sequence);
+
+    test_case.test_id = range.first_test + (sequence - range.first_sequence) * range.stride;
+    test_case.file_index = range.file_index;
+    test_case.sequence = sequence;
+
+    if(packs[range.file_index]->getTest(test_case.test_id, test_case) != 0)
+    {
+        return -1;
+    }
+
+    test_case.file_index = range.file_index;
+    test_case.sequence = sequence;
+
+    return 0;
+}
+
+// worker process only. The rest of the slot's chunk first, which is left over if the
+// worker before it crashed, then a new chunk
+bool ProcessPool::claim(WORKER_SLOT &slot, unsigned long long &sequence)
+{
+    unsigned long long next = slot.next;
+
+    if(next >= slot.end)
+    {
+        next = control->next_sequence.fetch_add(ISOLATE_CHUNK_SIZE);
+        if(next >= total)
+        {
+            return false;
+        }
+
+        slot.next = next;
+        slot.end = min(next + ISOLATE_CHUNK_SIZE, total);
+    }
+
+    // current is published before next moves past it, a crash from here on is charged to this test
+    slot.current = next;
+    slot.next = next + 1;
+    sequence = next;
+
+    return true;
+}
+
+// body of a worker process, never returns
+void ProcessPool::workerMain(unsigned int worker, int fd)
+{
+    WORKER_SLOT &slot = slots[worker];
+    unsigned long long sequence = 0;
+
+    // the supervisor decides when to stop and the worker goes with it
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if(getppid() != spawner)
+    {
+        _exit(1);
+    }
+
+    while(!control->cancelled && claim(slot, sequence))
+    {
+        TEST_CASE test_case;
+        TEST_RESULT result;
+        TEST_STATE emulator_state;
+
+        if(getTestCase(sequence, test_case) != 0)
+        {
+            result.test_id = test_case.test_id;
+            result.file_index = test_case.file_index;
+            result.sequence = sequence;
+            result.status = TEST_ERROR;
+            result.error = "Corrupt test pack record";
+            result.duration_ns = 0;
+        }
+        else
+        {
+            run_test(test_params, translator, baseline, results.getResultCache(), test_case, result, emulator_state);
+            if(result.status != TEST_PASS)
+            {
+                result.emulator_state = std::move(emulator_state);
+            }
+        }
+
+        string message = encode_result(result);
+        if(write_all(fd, message.data(), message.size()) != 0)
+        {
+            _exit(1);
+        }
+
+        slot.current = NO_TEST;
+    }
+
+    // no exit handlers or stream flushes, they belong to the supervisor
+    _exit(0);
+}
+
+// Body of the spawner process, never returns. Forks a worker or collects one for every
+// request until the supervisor closes the socket. Single threaded, so its workers are too
+void ProcessPool::spawnerMain(int sock)
+{
+    SPAWN_REQUEST request;
+    int unused = -1;
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if(getppid() != supervisor)
+    {
+        _exit(1);
+    }
+
+    spawner = getpid();
+
+    while(receive_message(sock, &request, sizeof(request), unused) == 0)
+    {
+        SPAWN_REPLY reply = { -1, 0, 0 };
+        int fds[2] = { -1, -1 };
+
+        if(request.command == SPAWN_WAIT)
+        {
+            while(waitpid(request.pid, &reply.status, 0) < 0 && errno == EINTR)
+            {
+            }
+        }
+        else if(pipe(fds) != 0)
+        {
+            reply.error = errno;
+        }
+        else
+        {
+            reply.pid = fork();
+            if(reply.pid == 0)
+            {
+                // the worker only holds the write end of its own pipe
+                close(sock);
+                close(fds[0]);
+                workerMain(request.worker, fds[1]);
+            }
+
+            if(reply.pid < 0)
+            {
+                reply.error = errno;
+            }
+            close(fds[1]);
+        }
+
+        if(send_message(sock, &reply, sizeof(reply), reply.pid > 0 ? fds[0] : -1) != 0)
+        {
+            _exit(1);
+        }
+
+        if(fds[0] != -1)
+        {
+            close(fds[0]);
+        }
+    }
+
+    _exit(0);
+}
+
+int ProcessPool::startSpawner(void)
+{
+    int fds[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0)
+    {
+        cout << "[-] Failed to create the spawner socket: " << strerror(errno) << endl;
+        return -1;
+    }
+
+    // anything still buffered would be written again by a worker that prints
+    cout.flush();
+
+    pid = fork();
+    if(pid < 0)
+    {
+        cout << "[-] Failed to start the worker spawner: " << strerror(errno) << endl;
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        close(fds[0]);
+        spawnerMain(fds[1]);
+    }
+
+    close(fds[1]);
+    spawner = pid;
+    spawner_fd = fds[0];
+
+    return 0;
+}
+
+int ProcessPool::spawn(unsigned int worker)
+{
+    SPAWN_REQUEST request = { SPAWN_WORKER, worker, -1 };
+    SPAWN_REPLY reply;
+    int fd = -1;
+
+    if(send_message(spawner_fd, &request, sizeof(request), -1) != 0 || receive_message(spawner_fd, &reply, sizeof(reply), fd) != 0)
+    {
+        cout << "[-] Lost the worker spawner!" << endl;
+        return -1;
+    }
+
+    if(reply.pid < 0 || fd == -1)
+    {
+        cout << "[-] Failed to start worker " << worker << ": " << strerror(reply.error) << endl;
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    workers[worker].pid = reply.pid;
+    workers[worker].fd = fd;
+    workers[worker].buffer.clear();
+
+    return 0;
+}
+
+// the worker's pipe is at its end, collect the worker and replace it if it died
+void ProcessPool::reap(unsigned int worker)
+{
+    WORKER_PROCESS &process = workers[worker];
+    SPAWN_REQUEST request = { SPAWN_WAIT, worker, process.pid };
+    SPAWN_REPLY reply;
+    int unused = -1;
+    int status = 0;
+
+    close(process.fd);
+    process.fd = -1;
+    process.pid = -1;
+
+    // workers are the spawner's children, only it can collect them
+    if(send_message(spawner_fd, &request, sizeof(request), -1) != 0 || receive_message(spawner_fd, &reply, sizeof(reply), unused) != 0)
+    {
+        cout << "[-] Lost the worker spawner!" << endl;
+        run.cancel();
+        control->cancelled = true;
+        return;
+    }
+    status = reply.status;
+
+    // out of tests or told to stop
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        return;
+    }
+
+    recordCrash(worker, status);
+
+    if(control->cancelled)
+    {
+        return;
+    }
+
+    if(process.idle_crashes >= MAX_IDLE_CRASHES)
+    {
+        cout << "[-] Worker " << worker << " died " << process.idle_crashes << " times without running a test, stopping the run!" << endl;
+        run.cancel();
+        control->cancelled = true;
+        return;
+    }
+
+    if(spawn(worker) != 0)
+    {
+        run.cancel();
+        control->cancelled = true;
+    }
+}
+
+void ProcessPool::recordCrash(unsigned int worker, int status)
+{
+    WORKER_PROCESS &process = workers[worker];
+    unsigned long long sequence = slots[worker].current;
+    unique_ptr<TEST_RESULT> result(new TEST_RESULT());
+    TEST_CASE test_case;
+    string reason;
+
+    if(WIFSIGNALED(status))
+    {
+        reason = "Worker crashed: signal " + to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+    }
+    else
+    {
+        reason = "Worker exited with status " + to_string(WEXITSTATUS(status));
+    }
+
+    slots[worker].current = NO_TEST;
+
+    // died between tests, or after sending the result of the test it was on
+    if(sequence == NO_TEST || sequence == process.last_result)
+    {
+        process.idle_crashes++;
+        cout << "[-] Worker " << worker << " died outside of a test. " << reason << endl;
+        return;
+    }
+
+    process.idle_crashes = 0;
+    process.last_result = sequence;
+
+    // the name and states come from the corpus, the worker never got to report them
+    int decoded = getTestCase(sequence, test_case);
+
+    result->test_id = test_case.test_id;
+    result->file_index = test_case.file_index;
+    result->sequence = sequence;
+    result->name = test_case.name;
+    result->status = TEST_CRASH;
+    result->error = reason;
+    result->duration_ns = 0;
+
+    run.addCompletions(1);
+    if(!run.recordFailure())
+    {
+        resolve(*result, false);
+        return;
+    }
+
+    if(decoded == 0)
+    {
+        result->initial_state = std::move(test_case.initial_state);
+        result->expected_state = std::move(test_case.final_state);
+    }
+
+    resolve(*result, true);
+    results.submit(worker, std::move(result));
+}
+
+// read what the worker has written so far, returns -1 at the end of its output
+int ProcessPool::readResults(unsigned int worker)
+{
+    WORKER_PROCESS &process = workers[worker];
+    char block[RESULT_READ_SIZE];
+    ssize_t count = read(process.fd, block, sizeof(block));
+    size_t offset = 0;
+
+    if(count < 0 && errno == EINTR)
+    {
+        return 0;
+    }
+
+    if(count <= 0)
+    {
+        // a partial message was cut off by a crash, the test is charged with it
+        return -1;
+    }
+
+    process.buffer.append(block, count);
+
+    while(process.buffer.size() - offset >= sizeof(uint32_t))
+    {
+        uint32_t length = 0;
+
+        memcpy(&length, process.buffer.data() + offset, sizeof(length));
+        if(process.buffer.size() - offset - sizeof(length) < length)
+        {
+            break;
+        }
+
+        const char *message = process.buffer.data() + offset + sizeof(length);
+        unique_ptr<TEST_RESULT> result(new TEST_RESULT());
+
+        if(!decode_result(message, message + length, *result))
+        {
+            cout << "[-] Worker " << worker << " sent a malformed result!" << endl;
+        }
+        else
+        {
+            process.last_result = result->sequence;
+            accept(worker, std::move(result));
+        }
+
+        offset += sizeof(length) + length;
+    }
+
+    process.buffer.erase(0, offset);
+
+    return 0;
+}
+
+// the supervisor's half of execute_test()
+void ProcessPool::accept(unsigned int worker, unique_ptr<TEST_RESULT> result)
+{
+    TEST_CASE test_case;
+
+    run.addCompletions(1);
+
+    if(!is_reported(test_params, *result))
+    {
+        // ids from the corpus, the outcome itself is all the worker reports
+        const TEST_RANGE &range = findRange(result->sequence);
+
+        result->file_index = range.file_index;
+        result->test_id = range.first_test + (result->sequence - range.first_sequence) * range.stride;
+    }
+    else
+    {
+        int decoded = getTestCase(result->sequence, test_case);
+
+        result->file_index = test_case.file_index;
+        result->test_id = test_case.test_id;
+
+        if(!run.recordFailure())
+        {
+            // the run was aborted while this test was in flight
+            resolve(*result, false);
+            return;
+        }
+
+        if(decoded == 0)
+        {
+            result->initial_state = std::move(test_case.initial_state);
+            result->expected_state = std::move(test_case.final_state);
+        }
+    }
+
+    resolve(*result, true);
+    results.submit(worker, std::move(result));
+}
+
+// note a result for the checkpoint and move the watermark past every finished test
+void ProcessPool::resolve(const TEST_RESULT &result, bool counted)
+{
+    if(test_params.checkpoint_filename.empty())
+    {
+        return;
+    }
+
+    RESOLVED_TEST &entry = resolved[result.sequence];
+
+    entry.file_index = result.file_index;
+    entry.status = result.status;
+    entry.divergence = result.divergence;
+    entry.reported = is_reported(test_params, result);
+    entry.counted = counted;
+    if(counted && entry.reported && !test_params.summary_filename.empty())
+    {
+        entry.record = result_record(test_params, result);
+    }
+
+    auto next = resolved.begin();
+    while(next != resolved.end() && next->first == watermark)
+    {
+        RESOLVED_TEST &test = next->second;
+        FILE_COUNTS &counts = checkpoint_counts[test.file_index];
+
+        if(test.counted)
+        {
+            count_result(test.status, test.divergence, counts);
+
+            if(test.reported)
+            {
+                checkpoint_failures++;
+                if(!test.record.is_null())
+                {
+                    checkpoint_records.push_back(std::move(test.record));
+                }
+            }
+        }
+
+        next = resolved.erase(next);
+        watermark++;
+    }
+}
+
+// written next to the checkpoint file and renamed over it, an interrupted write never
+// leaves a half written checkpoint
+int ProcessPool::writeCheckpoint(void)
+{
+    nlohmann::ordered_json doc;
+    nlohmann::ordered_json files = nlohmann::ordered_json::array();
+    string temporary = test_params.checkpoint_filename + ".tmp";
+
+    for(auto &counts : checkpoint_counts)
+    {
+        nlohmann::ordered_json entry;
+
+        entry["passed"] = counts.passed;
+        entry["failed"] = counts.failed;
+        entry["errors"] = counts.errors;
+        entry["fixed"] = counts.fixed;
+        entry["regressed"] = counts.regressed;
+        entry["changed"] = counts.changed;
+        files.push_back(entry);
+    }
+
+    doc["version"] = CHECKPOINT_VERSION;
+    doc["run"] = checkpoint_run(test_params);
+    doc["next_sequence"] = watermark;
+    doc["failures"] = checkpoint_failures;
+    doc["files"] = files;
+    doc["failure_records"] = checkpoint_records;
+
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out << doc.dump() << '\n';
+    out.close();
+
+    if(!out || rename(temporary.c_str(), test_params.checkpoint_filename.c_str()) != 0)
+    {
+        cout << "[-] Failed to write checkpoint file " << test_params.checkpoint_filename << "!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+// --resume: skip every test the checkpoint covers and carry its counts over
+int ProcessPool::restore(void)
+{
+    nlohmann::ordered_json doc;
+
+    if(!test_params.resume)
+    {
+        return 0;
+    }
+
+    if(!boost::filesystem::exists(test_params.checkpoint_filename))
+    {
+        cout << "[*] No checkpoint in " << test_params.checkpoint_filename << ", starting from the first test" << endl;
+        return 0;
+    }
+
+    std::ifstream in(test_params.checkpoint_filename);
+
+    try
+    {
+        in >> doc;
+
+        if(doc.at("version").get<unsigned int>() != CHECKPOINT_VERSION)
+        {
+            cout << "[-] Unsupported checkpoint version in " << test_params.checkpoint_filename << "!" << endl;
+            return -1;
+        }
+
+        if(doc.at("run") != checkpoint_run(test_params) || doc.at("files").size() != checkpoint_counts.size())
+        {
+            cout << "[-] Checkpoint " << test_params.checkpoint_filename << " is from a different run!" << endl;
+            return -1;
+        }
+
+        watermark = min(doc.at("next_sequence").get<unsigned long long>(), total);
+        checkpoint_failures = doc.at("failures").get<unsigned int>();
+
+        for(unsigned int i = 0; i < checkpoint_counts.size(); i++)
+        {
+            const nlohmann::ordered_json &entry = doc.at("files")[i];
+
+            checkpoint_counts[i].passed = entry.at("passed").get<unsigned int>();
+            checkpoint_counts[i].failed = entry.at("failed").get<unsigned int>();
+            checkpoint_counts[i].errors = entry.at("errors").get<unsigned int>();
+            checkpoint_counts[i].fixed = entry.at("fixed").get<unsigned int>();
+            checkpoint_counts[i].regressed = entry.at("regressed").get<unsigned int>();
+            checkpoint_counts[i].changed = entry.at("changed").get<unsigned int>();
+        }
+
+        for(auto &record : doc.at("failure_records"))
+        {
+            checkpoint_records.push_back(record);
+        }
+    }
+    catch(nlohmann::json::exception &e)
+    {
+        cout << "[-] " << test_params.checkpoint_filename << " is not a valid checkpoint file: " << e.what() << endl;
+        return -1;
+    }
+
+    results.restore(checkpoint_counts, checkpoint_records, watermark);
+    run.restore(watermark, checkpoint_failures);
+    control->next_sequence = watermark;
+
+    cout << "[*] Resuming from " << test_params.checkpoint_filename << " at test case " << watermark << "/" << total << endl;
+
+    return 0;
+}
+
+// start the workers and supervise them until every test has a result, the run is
+// cancelled or it is interrupted. Returns -1 if the run was interrupted or a worker
+// couldn't be started
+int ProcessPool::execute(void)
+{
+    struct sigaction action;
+    struct sigaction previous_int;
+    struct sigaction previous_term;
+    auto last_checkpoint = boost::chrono::steady_clock::now();
+    int result = 0;
+
+    interrupted = 0;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupt_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous_int);
+    sigaction(SIGTERM, &action, &previous_term);
+
+    workers.resize(test_params.num_threads, WORKER_PROCESS{-1, -1, string(), NO_TEST, 0});
+    for(unsigned int i = 0; i < test_params.num_threads; i++)
+    {
+        if(spawn(i) != 0)
+        {
+            run.cancel();
+            control->cancelled = true;
+            result = -1;
+            break;
+        }
+    }
+
+    while(1)
+    {
+        vector<pollfd> fds;
+        vector<unsigned int> polled;
+
+        if(interrupted || run.isCancelled())
+        {
+            control->cancelled = true;
+        }
+
+        for(unsigned int i = 0; i < workers.size(); i++)
+        {
+            if(workers[i].fd != -1)
+            {
+                fds.push_back({workers[i].fd, POLLIN, 0});
+                polled.push_back(i);
+            }
+        }
+
+        if(fds.empty())
+        {
+            break;
+        }
+
+        if(poll(fds.data(), fds.size(), SUPERVISOR_POLL_MS) > 0)
+        {
+            for(unsigned int i = 0; i < fds.size(); i++)
+            {
+                if((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && readResults(polled[i]) != 0)
+                {
+                    reap(polled[i]);
+                }
+            }
+        }
+
+        auto now = boost::chrono::steady_clock::now();
+
+        if(!test_params.checkpoint_filename.empty() && now - last_checkpoint >= boost::chrono::milliseconds(CHECKPOINT_INTERVAL_MS))
+        {
+            writeCheckpoint();
+            last_checkpoint = now;
+        }
+    }
+
+    sigaction(SIGINT, &previous_int, nullptr);
+    sigaction(SIGTERM, &previous_term, nullptr);
+
+    if(interrupted)
+    {
+        cout << "[-] Interrupted";
+        if(!test_params.checkpoint_filename.empty() && writeCheckpoint() == 0)
+        {
+            cout << ", continue with --checkpoint " << test_params.checkpoint_filename << " --resume";
+        }
+        cout << endl;
+
+        return -1;
+    }
+
+    // a finished run, including one stopped at --max-failures, has nothing to resume
+    if(!test_params.checkpoint_filename.empty())
+    {
+        remove(test_params.checkpoint_filename.c_str());
+    }
+
+    return result;
+}
+
+int run_isolated(TEST_PARAMS &test_params, const SlaTranslator &translator, const SlaTranslator *baseline, vector<unique_ptr<TestPack>> &packs,
+    TestRun &run, ResultPipeline &results, vector<unsigned int> &loaded, unsigned int &submitted, unsigned int &failed_files)
+{
+    ProcessPool pool(test_params, translator, baseline, packs, run, results);
+
+    if(pool.load(loaded, failed_files) != 0)
+    {
+        return -1;
+    }
+    submitted = pool.getTotal();
+
+    // workers are forked from a copy of this process taken while it has no other busy threads
+    if(pool.startSpawner() != 0)
+    {
+        return -1;
+    }
+
+    // results and progress lines from here on go through the writer thread, only the
+    // supervisor still prints its own errors
+    results.setProgress([&]()
+    {
+        if(interrupted || run.isCancelled())
+        {
+            return string();
+        }
+
+        return "Test cases: " + to_string(run.getCompletions()) + "/" + to_string(pool.getTotal()) + " Fail cases: " + to_string(run.getFailures());
+    });
+    results.start();
+
+    return pool.execute();
+}
@@ -0,0 +1,38 @@
+//--------------------------------------------------------------------------------------
+// File: process_pool.h
+//
+// Runs the tests in forked worker processes so a crash in the emulator only loses the
+// test it was running (--isolate), with checkpoints an interrupted run can resume from
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "sla_emulator.h"
+#include "pack.h"
+#include "../test_run.h"
+#include "../test_results.h"
+
+// tests a worker process claims at once
+#define ISOLATE_CHUNK_SIZE 64
+
+// minimum time between checkpoints
+#define CHECKPOINT_INTERVAL_MS 1000
+
+#define CHECKPOINT_VERSION 2
+
+// crashes outside of any test in a row before a worker is not restarted again
+#define MAX_IDLE_CRASHES 3
+
+// Run every test of test_params.test_files in num_threads worker processes forked from
+// a copy of this one. Json files are converted into packs in memory first (packs[i] is null for
+// them on entry) so every test can be fetched by index from the corpus the workers
+// inherit. A worker that dies has the test it was running recorded as TEST_CRASH and is
+// replaced. loaded, submitted and failed_files are filled in the same as the threaded run
+// fills them. Starts the result pipeline itself, after restoring a checkpoint with --resume.
+// baseline is the second translator of a differential run, null otherwise
+int run_isolated(TEST_PARAMS &test_params, const SlaTranslator &translator, const SlaTranslator *baseline, vector<unique_ptr<TestPack>> &packs,
+    TestRun &run, ResultPipeline &results, vector<unsigned int> &loaded, unsigned int &submitted, unsigned int &failed_files);
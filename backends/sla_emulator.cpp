@@ -10,324 +10,1735 @@
 #include <boost/atomic.hpp>
 #include <boost/timer/timer.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
 #include <boost/asio/post.hpp>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/chrono.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/bind.hpp>
 #include <iostream>
+#include <memory>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
 #include <boost/asio/execution.hpp>
 #include "json.h"
+#include "pack.h"
+#include "trace.h"
+#include "memory_bank.h"
+#include "compressed.h"
+#include "../test_scheduler.h"
+#include "../test_run.h"
+#include "../test_results.h"
+#include "../profiler.h"
+#include "../sla_util.h"
+#include "../shard.h"
+#include "../result_cache.h"
+#include "process_pool.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 using namespace std;
 
-boost::atomic<unsigned int> failure_count = 0;
-boost::atomic<unsigned int> completed_count = 0;
+// number of consecutive tests handed to a worker at once
+#define TEST_CHUNK_SIZE 64
 
-void incrementTestFailures(void)
-{
-    failure_count++;
-}
+// maximum number of chunks waiting for a worker
+#define TEST_QUEUE_CHUNKS 64
 
-unsigned int getTestFailures(void)
-{
-    return failure_count;
-}
+// RAM accesses one instruction may make with --bus-access, the log never grows past it
+#define BUS_LOG_SIZE 256
 
-void incrementTestCompletions(void)
+// A run of consecutive tests from one file. Tests parsed from json are carried in the chunk.
+// Tests in a pack are only an index range, the worker decodes them straight from the shared
+// mapping. In a matrix run every variant is dealt its own chunks of the same pack
+typedef struct _TEST_CHUNK
 {
-    completed_count++;
-}
+    unsigned int file_index;
+    unsigned int variant; // the translator the tests run on, 0 unless in a matrix
+    unsigned int first_test;
+    unsigned int test_stride; // pack tests are first_test, first_test + test_stride, ...
+    unsigned long long first_sequence;
+    unsigned int num_tests;
+    const TestPack *pack; // null for json tests
+    vector<TEST_CASE> tests;
+} TEST_CHUNK, *PTEST_CHUNK;
 
-unsigned int getTestCompletions(void)
-{
-    return completed_count;
-}
+typedef TestScheduler<TEST_CHUNK> TEST_SCHEDULER;
 
-int execute_test(TEST_PARAMS& test_params, unsigned int test_id, TEST_STATE initial_state, TEST_STATE final_state, DocumentStorage docstorage);
+boost::atomic<unsigned int> load_error_count = 0;
+
+int execute_test(TEST_PARAMS& test_params, const SlaTranslator *translator, const SlaTranslator *baseline, TestRun *run, ResultPipeline *results,
+    unsigned int worker, TEST_CASE &test_case);
 
 // This is a tiny LoadImage class which feeds the executable bytes to the translator
 class MyLoadImage : public LoadImage {
-    map<unsigned long long, unsigned char>* address_space;
+    TestMemoryBank *ram;
 
 public:
-    MyLoadImage(map<unsigned long long, unsigned char>* loader_address_space) : LoadImage("nofile") { address_space = loader_address_space; }
+    MyLoadImage(void) : LoadImage("nofile"), ram(nullptr) {}
+    void setMemory(TestMemoryBank *loader_ram) { ram = loader_ram; }
     virtual void loadFill(uint1 *ptr,int4 size,const Address &addr);
     virtual string getArchType(void) const { return "myload"; }
     virtual void adjustVma(long adjust) { }
 };
 
-// This is the only important method for the LoadImage. It returns bytes from the static array
-// depending on the address range requested
+// This is the only important method for the LoadImage. Instructions are fetched from the same
+// RAM bank the emulator uses. Without a bank (the startup translator) memory reads as zero
 void MyLoadImage::loadFill(uint1 *ptr, int4 size, const Address &addr)
 {
-    uintb start = addr.getOffset();
+    if(ram == nullptr)
+    {
+        memset(ptr, 0, size);
+        return;
+    }
 
-    for(int4 i = 0; i < size; i++)
+    ram->read(addr.getOffset(), ptr, size);
+}
+
+// Hashes the p-code an instruction translates to for the result cache
+class FingerprintEmit : public PcodeEmit
+{
+    ResultHasher &hasher;
+
+    void addVarnode(const VarnodeData &vn)
     {
-        uint1 value = 0;
+        hasher.add<int4>(vn.space->getIndex());
+        hasher.add<uintb>(vn.offset);
+        hasher.add<uint4>(vn.size);
+    }
 
-        uintb cur_offset = start + i;
+public:
+    FingerprintEmit(ResultHasher &result_hasher) : hasher(result_hasher) {}
 
-        // TODO: cur_offset really should be modulus the size of the address space
+    virtual void dump(const Address &addr, OpCode opc, VarnodeData *outvar, VarnodeData *vars, int4 isize)
+    {
+        hasher.add<uintb>(addr.getOffset());
+        hasher.add<int4>(opc);
+        hasher.add<bool>(outvar != nullptr);
+        if(outvar != nullptr)
+        {
+            addVarnode(*outvar);
+        }
 
-        // default to zero for addresses not in our map
-        if(address_space->find(cur_offset) != address_space->end())
+        hasher.add(isize);
+        for(int4 i = 0; i < isize; i++)
         {
-            value = (*address_space)[cur_offset];
+            addVarnode(vars[i]);
         }
+    }
+};
+
+// Emulator that records every byte of RAM an instruction's LOAD and STORE p-code touches,
+// in order, into a ring allocated once with the worker's context. It is only built with
+// --bus-access, otherwise the plain EmulatePcodeCache runs and loads and stores cost nothing extra
+class BusLoggingEmulator : public EmulatePcodeCache
+{
+    AddrSpace *ram;
+    BUS_ACCESS accesses[BUS_LOG_SIZE]; // a count past BUS_LOG_SIZE overwrote the oldest
+    unsigned int count;
+
+protected:
+    virtual void executeLoad(void);
+    virtual void executeStore(void);
+
+public:
+    BusLoggingEmulator(Translate *t, MemoryState *s, BreakTable *b, AddrSpace *ram_space) : EmulatePcodeCache(t, s, b), ram(ram_space), count(0) {}
+
+    void clear(void) { count = 0; }
+    void record(uintb address, int4 size, bool write);
+    const BUS_ACCESS *getAccesses(unsigned int &access_count) const { access_count = count; return accesses; }
+};
+
+// values are read back from RAM after the access, multi-byte accesses are logged a byte at a time in address order
+void BusLoggingEmulator::record(uintb address, int4 size, bool write)
+{
+    for(int4 i = 0; i < size; i++)
+    {
+        BUS_ACCESS &access = accesses[count++ % BUS_LOG_SIZE];
 
-        ptr[i] = value;
+        access.address = ram->wrapOffset(address + i);
+        access.value = memstate->getValue(ram, access.address, 1);
+        access.write = write;
     }
 }
 
-int sla_emulate(TEST_PARAMS &test_params, TEST_STATE &initial_state, TEST_STATE &final_state, DocumentStorage docstorage)
+void BusLoggingEmulator::executeLoad(void)
 {
-    map<unsigned long long, unsigned char> address_space; // represents the emulators address space
+    // the address is read first, the load's output may overwrite it
+    AddrSpace *space = currentOp->getInput(0)->getSpaceFromConst();
+    uintb offset = AddrSpace::addressToByte(memstate->getValue(currentOp->getInput(1)), space->getWordSize());
+    int4 size = currentOp->getOutput()->size;
 
-    // Set up the context object
-    ContextInternal context;
+    EmulateMemory::executeLoad();
 
-    // set initial memory
-    for (const auto & [address, value] : initial_state.memory)
+    if(space == ram)
+    {
+        record(offset, size, false);
+    }
+}
+
+void BusLoggingEmulator::executeStore(void)
+{
+    AddrSpace *space = currentOp->getInput(0)->getSpaceFromConst();
+    uintb offset = AddrSpace::addressToByte(memstate->getValue(currentOp->getInput(1)), space->getWordSize());
+
+    EmulateMemory::executeStore();
+
+    if(space == ram)
+    {
+        record(offset, currentOp->getInput(2)->size, true);
+    }
+}
+
+// Per-worker emulator state. Building the Sleigh translator, memory banks and emulator
+// is far more expensive than executing a single instruction, so each worker thread builds
+// one context and resets it between tests
+class SlaEmulatorContext
+{
+    MyLoadImage loader;
+    DocumentStorage docstorage; // refers to the shared .sla DOM, owns nothing
+    const SlaTranslator *bound_translator;
+    vector<VarnodeData> register_varnodes; // indexed by register index
+    VarnodeData pc_varnode;
+    ResultHasher layout; // address spaces and test registers, the start of every result cache key
+    const TEST_STATE *prepared; // initial state fingerprint() already loaded, null if none
+
+    // declared in construction order, destroyed in reverse
+    unique_ptr<ContextInternal> context;
+    unique_ptr<CachingSleigh> trans;
+    unique_ptr<TestMemoryBank> ramstate; // represents the emulators address space
+    unique_ptr<TestMemoryBank> registerstate;
+    unique_ptr<TestMemoryBank> tmpstate;
+    unique_ptr<MemoryState> memstate;
+    unique_ptr<BreakTableCallBack> breaktable;
+    unique_ptr<EmulatePcodeCache> emulator;
+    BusLoggingEmulator *bus_emulator; // the emulator with --bus-access, null otherwise
+
+    void reset(void);
+
+public:
+    SlaEmulatorContext(void) : bound_translator(nullptr), prepared(nullptr), bus_emulator(nullptr) {}
+    bool isInitialized(const SlaTranslator &translator) const { return trans != nullptr && bound_translator == &translator; }
+    bool isBoundTo(const SlaTranslator *translator) const { return bound_translator == translator; }
+    int initialize(TEST_PARAMS &test_params, const SlaTranslator &translator);
+    int prepare(TEST_PARAMS &test_params, const TEST_STATE &state, bool clean = true);
+    int execute(TEST_PARAMS &test_params, TEST_STATE &final_state, string &exception_type, string &exception_message);
+    int emulate(TEST_PARAMS &test_params, TEST_STATE &initial_state, TEST_STATE &final_state, string &exception_type, string &exception_message);
+    int fingerprint(TEST_PARAMS &test_params, const TEST_CASE &test_case, RESULT_KEY &key);
+
+    // RAM accesses of the last instruction executed, --bus-access only
+    const BUS_ACCESS *getBusAccesses(unsigned int &count) const { return bus_emulator->getAccesses(count); }
+};
+
+// one time setup of the translator and emulator for this worker
+int SlaEmulatorContext::initialize(TEST_PARAMS &test_params, const SlaTranslator &translator)
+{
+    PROFILE_SCOPE(PHASE_CONTEXT_INIT);
+
+    // tear down anything bound to a previous translator
+    bus_emulator = nullptr;
+    emulator.reset();
+    breaktable.reset();
+    memstate.reset();
+    loader.setMemory(nullptr);
+    tmpstate.reset();
+    registerstate.reset();
+    ramstate.reset();
+    trans.reset();
+    context.reset();
+
+    docstorage = DocumentStorage();
+    docstorage.registerTag(translator.getRoot());
+    bound_translator = &translator;
+
+    try
+    {
+        context.reset(new ContextInternal());
+        trans.reset(new CachingSleigh(&loader, context.get(), &docstorage,
+            test_params.translation_cache ? translator.getTranslationCache() : nullptr));
+        trans->initialize(docstorage); // Initialize the translator
+
+        // resolve the registers once, tests are then loaded and read back by index
+        register_varnodes.clear();
+        for (auto &register_name : test_params.registers)
+        {
+            register_varnodes.push_back(trans->getRegister(register_name));
+        }
+        pc_varnode = trans->getRegister(test_params.program_counter);
+
+        // everything besides the instruction's p-code and the test's states that an
+        // outcome depends on
+        layout = ResultHasher();
+        layout.add<uint32_t>(RESULT_CACHE_VERSION);
+        for(int4 i = 0; i < trans->numSpaces(); i++)
+        {
+            AddrSpace *space = trans->getSpace(i);
+            if(space == nullptr)
+            {
+                continue;
+            }
+
+            layout.add(space->getName());
+            layout.add<int4>(space->getIndex());
+            layout.add<int4>(space->getAddrSize());
+            layout.add<int4>(space->getWordSize());
+            layout.add<bool>(space->isBigEndian());
+        }
+
+        for(unsigned int i = 0; i < register_varnodes.size(); i++)
+        {
+            layout.add(test_params.registers[i]);
+            layout.add<int4>(register_varnodes[i].space->getIndex());
+            layout.add<uintb>(register_varnodes[i].offset);
+            layout.add<uint4>(register_varnodes[i].size);
+            layout.add(test_params.register_masks[i]);
+        }
+        layout.add<uintb>(pc_varnode.offset);
+        layout.add<uint4>(pc_varnode.size);
+
+        // Set up memory state object. The banks are reused for every test, reset() only
+        // clears what the previous test wrote
+        ramstate.reset(new TestMemoryBank(trans->getDefaultCodeSpace()));
+        registerstate.reset(new TestMemoryBank(trans->getSpaceByName("register")));
+        tmpstate.reset(new TestMemoryBank(trans->getUniqueSpace()));
+        loader.setMemory(ramstate.get());
+
+        memstate.reset(new MemoryState(trans.get()));
+        memstate->setMemoryBank(ramstate.get());
+        memstate->setMemoryBank(registerstate.get());
+        memstate->setMemoryBank(tmpstate.get());
+        reset();
+
+        breaktable.reset(new BreakTableCallBack(trans.get())); // Set up the callback object
+        // Set up the emulator
+        if(test_params.bus_access)
+        {
+            bus_emulator = new BusLoggingEmulator(trans.get(), memstate.get(), breaktable.get(), trans->getDefaultCodeSpace());
+            emulator.reset(bus_emulator);
+        }
+        else
+        {
+            emulator.reset(new EmulatePcodeCache(trans.get(), memstate.get(), breaktable.get()));
+        }
+    }
+    catch(LowlevelError &e)
     {
-        address_space[address] = value;
+        cout << "[-] Failed to initialize emulator: " << e.explain << endl;
+        trans.reset();
+        return -1;
     }
 
-    MyLoadImage loader(&address_space);
-    Sleigh trans(&loader, &context);
+    return 0;
+}
+
+// return the emulator to a clean state between tests
+void SlaEmulatorContext::reset(void)
+{
+    PROFILE_SCOPE(PHASE_RESET);
+
+    // clear RAM, register and unique banks
+    ramstate->reset();
+    registerstate->reset();
+    tmpstate->reset();
 
-    trans.initialize(docstorage); // Initialize the translator
+    // fresh context so context changes made by the previous instruction don't leak.
+    // resetting the translator also drops its disassembly cache which would otherwise
+    // hold the previous test's instruction bytes. The .sla is only decoded once, re-initializing
+    // after a reset just re-registers the context variables
+    unique_ptr<ContextInternal> new_context(new ContextInternal());
+    trans->resetCaching(&loader, new_context.get());
+    context = std::move(new_context);
+    trans->initialize(docstorage);
+}
+
+// Reset and load a test's initial state. Without clean the state is written over whatever
+// the emulator holds, a trace resynchronizes the emulator this way after a failed step
+int SlaEmulatorContext::prepare(TEST_PARAMS &test_params, const TEST_STATE &initial_state, bool clean)
+{
+    if(clean)
+    {
+        reset();
+    }
 
-    // Set up memory state object
-    // TODO: get page size dynamically
-    MemoryImage loadmemory(trans.getDefaultCodeSpace(), test_params.word_size, 4096, &loader);
-    MemoryPageOverlay ramstate(trans.getDefaultCodeSpace(), test_params.word_size, 4096, &loadmemory);
-    MemoryHashOverlay registerstate(trans.getSpaceByName("register"), test_params.word_size, 4096, 4096, (MemoryBank *)0);
-    MemoryHashOverlay tmpstate(trans.getUniqueSpace(), test_params.word_size, 4096, 4096, (MemoryBank *)0);
+    PROFILE_SCOPE(PHASE_STATE_LOAD);
 
-    // Instantiate the memory state object
-    MemoryState memstate(&trans);
-    memstate.setMemoryBank(&ramstate);
-    memstate.setMemoryBank(&registerstate);
-    memstate.setMemoryBank(&tmpstate);
+    // set initial memory
+    ramstate->load(initial_state.memory.addresses, initial_state.memory.values);
 
     // set initial registers
-    for (const auto & [register_name, value] : initial_state.registers)
+    for (unsigned int i = 0; i < register_varnodes.size(); i++)
     {
+        if(!(initial_state.register_mask & (1ULL << i)))
+        {
+            continue;
+        }
+
+        const VarnodeData &vn = register_varnodes[i];
         try
         {
-            memstate.setValue(register_name.c_str(), value);
+            memstate->setValue(vn.space, vn.offset, vn.size, initial_state.registers[i]);
         } catch(...)
         {
-            cout << "[-] Failed to set emulator register " << register_name << "! Do you need to set a register map?" << endl;
+            cout << "[-] Failed to set emulator register " << test_params.registers[i] << "!" << endl;
             return -1;
         }
     }
 
-    BreakTableCallBack breaktable(&trans); // Set up the callback object
-    EmulatePcodeCache emulator(&trans, &memstate, &breaktable); // Set up the emulator
+    return 0;
+}
+
+// Result cache key of a test: the layout, the p-code its instruction translates to and its
+// states. Leaves the test loaded so emulate() doesn't load it again
+int SlaEmulatorContext::fingerprint(TEST_PARAMS &test_params, const TEST_CASE &test_case, RESULT_KEY &key)
+{
+    PROFILE_SCOPE(PHASE_FINGERPRINT);
+    ResultHasher hasher = layout;
+    FingerprintEmit emit(hasher);
+
+    prepared = nullptr;
+    if(prepare(test_params, test_case.initial_state) != 0)
+    {
+        return -1;
+    }
+
+    try
+    {
+        Address pc(trans->getDefaultCodeSpace(), memstate->getValue(pc_varnode.space, pc_varnode.offset, pc_varnode.size));
+        hasher.add<int4>(trans->oneInstruction(emit, pc));
+    }
+    catch(LowlevelError &e)
+    {
+        // bytes that don't decode fail the same way until the .sla decodes them differently
+        hasher.add(e.explain);
+    }
+
+    hasher.addState(test_case.initial_state);
+    hasher.addState(test_case.final_state);
+
+    // the outcome also depends on the cycles, keys without --bus-access stay as they were
+    if(test_params.bus_access)
+    {
+        hasher.add<uint32_t>(test_case.cycles.size());
+        for(auto &cycle : test_case.cycles)
+        {
+            hasher.add<unsigned long long>(cycle.address);
+            hasher.add<unsigned char>(cycle.value);
+            hasher.add<bool>(cycle.write);
+        }
+    }
+
+    key = hasher.getKey();
+    prepared = &test_case.initial_state;
+
+    return 0;
+}
+
+int SlaEmulatorContext::emulate(TEST_PARAMS &test_params, TEST_STATE &initial_state, TEST_STATE &final_state, string &exception_type, string &exception_message)
+{
+    // fingerprint() may have loaded this test already
+    if(prepared != &initial_state && prepare(test_params, initial_state) != 0)
+    {
+        prepared = nullptr;
+        return -1;
+    }
+    prepared = nullptr;
+
+    return execute(test_params, final_state, exception_type, exception_message);
+}
 
+// Execute the instruction at the program counter in whatever state the emulator is in and
+// read back the registers final_state lists and every byte of memory that was written.
+// The emulator is left in the state the instruction produced, the next call continues from it
+int SlaEmulatorContext::execute(TEST_PARAMS &test_params, TEST_STATE &final_state, string &exception_type, string &exception_message)
+{
     try
     {
-        emulator.setExecuteAddress(Address(trans.getDefaultCodeSpace(), memstate.getValue(test_params.program_counter.c_str())));
+        emulator->setExecuteAddress(Address(trans->getDefaultCodeSpace(), memstate->getValue(pc_varnode.space, pc_varnode.offset, pc_varnode.size)));
+
+        unsigned int pc = emulator->getExecuteAddress().getOffset();
+        emulator->setHalt(false);
+        ramstate->setWriteLogging(true);
 
-        unsigned int pc = emulator.getExecuteAddress().getOffset();
-        emulator.setHalt(false);
+        if(bus_emulator != nullptr)
+        {
+            // the fetch isn't p-code, the instruction's bytes are the first reads. Bytes that
+            // don't decode throw again from executeInstruction()
+            bus_emulator->clear();
+            try
+            {
+                bus_emulator->record(pc, trans->instructionLength(emulator->getExecuteAddress()), false);
+            }
+            catch(LowlevelError &e)
+            {
+            }
+        }
         try
         {
-            emulator.executeInstruction();
+            PROFILE_SCOPE(PHASE_EXECUTE);
+            emulator->executeInstruction();
+        }
+        catch(UnimplError &e)
+        {
+            // p-code the emulator can't execute, e.g. a CALLOTHER without a handler
+            exception_type = "UnimplError";
+            exception_message = e.explain;
+        }
+        catch(BadDataError &e)
+        {
+            // the bytes don't decode to an instruction
+            exception_type = "BadDataError";
+            exception_message = e.explain;
+        }
+        catch(LowlevelError &e)
+        {
+            exception_type = "LowlevelError";
+            exception_message = e.explain;
         }
         catch(...)
         {
-            // TODO: document this exception
+            exception_type = "unknown";
         }
+        ramstate->setWriteLogging(false);
 
-        emulator.setHalt(true);
+        emulator->setHalt(true);
 
-        pc = emulator.getExecuteAddress().getOffset();
-        memstate.setValue(test_params.program_counter.c_str(), pc);
+        pc = emulator->getExecuteAddress().getOffset();
+        memstate->setValue(pc_varnode.space, pc_varnode.offset, pc_varnode.size, pc);
     }
     catch(...)
     {
         // TODO: document this exception
     }
 
-    // record final register state
-    for (const auto & [register_name, value] : initial_state.registers)
+    PROFILE_SCOPE(PHASE_READBACK);
+
+    // record final register state, final_state lists the registers to read back
+    for (unsigned int i = 0; i < register_varnodes.size(); i++)
     {
-        final_state.registers[register_name] = memstate.getValue(register_name);
+        if(final_state.register_mask & (1ULL << i))
+        {
+            const VarnodeData &vn = register_varnodes[i];
+            final_state.registers[i] = memstate->getValue(vn.space, vn.offset, vn.size);
+        }
     }
 
-    // set initial memory
-    for (const auto & [address, value] : final_state.memory)
+    // every address the instruction wrote is read back, so writes outside of the expected
+    // final state show up in the diff without scanning the address space
+    for (auto address : ramstate->getWriteLog())
     {
-        final_state.memory[address] = memstate.getValue(trans.getDefaultCodeSpace(), address, 1);
+        add_memory(final_state, address, 0);
     }
+    sort_memory(final_state);
 
-    /*
-    // method to search entire address space
-    for(unsigned int address = 0; address < 0x10000; address++)
+    // record final memory state
+    for (size_t i = 0; i < final_state.memory.size(); i++)
     {
-        unsigned val = 0;
-
-        val = memstate.getValue(trans.getDefaultCodeSpace(), address, 1);
-
-        //cout << "adddress " << address << val << endl;
-        if(val != 0)
-        {
-
-        }
+        final_state.memory.values[i] = memstate->getValue(trans->getDefaultCodeSpace(), final_state.memory.addresses[i], 1);
     }
-    */
 
     return 0;
 }
 
-int parallelize_test(TEST_PARAMS& test_params)
+// Open and parse the .sla. Only done once per run, workers read the DOM concurrently
+// but never modify it. Word size and registers come from the translator decoded here,
+// the file isn't parsed a second time
+int SlaTranslator::load(const string &sla_filename)
 {
-    boost::timer::auto_cpu_timer t;
-    vector<TEST_STATE> initial_states;
-    vector<TEST_STATE> final_states;
-    unsigned int completed_count = 0;
-    unsigned int fail_count = 0;
-    boost::asio::thread_pool thread_pool(test_params.num_threads);
-    unsigned int cases_submitted = 0;
-    int result = 0;
+    static boost::once_flag ids_initialized = BOOST_ONCE_INIT;
+    SLA_FORMAT format = SLA_FORMAT_XML;
+    int version = 0;
 
-    result = get_tests(test_params, initial_states, final_states);
-    if(result != 0)
+    if(sla_get_format(sla_filename, format, version) != 0)
     {
-        cout << "[-] Failed to load unit tests!" << endl;
         return -1;
     }
 
-    cout << "[*] " << test_params.json_filename << ": Loaded " << initial_states.size() << " test cases" << endl;
-
-    // can't have end test greater than the number of total tests
-    if(test_params.end_test >= initial_states.size())
+#ifdef SLA_COMPRESSED_FORMAT
+    if(format == SLA_FORMAT_XML)
+    {
+        cout << "[-] " << sla_filename << " is an XML .sla (sleigh version " << version << "), this build reads compressed .sla files" << endl;
+        cout << "[-] Recompile it with the sleigh from the same Ghidra as libsla" << endl;
+        return -1;
+    }
+#else
+    if(format == SLA_FORMAT_COMPRESSED)
     {
-        test_params.end_test = initial_states.size();
+        cout << "[-] " << sla_filename << " is a compressed .sla (format version " << version << ") from Ghidra 11.1 or later" << endl;
+        cout << "[-] Rebuild the verifier against that Ghidra's libsla" << endl;
+        return -1;
     }
-    cout << "[*] Test Range: "  << test_params.start_test << "-" << test_params.end_test << endl;
+#endif
 
+    boost::call_once(ids_initialized, []()
+    {
+        AttributeId::initialize();
+        ElementId::initialize();
+    });
 
-    AttributeId::initialize();
-    ElementId::initialize();
+    try
+    {
+#ifdef SLA_COMPRESSED_FORMAT
+        // a <sleigh> tag naming the file. Each worker's translator decodes the file once
+        // when it is first initialized
+        string escaped;
+        for(char c : sla_filename)
+        {
+            escaped += c == '&' ? "&amp;" : c == '<' ? "&lt;" : string(1, c);
+        }
+        istringstream document("<sleigh>" + escaped + "</sleigh>");
+        sleighroot = docstorage.parseDocument(document)->getRoot();
+#else
+        // Read sleigh file into DOM
+        sleighroot = docstorage.openDocument(sla_filename)->getRoot();
+#endif
 
-    // Read sleigh file into DOM
-    DocumentStorage docstorage;
-    Element *sleighroot = docstorage.openDocument(test_params.sla_filename)->getRoot();
+        loader.reset(new MyLoadImage());
+        context.reset(new ContextInternal());
+        trans.reset(new Sleigh(loader.get(), context.get()));
+        trans->initialize(docstorage);
 
-    // TODO: improve performance of loop
-    for(unsigned int i = test_params.start_test; i < test_params.end_test; i++)
+        word_size = trans->getDefaultCodeSpace()->getAddrSize();
+    }
+    catch(LowlevelError &e)
     {
-        // TODO: DocumentStorage needs to be copied or crashes will happen...
-        DocumentStorage docstorage2;
-        docstorage2.registerTag(sleighroot);
-
-        boost::asio::post(thread_pool, boost::bind(execute_test, test_params, i, initial_states[i], final_states[i], docstorage2));
-        cases_submitted++;
+        cout << "[-] Failed to parse " << sla_filename << ": " << e.explain << endl;
+        return -1;
     }
-    cout << "[*] Done posting tests" << endl;
 
-    // TODO: improve poll logic
-    while(1)
+    return 0;
+}
+
+bool SlaTranslator::hasRegister(const string &register_name) const
+{
+    try
+    {
+        trans->getRegister(register_name);
+    }
+    catch(LowlevelError &e)
     {
-        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        return false;
+    }
 
-        completed_count = getTestCompletions();
-        fail_count = getTestFailures();
+    return true;
+}
+
+// fail fast if the register map, the tests or the program counter name registers the .sla doesn't have
+int SlaTranslator::validateRegisters(TEST_PARAMS &test_params) const
+{
+    int result = 0;
 
-        cout << "Test cases: " << completed_count << "/" << cases_submitted  << " Fail cases: " << fail_count << endl;
+    for (const auto & [test_register, ghidra_register] : test_params.register_map)
+    {
+        if(!hasRegister(ghidra_register))
+        {
+            cout << "[-] Register map entry " << test_register << "=" << ghidra_register << " is not a register in the .sla!" << endl;
+            result = -1;
+        }
+    }
 
-        // check if we exceeded our max number of failures
-        if(fail_count >= test_params.max_failures)
+    for (unsigned int i = 0; i < test_params.registers.size(); i++)
+    {
+        if(!hasRegister(test_params.registers[i]))
         {
-            // abort the rest of the threads
-            thread_pool.stop();
-            break;
+            cout << "[-] Test register " << test_params.registers[i] << " is not a register in the .sla! Do you need to set a register map?" << endl;
+            result = -1;
+            continue;
         }
 
-        // check if we finished our submitted jobs
-        if(completed_count >= cases_submitted)
+        // values are compared at the register's width, an 8 bit register holding 0x1FF passes
+        // a test that expects 0xFF
+        int4 size = trans->getRegister(test_params.registers[i]).size;
+        if(size < (int4)sizeof(unsigned int))
         {
-            // finished
-            break;
+            test_params.register_masks[i] = (1U << (size * 8)) - 1;
         }
     }
 
-    // wait for threads to finish
-    // should be quick as we exited the polling loop
-    thread_pool.join();
-
-    cout << "Cases submitted " << cases_submitted  << endl;
-    cout << "Completed cases " << getTestCompletions() << endl;
-    cout << "Fail cases " << getTestFailures() << endl;
+    if(!hasRegister(test_params.program_counter))
+    {
+        cout << "[-] Program counter " << test_params.program_counter << " is not a register in the .sla!" << endl;
+        result = -1;
+    }
 
-    return 0;
+    return result;
 }
 
-int execute_test(TEST_PARAMS& test_params, unsigned int test_id, TEST_STATE initial_state, TEST_STATE final_state, DocumentStorage docstorage)
+// each worker thread keeps an emulator context per translator alive between tests, a
+// differential or matrix run switches translators and must not rebuild them each time
+static SlaEmulatorContext &get_emulator_context(const SlaTranslator &translator)
 {
-    TEST_STATE emu_final_state;
-    unsigned int fail_count = 0;
-    int result = 0;
+    static thread_local vector<unique_ptr<SlaEmulatorContext>> emulator_contexts;
 
-    // check if we hit the max number of test failures
-    fail_count = getTestFailures();
-    if(fail_count >= test_params.max_failures)
+    for(auto &emulator_context : emulator_contexts)
     {
-        // hit max failures, just return
-        return 0;
+        if(emulator_context->isBoundTo(&translator))
+        {
+            return *emulator_context;
+        }
     }
 
-    incrementTestCompletions();
+    emulator_contexts.emplace_back(new SlaEmulatorContext());
+
+    return *emulator_contexts.back();
+}
+
+int sla_emulate(TEST_PARAMS &test_params, const SlaTranslator &translator, TEST_STATE &initial_state, TEST_STATE &final_state,
+    string &exception_type, string &exception_message)
+{
+    SlaEmulatorContext &emulator_context = get_emulator_context(translator);
+    int result = 0;
 
-    for (const auto & [address, value] : final_state.memory)
+    if(!emulator_context.isInitialized(translator))
     {
-        emu_final_state.memory[address] = 0;
+        result = emulator_context.initialize(test_params, translator);
+        if(result != 0)
+        {
+            return result;
+        }
     }
 
-    try
+    return emulator_context.emulate(test_params, initial_state, final_state, exception_type, exception_message);
+}
+
+static int sla_fingerprint(TEST_PARAMS &test_params, const SlaTranslator &translator, const TEST_CASE &test_case, RESULT_KEY &key)
+{
+    SlaEmulatorContext &emulator_context = get_emulator_context(translator);
+    int result = 0;
+
+    if(!emulator_context.isInitialized(translator))
     {
-        result = sla_emulate(test_params, initial_state, emu_final_state,  docstorage);
+        result = emulator_context.initialize(test_params, translator);
         if(result != 0)
         {
-            cout << "[-] Fatal emulation error!" << endl;
             return result;
         }
     }
-    catch(BadDataError &e)
+
+    return emulator_context.fingerprint(test_params, test_case, key);
+}
+
+// RAM accesses of the last test this worker ran on translator, --bus-access only
+static const BUS_ACCESS *sla_bus_accesses(const SlaTranslator &translator, unsigned int &count)
+{
+    return get_emulator_context(translator).getBusAccesses(count);
+}
+
+// bind the calling thread to the nth CPU this process may run on
+static void pin_worker(unsigned int worker)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    cpu_set_t target;
+    int count = 0;
+
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
     {
-        cout << "[-] BadDataError: " << e.explain << endl;
-        return -1;
+        return;
     }
 
-    result = compare_state(final_state, emu_final_state);
-    if(result != 0)
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
     {
-        // TODO: output failure
-        cout << "[-] " << test_id << ") FAIL" << endl;
-
-        cout << "Initial State:" << endl;
-        print_state(initial_state);
-        cout << endl;
+        if(!CPU_ISSET(cpu, &allowed))
+        {
+            continue;
+        }
 
-        cout << "Final (Expected) State:" << endl;
-        print_state(final_state);
-        cout << endl;
+        if(count++ == (int)(worker % CPU_COUNT(&allowed)))
+        {
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+            return;
+        }
+    }
+#else
+    (void)worker;
+#endif
+}
 
-        cout << "Emulator:" << endl;
-        print_state(emu_final_state);
-        cout << endl;
+// worker loop, runs chunks of tests until the loader is done or the run is aborted
+void test_worker(TEST_PARAMS& test_params, const vector<unique_ptr<SlaTranslator>> *translators, const SlaTranslator *baseline,
+    TEST_SCHEDULER *scheduler, TestRun *run, ResultPipeline *results, unsigned int worker)
+{
+    TEST_CHUNK chunk;
+    TEST_CASE test_case;
 
-        incrementTestFailures();
+    if(test_params.pin_threads)
+    {
+        pin_worker(worker);
     }
-    else
+
+    while(scheduler->pop(worker, chunk))
     {
-        cout << "[+] " << test_id << ") SUCCESS" << endl;
+        unsigned int completed = 0;
+
+        for(unsigned int i = 0; i < chunk.num_tests; i++)
+        {
+            // checked between tests so an abort takes effect within one test
+            if(run->isCancelled())
+            {
+                break;
+            }
+
+            if(chunk.pack != nullptr)
+            {
+                if(chunk.pack->getTest(chunk.first_test + i * chunk.test_stride, test_case) != 0)
+                {
+                    unique_ptr<TEST_RESULT> result(new TEST_RESULT());
+
+                    result->test_id = chunk.first_test + i * chunk.test_stride;
+                    result->file_index = chunk.file_index;
+                    result->variant = chunk.variant;
+                    result->sequence = chunk.first_sequence + i;
+                    result->status = TEST_ERROR;
+                    result->error = "Corrupt test pack record";
+
+                    load_error_count++;
+                    completed++; // consumed, the run only finishes once every test is accounted for
+
+                    // errors spend the failure budget like any other reported test
+                    if(!run->recordFailure())
+                    {
+                        break;
+                    }
+
+                    results->submit(worker, std::move(result));
+                    continue;
+                }
+
+                test_case.file_index = chunk.file_index;
+                test_case.sequence = chunk.first_sequence + i;
+                test_case.variant = chunk.variant;
+            }
+            else
+            {
+                test_case = std::move(chunk.tests[i]);
+            }
+
+            execute_test(test_params, (*translators)[chunk.variant].get(), baseline, run, results, worker, test_case);
+            completed++;
+        }
+
+        // completions are published once per chunk, they only feed the progress line
+        run->addCompletions(completed);
     }
 
-    return 0;
+    run->workerDone();
+}
+
+// Resolve the register layout of every test file up front so the workers never see it
+// change. Packs are opened here and stay mapped for the whole run
+static int load_test_registers(TEST_PARAMS &test_params, vector<unique_ptr<TestPack>> &packs)
+{
+    for(auto &test_file : test_params.test_files)
+    {
+        int result = 0;
+
+        if(is_test_pack(test_file))
+        {
+            unique_ptr<TestPack> pack(new TestPack());
+
+            result = pack->open(test_file);
+            if(result == 0)
+            {
+                result = pack->resolveRegisters(test_params, true);
+            }
+            packs.push_back(std::move(pack));
+        }
+        else
+        {
+            TEST_PARAMS file_params = test_params;
+
+            file_params.json_filename = test_file;
+            result = get_test_registers(file_params);
+            test_params.registers = file_params.registers;
+            test_params.register_indexes = file_params.register_indexes;
+            packs.push_back(nullptr);
+        }
+
+        if(result != 0)
+        {
+            cout << "[-] Failed to read test registers from " << test_file << "!" << endl;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Read every test file in order and hand the tests to the workers in chunks, the next file
+// is read while the previous one is still executing. A compressed json file starts
+// decompressing on its own thread while the file before it is parsed. In a matrix run
+// every file is a pack and each variant is dealt the same tests in turn. Returns the number
+// of files that failed to load
+static unsigned int load_tests(TEST_PARAMS &test_params, const vector<unique_ptr<TestPack>> &packs, TEST_SCHEDULER &scheduler, vector<unsigned int> &loaded)
+{
+    PROFILE_SCOPE(PHASE_LOAD);
+    unsigned int num_variants = max(test_params.matrix_sla_files.size(), (size_t)1);
+    unsigned long long sequence = 0;
+    unsigned int failed_files = 0;
+    bool accepted = true;
+    unique_ptr<istream> next_input; // the next json file, already decompressing
+
+    for(unsigned int file_index = 0; file_index < test_params.test_files.size() && accepted; file_index++)
+    {
+        const TestPack *pack = packs[file_index].get();
+        unsigned long long first_sequence = sequence;
+        unique_ptr<istream> input = std::move(next_input);
+
+        if(file_index + 1 < test_params.test_files.size() && packs[file_index + 1] == nullptr &&
+           get_compression(test_params.test_files[file_index + 1]) != COMPRESSION_NONE)
+        {
+            next_input = open_test_file(test_params.test_files[file_index + 1], true);
+        }
+
+        if(pack != nullptr)
+        {
+            // nothing to parse, just deal out index ranges. A sharded file gives this shard
+            // every shard_count'th test
+            unsigned long long end_test = min(test_params.end_test, pack->getNumTests());
+            unsigned int stride = test_params.shard_by_file ? 1 : test_params.shard_count;
+            unsigned long long first_test = test_params.start_test;
+
+            while(first_test < end_test && !test_in_shard(test_params, first_test))
+            {
+                first_test++;
+            }
+
+            for(unsigned int variant = 0; variant < num_variants; variant++)
+            {
+                for(unsigned long long i = first_test; i < end_test && accepted; i += TEST_CHUNK_SIZE * stride)
+                {
+                    TEST_CHUNK chunk;
+
+                    chunk.file_index = file_index;
+                    chunk.variant = variant;
+                    chunk.first_test = i;
+                    chunk.test_stride = stride;
+                    chunk.first_sequence = sequence;
+                    chunk.num_tests = min((end_test - i + stride - 1) / stride, (unsigned long long)TEST_CHUNK_SIZE);
+                    chunk.pack = pack;
+
+                    sequence += chunk.num_tests;
+
+                    PROFILE_SCOPE(PHASE_LOAD_WAIT);
+                    accepted = scheduler.push(std::move(chunk), chunk.num_tests);
+                }
+            }
+        }
+        else
+        {
+            TEST_PARAMS file_params = test_params;
+            TEST_CHUNK chunk;
+
+            file_params.json_filename = test_params.test_files[file_index];
+
+            auto push_chunk = [&]()
+            {
+                chunk.file_index = file_index;
+                chunk.variant = 0;
+                chunk.num_tests = chunk.tests.size();
+                chunk.pack = nullptr;
+                chunk.test_stride = 1;
+
+                {
+                    PROFILE_SCOPE(PHASE_LOAD_WAIT);
+                    accepted = scheduler.push(std::move(chunk), chunk.num_tests);
+                }
+                chunk = TEST_CHUNK();
+
+                return accepted;
+            };
+
+            TEST_SINK sink = [&](TEST_CASE &test_case)
+            {
+                test_case.file_index = file_index;
+                test_case.sequence = sequence++;
+                chunk.tests.push_back(std::move(test_case));
+
+                return chunk.tests.size() < TEST_CHUNK_SIZE || push_chunk();
+            };
+
+            if(get_tests(file_params, sink, input.get()) != 0)
+            {
+                cout << "[-] Failed to load " << file_params.json_filename << "!" << endl;
+                failed_files++;
+            }
+
+            // partial last chunk, chunks never span files
+            if(accepted && !chunk.tests.empty())
+            {
+                push_chunk();
+            }
+        }
+
+        loaded[file_index] = (sequence - first_sequence) / num_variants;
+    }
+
+    scheduler.close();
+
+    return failed_files;
+}
+
+// Matrix mode report, a row per test file and a column per variant with the passed and
+// loaded count of each pair, then the totals of each variant
+static void print_matrix(TEST_PARAMS &test_params, const ResultPipeline &results, const vector<unsigned int> &loaded)
+{
+    size_t file_width = strlen("Test file");
+    vector<size_t> widths;
+
+    for(auto &test_file : test_params.test_files)
+    {
+        file_width = max(file_width, test_file.size());
+    }
+
+    for(unsigned int variant = 0; variant < test_params.matrix_names.size(); variant++)
+    {
+        size_t width = test_params.matrix_names[variant].size();
+
+        for(unsigned int i = 0; i < test_params.test_files.size(); i++)
+        {
+            width = max(width, to_string(results.getFileCounts(i, variant).passed).size() + 1 + to_string(loaded[i]).size());
+        }
+        widths.push_back(width);
+    }
+
+    cout << "[*] Matrix, passed/loaded test cases:" << endl;
+    cout << left << setw(file_width) << "Test file";
+    for(unsigned int variant = 0; variant < test_params.matrix_names.size(); variant++)
+    {
+        cout << "  " << right << setw(widths[variant]) << test_params.matrix_names[variant];
+    }
+    cout << endl;
+
+    for(unsigned int i = 0; i < test_params.test_files.size(); i++)
+    {
+        cout << left << setw(file_width) << test_params.test_files[i];
+        for(unsigned int variant = 0; variant < test_params.matrix_names.size(); variant++)
+        {
+            string cell = to_string(results.getFileCounts(i, variant).passed) + "/" + to_string(loaded[i]);
+
+            cout << "  " << right << setw(widths[variant]) << cell;
+        }
+        cout << endl;
+    }
+    cout << left;
+
+    for(unsigned int variant = 0; variant < test_params.matrix_names.size(); variant++)
+    {
+        FILE_COUNTS totals = {};
+        unsigned int total_loaded = 0;
+
+        for(unsigned int i = 0; i < test_params.test_files.size(); i++)
+        {
+            const FILE_COUNTS &counts = results.getFileCounts(i, variant);
+
+            totals.passed += counts.passed;
+            totals.failed += counts.failed;
+            totals.errors += counts.errors;
+            total_loaded += loaded[i];
+        }
+
+        bool passed = totals.failed == 0 && totals.errors == 0 && totals.passed == total_loaded;
+
+        cout << (passed ? "[+] " : "[-] ") << test_params.matrix_names[variant] << " (" << test_params.matrix_sla_files[variant] << "): " <<
+            totals.passed << " passed, " << totals.failed << " failed, " << totals.errors << " errors" << endl;
+    }
+}
+
+int parallelize_test(TEST_PARAMS& test_params)
+{
+    boost::timer::auto_cpu_timer t;
+    vector<unique_ptr<SlaTranslator>> translators; // the module or every matrix variant, then the baseline. Must outlive the thread pool
+    vector<string> sla_files = test_params.matrix_sla_files;
+    bool differential = !test_params.baseline_sla_filename.empty();
+    bool matrix = !test_params.matrix_sla_files.empty();
+    vector<unique_ptr<TestPack>> packs; // indexed by file, null for json files
+    vector<unsigned int> loaded(test_params.test_files.size(), 0); // tests read from each file
+    TEST_SCHEDULER scheduler(test_params.num_threads, TEST_QUEUE_CHUNKS);
+    TestRun run(test_params.max_failures, test_params.num_threads);
+    ResultPipeline results(test_params, test_params.num_threads);
+    boost::asio::thread_pool thread_pool(test_params.isolate ? 1 : test_params.num_threads); // idle with --isolate
+    unsigned int cases_submitted = 0;
+    unsigned int failed_files = 0;
+    int isolate_result = 0;
+    int result = 0;
+
+    cout << "[*] Test Range: "  << test_params.start_test << "-" << test_params.end_test << endl;
+
+    PROFILE_RESET();
+
+    if(!matrix)
+    {
+        sla_files.push_back(test_params.sla_filename);
+    }
+
+    if(differential)
+    {
+        sla_files.push_back(test_params.baseline_sla_filename);
+    }
+
+    // one translator per .sla for every file in the run
+    for(auto &sla_file : sla_files)
+    {
+        unique_ptr<SlaTranslator> translator(new SlaTranslator());
+
+        {
+            PROFILE_SCOPE(PHASE_SLA_LOAD);
+            result = translator->load(sla_file);
+        }
+        if(result != 0)
+        {
+            cout << "[-] Failed to load " << sla_file << "!" << endl;
+            return -1;
+        }
+
+        // the tests' addresses are read at one word size
+        if(!translators.empty() && translator->getWordSize() != translators[0]->getWordSize())
+        {
+            cout << "[-] " << sla_file << " has a word size of " << translator->getWordSize() << ", " << sla_files[0] << " has " <<
+                translators[0]->getWordSize() << "!" << endl;
+            return -1;
+        }
+
+        translators.push_back(std::move(translator));
+    }
+
+    const SlaTranslator &translator = *translators[0];
+    const SlaTranslator *baseline = differential ? translators.back().get() : nullptr;
+
+    test_params.word_size = translator.getWordSize();
+    cout << "[*] Word size: " << test_params.word_size << endl;
+
+    // resolve register names once, everything after this works on register indexes
+    {
+        PROFILE_SCOPE(PHASE_REGISTERS);
+        result = load_test_registers(test_params, packs);
+    }
+    if(result != 0)
+    {
+        return -1;
+    }
+
+    // every .sla needs the test registers, they are compared at their width in the first
+    for(unsigned int i = 1; i < translators.size(); i++)
+    {
+        unsigned int register_masks[MAX_TEST_REGISTERS];
+
+        memcpy(register_masks, test_params.register_masks, sizeof(register_masks));
+        result = translators[i]->validateRegisters(test_params);
+        memcpy(test_params.register_masks, register_masks, sizeof(register_masks));
+        if(result != 0)
+        {
+            cout << "[-] " << sla_files[i] << " is missing test registers!" << endl;
+            return -1;
+        }
+    }
+
+    result = translator.validateRegisters(test_params);
+    if(result != 0)
+    {
+        return -1;
+    }
+
+    // matrix mode, json files are packed in memory once so every variant reads the same
+    // copy of the tests instead of parsing the file again
+    for(unsigned int i = 0; matrix && i < test_params.test_files.size(); i++)
+    {
+        if(packs[i] == nullptr && pack_json_tests(test_params, test_params.test_files[i], packs[i]) != 0)
+        {
+            cout << "[-] Failed to load " << test_params.test_files[i] << "!" << endl;
+            return -1;
+        }
+    }
+
+    result = results.open();
+    if(result != 0)
+    {
+        return -1;
+    }
+
+    if(test_params.isolate)
+    {
+        // worker processes instead of the thread pool, a crash only loses one test
+        isolate_result = run_isolated(test_params, translator, baseline, packs, run, results, loaded, cases_submitted, failed_files);
+    }
+    else
+    {
+        // results and progress lines from here on go through the writer thread, only the
+        // loader still prints its own errors
+        results.setProgress([&]()
+        {
+            if(run.isCancelled())
+            {
+                return string();
+            }
+
+            return "Test cases: " + to_string(run.getCompletions()) + "/" + to_string(scheduler.getPushed()) + " Fail cases: " + to_string(run.getFailures());
+        });
+        results.start();
+
+        for(unsigned int i = 0; i < test_params.num_threads; i++)
+        {
+            boost::asio::post(thread_pool, boost::bind(test_worker, boost::ref(test_params), &translators, baseline, &scheduler, &run, &results, i));
+        }
+
+        // tests are handed to the workers in chunks as they are read.
+        // the loader blocks whenever the scheduler is full
+        boost::thread loader([&]()
+        {
+            failed_files = load_tests(test_params, packs, scheduler, loaded);
+        });
+
+        // woken as soon as the workers are done or the failure budget is spent
+        run.wait();
+
+        if(run.isCancelled())
+        {
+            // abort the loader and wake any worker waiting for a chunk
+            scheduler.cancel();
+        }
+
+        loader.join();
+        cases_submitted = scheduler.getPushed();
+    }
+
+    thread_pool.join();
+    results.finish();
+
+    // per file summary
+    for(unsigned int i = 0; i < test_params.test_files.size() && !matrix; i++)
+    {
+        const FILE_COUNTS &counts = results.getFileCounts(i);
+        bool passed = counts.failed == 0 && counts.errors == 0 && counts.passed == loaded[i];
+
+        cout << (passed ? "[+] " : "[-] ") << test_params.test_files[i] << ": Loaded " << loaded[i] << " test cases, " <<
+            counts.passed << " passed, " << counts.failed << " failed, " << counts.errors << " errors";
+        if(differential)
+        {
+            cout << ", " << counts.fixed << " fixed, " << counts.regressed << " regressed, " << counts.changed << " changed";
+        }
+        cout << endl;
+    }
+
+    if(matrix)
+    {
+        print_matrix(test_params, results, loaded);
+    }
+
+    cout << "Test files " << test_params.test_files.size() << endl;
+    cout << "Cases submitted " << cases_submitted  << endl;
+    cout << "Completed cases " << run.getCompletions() << endl;
+    cout << "Fail cases " << results.getFailed() << endl;
+    cout << "Error cases " << results.getErrors() << endl;
+    if(differential)
+    {
+        cout << "Fixed cases " << results.getTotals().fixed << endl;
+        cout << "Regressed cases " << results.getTotals().regressed << endl;
+        cout << "Changed cases " << results.getTotals().changed << endl;
+    }
+
+    PROFILE_REPORT(test_params);
+
+    // each worker process had its own copy of the cache
+    if(test_params.translation_cache && !test_params.isolate)
+    {
+        for(unsigned int i = 0; i < translators.size(); i++)
+        {
+            string name = matrix && i < test_params.matrix_names.size() ? test_params.matrix_names[i] + " translation cache" :
+                (i == 0 ? "Translation cache" : "Baseline translation cache");
+
+            cout << "[*] " << name << ": " << translators[i]->getTranslationCache()->getHits() << " hits, " <<
+                translators[i]->getTranslationCache()->getMisses() << " misses" << endl;
+        }
+    }
+
+    if(results.getResultCache() != nullptr)
+    {
+        cout << "[*] Result cache: " << results.getResultCache()->getReused() << " reused, " << results.getResultCache()->getAdded() << " added" << endl;
+    }
+
+    if(results.getFileResult() != 0 || isolate_result != 0)
+    {
+        result = -1;
+    }
+
+    if(failed_files != 0 || load_error_count != 0)
+    {
+        cout << "[-] Failed to load unit tests!" << endl;
+        result = -1;
+    }
+
+    if(!test_params.summary_filename.empty())
+    {
+        RUN_SUMMARY summary;
+
+        summary.run = summary_run(test_params);
+        summary.shard_index = test_params.shard_index;
+        summary.shard_count = test_params.shard_count;
+        summary.result = result;
+        summary.aborted = run.isCancelled();
+        summary.submitted = cases_submitted;
+        summary.completed = run.getCompletions();
+        summary.failures = results.getFailureRecords();
+
+        for(unsigned int variant = 0; variant < max(test_params.matrix_sla_files.size(), (size_t)1); variant++)
+        {
+            for(unsigned int i = 0; i < test_params.test_files.size(); i++)
+            {
+                summary.files.push_back({unsharded_file_index(test_params, i), test_params.test_files[i], loaded[i], results.getFileCounts(i, variant), variant});
+            }
+        }
+
+        if(write_summary(test_params.summary_filename, summary) != 0)
+        {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+// Verify the steps of one trace segment. The emulator starts from image, the state at the
+// segment's checkpoint, and then runs without being reset. Each step is judged on every
+// register the trace has set so far, so a register the instruction shouldn't have touched
+// is caught too, and on the memory the step wrote. After a failed step the emulator is set
+// to the state the trace recorded so one wrong instruction doesn't fail every step after it
+static void verify_segment(TEST_PARAMS &test_params, SlaEmulatorContext &emulator_context, const TraceFile &trace, const TRACE_CHECKPOINT &checkpoint,
+    const TEST_STATE &image, unsigned long long end_step, boost::atomic<unsigned long long> *verified, TestRun *run, ResultPipeline *results, unsigned int worker)
+{
+    TEST_STATE expected; // the trace's registers after the step and the memory it wrote
+    TEST_STATE delta;
+    TEST_STATE actual;
+    TEST_STATE before;
+    uint64_t offset = checkpoint.offset;
+    unsigned long long step = checkpoint.first_step;
+
+    if(emulator_context.prepare(test_params, image) != 0)
+    {
+        load_error_count++;
+        return;
+    }
+
+    memcpy(expected.registers, image.registers, sizeof(expected.registers));
+    expected.register_mask = image.register_mask;
+
+    for(; step < end_step && !run->isCancelled(); step++)
+    {
+        string exception_type;
+        string exception_message;
+        vector<STATE_DIFF> diffs;
+        TEST_STATUS status = TEST_PASS;
+        string error;
+
+        memcpy(before.registers, expected.registers, sizeof(before.registers));
+        before.register_mask = expected.register_mask;
+
+        if(trace.getStep(offset, delta) != 0)
+        {
+            cout << "[-] Corrupt trace step " << step << "!" << endl;
+            load_error_count++;
+            break;
+        }
+
+        for(unsigned int i = 0; i < MAX_TEST_REGISTERS; i++)
+        {
+            if(delta.register_mask & (1ULL << i))
+            {
+                expected.registers[i] = delta.registers[i];
+            }
+        }
+        expected.register_mask |= delta.register_mask;
+        expected.memory.addresses.assign(delta.memory.addresses.begin(), delta.memory.addresses.end());
+        expected.memory.values.assign(delta.memory.values.begin(), delta.memory.values.end());
+
+        prepare_readback(expected, actual);
+        if(emulator_context.execute(test_params, actual, exception_type, exception_message) != 0)
+        {
+            status = TEST_ERROR;
+            error = "Fatal emulation error";
+        }
+        else if(compare_state(test_params, expected, actual, diffs) != 0)
+        {
+            status = TEST_FAIL;
+        }
+
+        if(status == TEST_PASS)
+        {
+            continue;
+        }
+
+        if(!run->recordFailure())
+        {
+            break;
+        }
+
+        unique_ptr<TEST_RESULT> result(new TEST_RESULT());
+
+        result->test_id = step;
+        result->file_index = 0;
+        result->sequence = step;
+        result->name = "step " + to_string(step);
+        result->status = status;
+        result->error = error;
+        result->exception_type = exception_type;
+        result->exception_message = exception_message;
+        result->diffs = std::move(diffs);
+        result->initial_state = before;
+        result->expected_state = expected;
+        result->emulator_state = actual;
+        results->submit(worker, std::move(result));
+
+        // continue from the recorded state, not the emulator's
+        if(emulator_context.prepare(test_params, expected, false) != 0)
+        {
+            load_error_count++;
+            break;
+        }
+    }
+
+    verified->fetch_add(step - checkpoint.first_step, boost::memory_order_relaxed);
+}
+
+// worker loop, verifies segments until every one is taken or the run is aborted
+static void trace_worker(TEST_PARAMS &test_params, const SlaTranslator *translator, const TraceFile *trace, const vector<TRACE_CHECKPOINT> *checkpoints,
+    boost::atomic<unsigned int> *next_segment, boost::atomic<unsigned long long> *verified, TestRun *run, ResultPipeline *results, unsigned int worker)
+{
+    SlaEmulatorContext &emulator_context = get_emulator_context(*translator);
+    TEST_STATE image; // memory as of the last checkpoint applied
+    unsigned int applied = 0;
+
+    if(test_params.pin_threads)
+    {
+        pin_worker(worker);
+    }
+
+    if(!emulator_context.isInitialized(*translator) && emulator_context.initialize(test_params, *translator) != 0)
+    {
+        load_error_count++;
+        run->workerDone();
+        return;
+    }
+
+    // segments are claimed in ascending order, so each worker only rolls its image forward
+    // and walks every checkpoint's memory delta once
+    for(unsigned int segment = (*next_segment)++; segment < checkpoints->size() && !run->isCancelled(); segment = (*next_segment)++)
+    {
+        unsigned long long end_step = segment + 1 < checkpoints->size() ? (*checkpoints)[segment + 1].first_step : trace->getNumSteps();
+
+        for(; applied <= segment; applied++)
+        {
+            apply_checkpoint(image, (*checkpoints)[applied]);
+        }
+
+        verify_segment(test_params, emulator_context, *trace, (*checkpoints)[segment], image, end_step, verified, run, results, worker);
+    }
+
+    run->workerDone();
+}
+
+// Trace mode, the whole run is one recorded execution instead of independent tests.
+// A sequential pass over the trace records a checkpoint every trace_segment_steps steps,
+// the segments between checkpoints are then verified in parallel. Only failed steps are
+// handed to the result pipeline, the step counts are kept here
+int trace_test(TEST_PARAMS &test_params)
+{
+    boost::timer::auto_cpu_timer t;
+    SlaTranslator translator;
+    TraceFile trace;
+    vector<TRACE_CHECKPOINT> checkpoints;
+    boost::atomic<unsigned int> next_segment(0);
+    boost::atomic<unsigned long long> verified(0);
+    TestRun run(test_params.max_failures, test_params.num_threads);
+    ResultPipeline results(test_params, test_params.num_threads);
+    boost::asio::thread_pool thread_pool(test_params.num_threads);
+    unsigned long long num_steps = 0;
+    int result = 0;
+
+    PROFILE_RESET();
+
+    {
+        PROFILE_SCOPE(PHASE_SLA_LOAD);
+        result = translator.load(test_params.sla_filename);
+    }
+    if(result != 0)
+    {
+        cout << "[-] Failed to load " << test_params.sla_filename << "!" << endl;
+        return -1;
+    }
+
+    test_params.word_size = translator.getWordSize();
+    cout << "[*] Word size: " << test_params.word_size << endl;
+
+    if(trace.open(test_params.trace_filename) != 0 || trace.resolveRegisters(test_params, true) != 0 ||
+       translator.validateRegisters(test_params) != 0)
+    {
+        return -1;
+    }
+
+    num_steps = trace.getNumSteps();
+    if(trace.checkpoint(test_params.trace_segment_steps, checkpoints) != 0)
+    {
+        return -1;
+    }
+
+    cout << "[*] Trace: " << num_steps << " steps in " << checkpoints.size() << " segments" << endl;
+
+    result = results.open();
+    if(result != 0)
+    {
+        return -1;
+    }
+
+    results.setProgress([&]()
+    {
+        if(run.isCancelled())
+        {
+            return string();
+        }
+
+        return "Trace steps: " + to_string(verified) + "/" + to_string(num_steps) + " Fail steps: " + to_string(run.getFailures());
+    });
+    results.start();
+
+    for(unsigned int i = 0; i < test_params.num_threads; i++)
+    {
+        boost::asio::post(thread_pool, boost::bind(trace_worker, boost::ref(test_params), &translator, &trace, &checkpoints, &next_segment,
+            &verified, &run, &results, i));
+    }
+
+    run.wait();
+
+    thread_pool.join();
+    results.finish();
+
+    {
+        unsigned long long failed = results.getFailed() + results.getErrors();
+        unsigned long long passed = verified - min((unsigned long long)verified, failed);
+        bool all_passed = failed == 0 && verified == num_steps;
+
+        cout << (all_passed ? "[+] " : "[-] ") << test_params.trace_filename << ": Verified " << verified << " of " << num_steps << " steps, " <<
+            passed << " passed, " << results.getFailed() << " failed, " << results.getErrors() << " errors" << endl;
+    }
+
+    PROFILE_REPORT(test_params);
+
+    if(test_params.translation_cache)
+    {
+        cout << "[*] Translation cache: " << translator.getTranslationCache()->getHits() << " hits, " <<
+            translator.getTranslationCache()->getMisses() << " misses" << endl;
+    }
+
+    if(results.getFileResult() != 0)
+    {
+        result = -1;
+    }
+
+    if(load_error_count != 0)
+    {
+        cout << "[-] Failed to verify the trace!" << endl;
+        result = -1;
+    }
+
+    return result;
+}
+
+#ifdef VERIFIER_PROFILE
+// first instruction byte of a test, -1 if the test doesn't include it
+static int test_opcode(TEST_PARAMS &test_params, const TEST_STATE &initial_state)
+{
+    auto pc_index = test_params.register_indexes.find(test_params.program_counter);
+    if(pc_index == test_params.register_indexes.end() || !(initial_state.register_mask & (1ULL << pc_index->second)))
+    {
+        return -1;
+    }
+
+    return find_memory(initial_state, initial_state.registers[pc_index->second]);
+}
+#endif
+
+// run one test on one translator and judge it
+static int judge_test(TEST_PARAMS& test_params, const SlaTranslator &translator, const ResultCache *cache, TEST_CASE &test_case, TEST_RESULT &result,
+    TEST_STATE &emu_final_state)
+{
+    int status = 0;
+    auto start_time = boost::chrono::steady_clock::now();
+    PROFILE_TEST_START(profile_start);
+
+    result.test_id = test_case.test_id;
+    result.file_index = test_case.file_index;
+    result.variant = test_case.variant;
+    result.sequence = test_case.sequence;
+    result.name = std::move(test_case.name);
+    result.status = TEST_PASS;
+
+    // an outcome recorded for the same p-code and states is reused without emulating
+    if(cache != nullptr && sla_fingerprint(test_params, translator, test_case, result.cache_key) == 0)
+    {
+        result.cacheable = true;
+        if(cache->find(result.cache_key, result))
+        {
+            result.cached = true;
+            emu_final_state = std::move(result.emulator_state);
+            result.emulator_state = TEST_STATE();
+            result.duration_ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::steady_clock::now() - start_time).count();
+            return 0;
+        }
+    }
+
+    prepare_readback(test_case.final_state, emu_final_state);
+
+    try
+    {
+        status = sla_emulate(test_params, translator, test_case.initial_state, emu_final_state, result.exception_type, result.exception_message);
+        if(status != 0)
+        {
+            result.status = TEST_ERROR;
+            result.error = "Fatal emulation error";
+            result.cacheable = false;
+        }
+    }
+    catch(BadDataError &e)
+    {
+        result.status = TEST_ERROR;
+        result.error = "BadDataError: " + e.explain;
+        result.cacheable = false;
+        status = -1;
+    }
+
+    {
+        PROFILE_SCOPE(PHASE_COMPARE);
+        if(result.status == TEST_PASS && compare_state(test_params, test_case.final_state, emu_final_state, result.diffs) != 0)
+        {
+            result.status = TEST_FAIL;
+        }
+
+        // bus accesses are judged even if the state is wrong, the accesses often say why
+        if(test_params.bus_access && result.status != TEST_ERROR)
+        {
+            unsigned int count = 0;
+            const BUS_ACCESS *accesses = sla_bus_accesses(translator, count);
+
+            if(count > BUS_LOG_SIZE)
+            {
+                result.status = TEST_ERROR;
+                result.error = "More than " + to_string(BUS_LOG_SIZE) + " bus accesses";
+                result.cacheable = false;
+            }
+            else if(compare_bus(test_case.cycles, accesses, count, result.diffs) != 0)
+            {
+                result.status = TEST_FAIL;
+            }
+        }
+    }
+
+    result.duration_ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::steady_clock::now() - start_time).count();
+    PROFILE_TEST_END(profile_start, test_case.file_index, test_case.test_id, test_opcode(test_params, test_case.initial_state));
+
+    return status;
+}
+
+// same status, messages and diffs
+static bool same_outcome(const TEST_RESULT &result, const TEST_RESULT &baseline)
+{
+    if(result.status != baseline.status || result.error != baseline.error || result.exception_type != baseline.exception_type ||
+       result.diffs.size() != baseline.diffs.size())
+    {
+        return false;
+    }
+
+    for(unsigned int i = 0; i < result.diffs.size(); i++)
+    {
+        const STATE_DIFF &a = result.diffs[i];
+        const STATE_DIFF &b = baseline.diffs[i];
+
+        if(a.kind != b.kind || a.register_index != b.register_index || a.address != b.address || a.expected != b.expected || a.actual != b.actual)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static DIVERGENCE classify_divergence(const TEST_RESULT &result, const TEST_RESULT &baseline)
+{
+    if(result.status == TEST_PASS)
+    {
+        return baseline.status == TEST_PASS ? DIVERGENCE_NONE : DIVERGENCE_FIXED;
+    }
+
+    if(baseline.status == TEST_PASS)
+    {
+        return DIVERGENCE_REGRESSED;
+    }
+
+    return same_outcome(result, baseline) ? DIVERGENCE_NONE : DIVERGENCE_CHANGED;
+}
+
+int run_test(TEST_PARAMS& test_params, const SlaTranslator &translator, const SlaTranslator *baseline, const ResultCache *cache, TEST_CASE &test_case,
+    TEST_RESULT &result, TEST_STATE &emu_final_state)
+{
+    int status = judge_test(test_params, translator, cache, test_case, result, emu_final_state);
+
+    if(baseline == nullptr)
+    {
+        return status;
+    }
+
+    // the same decoded test, the states are only read
+    unique_ptr<TEST_RESULT> baseline_result(new TEST_RESULT());
+    TEST_STATE baseline_state;
+
+    judge_test(test_params, *baseline, cache, test_case, *baseline_result, baseline_state);
+    baseline_result->name = result.name;
+
+    result.divergence = classify_divergence(result, *baseline_result);
+    if(baseline_result->status != TEST_PASS)
+    {
+        baseline_result->emulator_state = std::move(baseline_state);
+    }
+    result.baseline = std::move(baseline_result);
+
+    return status;
+}
+
+// run one test and hand the result to the writer thread
+int execute_test(TEST_PARAMS& test_params, const SlaTranslator *translator, const SlaTranslator *baseline, TestRun *run, ResultPipeline *results,
+    unsigned int worker, TEST_CASE &test_case)
+{
+    unique_ptr<TEST_RESULT> result(new TEST_RESULT());
+    TEST_STATE emu_final_state;
+    int status = run_test(test_params, *translator, baseline, results->getResultCache(), test_case, *result, emu_final_state);
+
+    if(is_reported(test_params, *result))
+    {
+        if(!run->recordFailure())
+        {
+            // the run was aborted while this test was in flight
+            return status;
+        }
+
+        // only reported tests carry the test's states to the writer
+        result->initial_state = std::move(test_case.initial_state);
+        result->expected_state = std::move(test_case.final_state);
+    }
+
+    // part of the outcome the result cache stores
+    if(result->status != TEST_PASS)
+    {
+        result->emulator_state = std::move(emu_final_state);
+    }
+
+    {
+        PROFILE_SCOPE(PHASE_SUBMIT);
+        results->submit(worker, std::move(result));
+    }
+
+    return status;
 }
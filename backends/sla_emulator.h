@@ -6,11 +6,59 @@
 // Copyright (c) Oberoi Security Solutions. All rights reserved.
 // Licensed under the Apache 2.0 License.
 //--------------------------------------------------------------------------------------
+#pragma once
+
 #include "../state.h"
 #include "sleigh.hh"
 #include "emulate.hh"
+#include "translation_cache.h"
+#include "../test_results.h"
+#include "../result_cache.h"
 
 using namespace ghidra;
 
-int sla_emulate(TEST_PARAMS &test_params, TEST_STATE &initial_state, TEST_STATE &final_state, DocumentStorage docstorage);
-int sla_emulate_internal(TEST_PARAMS &test_params, TEST_STATE &initial_state, TEST_STATE &final_state, DocumentStorage docstorage);
+#include <memory>
+
+// Ghidra 11.1 replaced the XML .sla with a compressed format that Sleigh::initialize() reads
+// itself, the document only names the file
+#if __has_include("slaformat.hh")
+#define SLA_COMPRESSED_FORMAT
+#endif
+
+// The parsed .sla. Loaded once and shared read-only by every worker thread.
+// Each worker decodes its own Sleigh translator from this DOM once, no per test copies.
+// A translator decoded on the loading thread answers questions about the .sla at startup
+class SlaTranslator
+{
+    DocumentStorage docstorage; // owns the parsed document
+    const Element *sleighroot;
+    unique_ptr<LoadImage> loader;
+    unique_ptr<ContextInternal> context;
+    unique_ptr<Sleigh> trans;
+    mutable TranslationCache translation_cache; // shared by every worker's translator
+    unsigned int word_size; // address size in bytes of the default space
+
+public:
+    SlaTranslator(void) : sleighroot(nullptr), word_size(0) {}
+    SlaTranslator(const SlaTranslator &) = delete;
+    SlaTranslator &operator=(const SlaTranslator &) = delete;
+
+    int load(const string &sla_filename);
+    const Element *getRoot(void) const { return sleighroot; }
+    TranslationCache *getTranslationCache(void) const { return &translation_cache; }
+    unsigned int getWordSize(void) const { return word_size; }
+    bool hasRegister(const string &register_name) const;
+    int validateRegisters(TEST_PARAMS &test_params) const;
+};
+
+// exception_type and exception_message describe an exception the instruction raised, if any.
+// The test is still judged on the state the emulator was left in
+int sla_emulate(TEST_PARAMS &test_params, const SlaTranslator &translator, TEST_STATE &initial_state, TEST_STATE &final_state,
+    string &exception_type, string &exception_message);
+
+// Run one test and judge it, the result is not submitted anywhere. emulator_state is the
+// state read back from the emulator. With a cache the outcome of an identical earlier test
+// is reused when there is one. With a baseline translator the test runs on it too, its
+// outcome is attached as result.baseline and the difference classified in result.divergence
+int run_test(TEST_PARAMS &test_params, const SlaTranslator &translator, const SlaTranslator *baseline, const ResultCache *cache, TEST_CASE &test_case,
+    TEST_RESULT &result, TEST_STATE &emulator_state);
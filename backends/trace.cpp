@@ -0,0 +1,286 @@
+//--------------------------------------------------------------------------------------
+// File: trace.cpp
+//
+// Recorded execution traces (.vtr). A start state followed by the register and memory
+// changes of every executed instruction, verified by running the emulator continuously
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "trace.h"
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include "json.h"
+#include "pack.h"
+#include "compressed.h"
+
+namespace bip = boost::interprocess;
+
+bool is_trace(const string &filename)
+{
+    char magic[TRACE_MAGIC_SIZE];
+    std::ifstream f(filename, std::ios::binary);
+
+    if(!f || !f.read(magic, TRACE_MAGIC_SIZE))
+    {
+        return false;
+    }
+
+    return memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0;
+}
+
+int TraceFile::open(const string &trace_filename)
+{
+    const unsigned char *ptr;
+    const unsigned char *end;
+
+    if(get_compression(trace_filename) != COMPRESSION_NONE)
+    {
+        cout << "[-] " << trace_filename << " is compressed, traces are memory mapped and must be decompressed first!" << endl;
+        return -1;
+    }
+
+    try
+    {
+        mapping = bip::file_mapping(trace_filename.c_str(), bip::read_only);
+        region = bip::mapped_region(mapping, bip::read_only);
+    }
+    catch(bip::interprocess_exception &e)
+    {
+        cout << "[-] Failed to map " << trace_filename << ": " << e.what() << endl;
+        return -1;
+    }
+
+    base = (const unsigned char *)region.get_address();
+    size = region.get_size();
+    end = base + size;
+
+    // steps are read front to back, tell the kernel to read ahead
+    region.advise(bip::mapped_region::advice_sequential);
+
+    ptr = base;
+    if(!read_value(ptr, end, header) || memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0)
+    {
+        cout << "[-] " << trace_filename << " is not a trace!" << endl;
+        return -1;
+    }
+
+    if(header.version != TRACE_VERSION)
+    {
+        cout << "[-] Unsupported trace version (" << header.version << ")!" << endl;
+        return -1;
+    }
+
+    if(read_register_table(ptr, end, header.num_registers, register_names) != 0)
+    {
+        cout << "[-] " << trace_filename << " has a corrupt register table!" << endl;
+        return -1;
+    }
+
+    start_offset = ptr - base;
+    if(header.steps_offset < start_offset || header.steps_offset > size)
+    {
+        cout << "[-] " << trace_filename << " is truncated!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+// map the trace's register table onto the run's register layout
+int TraceFile::resolveRegisters(TEST_PARAMS &test_params, bool discover)
+{
+    return resolve_packed_registers(test_params, register_names, discover, register_remap);
+}
+
+int TraceFile::getStep(uint64_t &offset, TEST_STATE &delta) const
+{
+    const unsigned char *ptr = base + offset;
+
+    if(offset > size)
+    {
+        return -1;
+    }
+
+    // keeps the memory's capacity, a worker decodes every step into the same state
+    delta.register_mask = 0;
+    delta.memory.addresses.clear();
+    delta.memory.values.clear();
+
+    if(read_packed_state(ptr, base + size, register_remap, delta) != 0)
+    {
+        return -1;
+    }
+
+    offset = ptr - base;
+
+    return 0;
+}
+
+int TraceFile::checkpoint(unsigned long long segment_steps, vector<TRACE_CHECKPOINT> &checkpoints) const
+{
+    const unsigned char *ptr = base + start_offset;
+    TEST_STATE state; // registers so far, memory written since the last checkpoint
+    TEST_STATE delta;
+    uint64_t offset = header.steps_offset;
+
+    if(read_packed_state(ptr, base + header.steps_offset, register_remap, state) != 0)
+    {
+        cout << "[-] Corrupt trace start state!" << endl;
+        return -1;
+    }
+
+    for(unsigned long long step = 0; step < header.num_steps; step++)
+    {
+        if(step % segment_steps == 0)
+        {
+            TRACE_CHECKPOINT checkpoint;
+
+            // the start image the first time, afterwards the bytes this segment wrote
+            sort_memory(state);
+            checkpoint.first_step = step;
+            checkpoint.offset = offset;
+            memcpy(checkpoint.state.registers, state.registers, sizeof(state.registers));
+            checkpoint.state.register_mask = state.register_mask;
+            checkpoint.state.memory = std::move(state.memory);
+            state.memory = TEST_MEMORY();
+
+            checkpoints.push_back(std::move(checkpoint));
+        }
+
+        if(getStep(offset, delta) != 0)
+        {
+            cout << "[-] Corrupt trace step " << step << "!" << endl;
+            return -1;
+        }
+
+        for(unsigned int i = 0; i < MAX_TEST_REGISTERS; i++)
+        {
+            if(delta.register_mask & (1ULL << i))
+            {
+                state.registers[i] = delta.registers[i];
+            }
+        }
+        state.register_mask |= delta.register_mask;
+
+        // sort_memory() keeps the last value written to an address
+        for(size_t i = 0; i < delta.memory.size(); i++)
+        {
+            add_memory(state, delta.memory.addresses[i], delta.memory.values[i]);
+        }
+    }
+
+    return 0;
+}
+
+void apply_checkpoint(TEST_STATE &image, const TRACE_CHECKPOINT &checkpoint)
+{
+    const TEST_MEMORY &a = image.memory;
+    const TEST_MEMORY &b = checkpoint.state.memory;
+    TEST_MEMORY merged;
+    size_t i = 0;
+    size_t j = 0;
+
+    memcpy(image.registers, checkpoint.state.registers, sizeof(image.registers));
+    image.register_mask = checkpoint.state.register_mask;
+
+    if(b.empty())
+    {
+        return;
+    }
+
+    // both sorted, the checkpoint's bytes are newer
+    merged.addresses.reserve(a.size() + b.size());
+    merged.values.reserve(a.size() + b.size());
+    while(i < a.size() || j < b.size())
+    {
+        if(j == b.size() || (i < a.size() && a.addresses[i] < b.addresses[j]))
+        {
+            merged.addresses.push_back(a.addresses[i]);
+            merged.values.push_back(a.values[i]);
+            i++;
+        }
+        else
+        {
+            if(i < a.size() && a.addresses[i] == b.addresses[j])
+            {
+                i++;
+            }
+
+            merged.addresses.push_back(b.addresses[j]);
+            merged.values.push_back(b.values[j]);
+            j++;
+        }
+    }
+
+    image.memory = std::move(merged);
+}
+
+int write_trace(TEST_PARAMS &test_params, const string &trace_filename)
+{
+    TRACE_HEADER header;
+    int result = 0;
+
+    result = get_test_registers(test_params);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    std::ofstream out(trace_filename, std::ios::binary | std::ios::trunc);
+    if(!out)
+    {
+        cout << "[-] Failed to open " << trace_filename << " for writing!" << endl;
+        return -1;
+    }
+
+    // header is rewritten once the steps are counted
+    memset(&header, 0, sizeof(header));
+    write_value(out, header);
+    write_register_table(out, test_params.registers);
+
+    // streamed, a trace is never held in memory
+    result = get_tests(test_params, [&](TEST_CASE &test_case)
+    {
+        if(header.num_steps == 0)
+        {
+            write_packed_state(out, test_case.initial_state, test_params.registers.size());
+            header.steps_offset = out.tellp();
+        }
+
+        write_packed_state(out, test_case.final_state, test_params.registers.size());
+        header.num_steps++;
+
+        return (bool)out;
+    });
+
+    if(result != 0)
+    {
+        return result;
+    }
+
+    if(header.num_steps == 0)
+    {
+        cout << "[-] " << test_params.json_filename << " has no steps!" << endl;
+        return -1;
+    }
+
+    memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+    header.version = TRACE_VERSION;
+    header.num_registers = test_params.registers.size();
+
+    out.seekp(0);
+    write_value(out, header);
+
+    if(!out)
+    {
+        cout << "[-] Failed to write " << trace_filename << "!" << endl;
+        return -1;
+    }
+
+    cout << "[*] " << trace_filename << ": Wrote " << header.num_steps << " trace steps" << endl;
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+//--------------------------------------------------------------------------------------
+// File: trace.h
+//
+// Recorded execution traces (.vtr). A start state followed by the register and memory
+// changes of every executed instruction, verified by running the emulator continuously
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "../state.h"
+
+// File layout, all integers in host (little endian) byte order:
+//   TRACE_HEADER
+//   register table: num_registers x (uint16 length, name bytes)
+//   start state
+//   step records, one per executed instruction, from steps_offset on
+// States and step records use the test pack's state encoding (pack.h). The start state
+// lists every register and the memory image, a step record lists only the registers the
+// instruction changed and the bytes it wrote
+#define TRACE_MAGIC "VTRACE\0\0"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION 1
+
+// steps verified from one checkpoint by one worker when --trace-segment isn't given
+#define TRACE_SEGMENT_STEPS 100000
+
+typedef struct _TRACE_HEADER
+{
+    char magic[TRACE_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t num_registers;
+    uint64_t num_steps;
+    uint64_t steps_offset;
+} TRACE_HEADER, *PTRACE_HEADER;
+
+// The machine state in front of a step, a segment of the trace is verified from it.
+// Memory is kept as a delta so a long trace doesn't hold a full image per segment
+typedef struct _TRACE_CHECKPOINT
+{
+    unsigned long long first_step;
+    uint64_t offset; // file offset of first_step's record
+    TEST_STATE state; // every register the trace has set so far. Memory is the start image for the
+                      // first checkpoint, then only the bytes written since the previous checkpoint
+} TRACE_CHECKPOINT, *PTRACE_CHECKPOINT;
+
+// Read only view of a memory mapped .vtr. Traces are too large to decompress or copy,
+// steps are decoded straight from the mapping
+class TraceFile
+{
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+    const unsigned char *base;
+    size_t size;
+    TRACE_HEADER header;
+    uint64_t start_offset; // of the start state
+    vector<string> register_names;
+    vector<unsigned int> register_remap; // trace register index -> test register index
+
+public:
+    TraceFile(void) : base(nullptr), size(0), header(), start_offset(0) {}
+
+    int open(const string &trace_filename);
+    int resolveRegisters(TEST_PARAMS &test_params, bool discover);
+    unsigned long long getNumSteps(void) const { return header.num_steps; }
+
+    // decode the step record at offset into delta and advance offset past it
+    int getStep(uint64_t &offset, TEST_STATE &delta) const;
+
+    // One pass over the whole trace applying the changes without emulating anything.
+    // Records a checkpoint every segment_steps steps, segments can then be verified in parallel
+    int checkpoint(unsigned long long segment_steps, vector<TRACE_CHECKPOINT> &checkpoints) const;
+};
+
+// Bring image up to a checkpoint: its registers, and its memory delta merged over the memory
+// image already holds. Checkpoints must be applied in order starting from the first
+void apply_checkpoint(TEST_STATE &image, const TRACE_CHECKPOINT &checkpoint);
+
+// true if the file starts with the .vtr magic
+bool is_trace(const string &filename);
+
+// Convert a json trace in test_params.json_filename into a .vtr. The json is a list in the
+// test file format where the first entry's initial state is the start state and each entry's
+// final state holds the changes of one step
+int write_trace(TEST_PARAMS &test_params, const string &trace_filename);
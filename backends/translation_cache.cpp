@@ -0,0 +1,442 @@
+//--------------------------------------------------------------------------------------
+// File: translation_cache.cpp
+//
+// Cache of decoded instructions and their p-code shared by every worker
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "translation_cache.h"
+#include "../profiler.h"
+#include <algorithm>
+#include <cstring>
+#include <boost/thread/locks.hpp>
+
+// key prefixes
+#define KEY_RELOCATABLE 'R'
+#define KEY_ABSOLUTE 'A'
+
+// longest instruction that can be cached
+#define MAX_CONTEXT_SNAPSHOT 16
+
+// One op as emitted by the translator
+typedef struct _RECORDED_OP
+{
+    Address address;
+    OpCode opcode;
+    bool has_output;
+    VarnodeData output;
+    vector<VarnodeData> inputs;
+} RECORDED_OP, *PRECORDED_OP;
+
+// Captures the p-code of one translation
+class PcodeRecorder : public PcodeEmit
+{
+public:
+    vector<RECORDED_OP> ops;
+
+    virtual void dump(const Address &addr, OpCode opc, VarnodeData *outvar, VarnodeData *vars, int4 isize)
+    {
+        RECORDED_OP op;
+
+        op.address = addr;
+        op.opcode = opc;
+        op.has_output = outvar != (VarnodeData *)0;
+        if(op.has_output)
+        {
+            op.output = *outvar;
+        }
+        op.inputs.assign(vars, vars + isize);
+
+        ops.push_back(op);
+    }
+};
+
+shared_ptr<const CACHED_TRANSLATION> TranslationCache::find(const string &key)
+{
+    boost::shared_lock<boost::shared_mutex> guard(lock);
+
+    auto found = translations.find(key);
+    if(found == translations.end())
+    {
+        return nullptr;
+    }
+
+    return found->second;
+}
+
+void TranslationCache::insert(const string &key, shared_ptr<const CACHED_TRANSLATION> translation)
+{
+    boost::unique_lock<boost::shared_mutex> guard(lock);
+
+    translations.emplace(key, translation);
+
+    if(std::find(lengths.begin(), lengths.end(), translation->length) == lengths.end())
+    {
+        lengths.push_back(translation->length);
+    }
+}
+
+vector<int4> TranslationCache::getLengths(void)
+{
+    boost::shared_lock<boost::shared_mutex> guard(lock);
+    return lengths;
+}
+
+void ProbeLoadImage::loadFill(uint1 *ptr, int4 size, const Address &addr)
+{
+    for(int4 i = 0; i < size; i++)
+    {
+        uintb index = addr.getOffset() + i - base;
+
+        ptr[i] = index < bytes.size() ? bytes[index] : 0;
+    }
+}
+
+CachingSleigh::CachingSleigh(LoadImage *ld, ContextDatabase *c_db, DocumentStorage *store, TranslationCache *translation_cache) :
+    Sleigh(ld, c_db), loader(ld), context(c_db), docstorage(store), cache(translation_cache)
+{
+}
+
+// Sleigh::reset() is not virtual, this keeps our copies of the loader and context in step
+void CachingSleigh::resetCaching(LoadImage *ld, ContextDatabase *c_db)
+{
+    reset(ld, c_db);
+    loader = ld;
+    context = c_db;
+}
+
+// raw context words in effect at addr
+static string context_key(ContextDatabase *context, const Address &addr)
+{
+    int4 size = context->getContextSize();
+
+    if(size == 0)
+    {
+        return string();
+    }
+
+    return string((const char *)context->getContext(addr), size * sizeof(uintm));
+}
+
+string CachingSleigh::contextKey(const Address &addr) const
+{
+    return context_key(context, addr);
+}
+
+// Translate bytes at addr with the private probe translator. The probe is reset every time so
+// its disassembly cache never serves bytes from an earlier probe
+int4 CachingSleigh::probeInstruction(const Address &addr, const vector<uint1> &bytes, const string &expected_context, PcodeEmit &emit) const
+{
+    unique_ptr<ContextInternal> new_context(new ContextInternal());
+
+    probe_loader.setBytes(addr.getOffset(), bytes);
+
+    if(probe == nullptr)
+    {
+        probe.reset(new Sleigh(&probe_loader, new_context.get()));
+    }
+    else
+    {
+        probe->reset(&probe_loader, new_context.get());
+    }
+    probe_context = std::move(new_context);
+    probe->initialize(*docstorage);
+
+    // the probe must decode under the same context or the comparison means nothing
+    if(context_key(probe_context.get(), addr) != expected_context)
+    {
+        return -1;
+    }
+
+    return probe->oneInstruction(emit, addr);
+}
+
+// v1 was translated at a1 and v2 at a2. The varnode is absolute if it is the same in both,
+// relative if it moved with the instruction. Only op addresses may move: a value derived from
+// the address, a branch target or a pushed return address, can wrap at a page or bank or be
+// masked, and two translations can't tell that apart from a plain offset
+static bool relocate_varnode(const VarnodeData &v1, const VarnodeData &v2, uintb a1, uintb a2, bool may_move, CACHED_VARNODE &result)
+{
+    result.space_index = v1.space->getIndex();
+    result.size = v1.size;
+    result.offset = v1.offset;
+    result.relative = false;
+
+    if(v1.space->getIndex() != v2.space->getIndex() || v1.size != v2.size)
+    {
+        return false;
+    }
+
+    if(v1.offset == v2.offset)
+    {
+        return true;
+    }
+
+    if(!may_move)
+    {
+        return false;
+    }
+
+    bool moved = v1.space->wrapOffset(v1.offset + (a2 - a1)) == v2.offset;
+
+    if(moved)
+    {
+        result.offset = v1.offset - a1;
+        result.relative = true;
+    }
+
+    return moved;
+}
+
+// build a cache entry from the translation at a1 and the probe at a2. Returns false if the two
+// don't line up or the p-code uses the address, the translation is then only valid at a1
+static bool relocate_translation(const PcodeRecorder &at_a1, const PcodeRecorder &at_a2, uintb a1, uintb a2, CACHED_TRANSLATION &translation)
+{
+    VarnodeData address1;
+    VarnodeData address2;
+
+    if(at_a1.ops.size() != at_a2.ops.size())
+    {
+        return false;
+    }
+
+    for(unsigned int i = 0; i < at_a1.ops.size(); i++)
+    {
+        const RECORDED_OP &op1 = at_a1.ops[i];
+        const RECORDED_OP &op2 = at_a2.ops[i];
+        CACHED_OP op;
+
+        if(op1.opcode != op2.opcode || op1.has_output != op2.has_output || op1.inputs.size() != op2.inputs.size())
+        {
+            return false;
+        }
+
+        op.opcode = op1.opcode;
+        op.has_output = op1.has_output;
+
+        address1.space = op1.address.getSpace();
+        address1.offset = op1.address.getOffset();
+        address1.size = 0;
+        address2.space = op2.address.getSpace();
+        address2.offset = op2.address.getOffset();
+        address2.size = 0;
+        if(!relocate_varnode(address1, address2, a1, a2, true, op.address))
+        {
+            return false;
+        }
+
+        if(op.has_output && !relocate_varnode(op1.output, op2.output, a1, a2, false, op.output))
+        {
+            return false;
+        }
+
+        op.inputs.resize(op1.inputs.size());
+        for(unsigned int j = 0; j < op1.inputs.size(); j++)
+        {
+            if(!relocate_varnode(op1.inputs[j], op2.inputs[j], a1, a2, false, op.inputs[j]))
+            {
+                return false;
+            }
+        }
+
+        translation.ops.push_back(op);
+    }
+
+    return true;
+}
+
+// cache entry valid only at the address it was translated at
+static void absolute_translation(const PcodeRecorder &recorded, CACHED_TRANSLATION &translation)
+{
+    translation.ops.clear();
+
+    for(auto &recorded_op : recorded.ops)
+    {
+        CACHED_OP op;
+
+        op.opcode = recorded_op.opcode;
+        op.address = { recorded_op.address.getSpace()->getIndex(), recorded_op.address.getOffset(), 0, false };
+        op.has_output = recorded_op.has_output;
+        if(op.has_output)
+        {
+            op.output = { recorded_op.output.space->getIndex(), recorded_op.output.offset, recorded_op.output.size, false };
+        }
+
+        for(auto &input : recorded_op.inputs)
+        {
+            op.inputs.push_back({ input.space->getIndex(), input.offset, input.size, false });
+        }
+
+        translation.ops.push_back(op);
+    }
+}
+
+void CachingSleigh::replay(const CACHED_TRANSLATION &translation, uintb base, PcodeEmit &emit) const
+{
+    VarnodeData output;
+    vector<VarnodeData> inputs;
+
+    auto resolve = [&](const CACHED_VARNODE &cached, VarnodeData &vn)
+    {
+        vn.space = getSpace(cached.space_index);
+        vn.size = cached.size;
+        vn.offset = cached.offset;
+
+        if(cached.relative)
+        {
+            vn.offset = vn.space->wrapOffset(vn.offset + base);
+        }
+    };
+
+    for(auto &op : translation.ops)
+    {
+        VarnodeData address;
+
+        resolve(op.address, address);
+        if(op.has_output)
+        {
+            resolve(op.output, output);
+        }
+
+        inputs.resize(op.inputs.size());
+        for(unsigned int i = 0; i < op.inputs.size(); i++)
+        {
+            resolve(op.inputs[i], inputs[i]);
+        }
+
+        emit.dump(Address(address.space, address.offset), op.opcode, op.has_output ? &output : (VarnodeData *)0, inputs.data(), inputs.size());
+    }
+}
+
+int4 CachingSleigh::oneInstruction(PcodeEmit &emit, const Address &baseaddr) const
+{
+    PROFILE_SCOPE(PHASE_DECODE);
+
+    AddrSpace *space = baseaddr.getSpace();
+    uintb addr = baseaddr.getOffset();
+    vector<int4> lengths;
+    vector<uint1> bytes;
+    string context_key;
+    int4 max_length = 0;
+
+    if(cache == nullptr)
+    {
+        return Sleigh::oneInstruction(emit, baseaddr);
+    }
+
+    context_key = contextKey(baseaddr);
+
+    // try every instruction length we have seen, instructions straddling the end of the space
+    // are never served from the cache as their addresses wrap
+    lengths = cache->getLengths();
+    for(auto length : lengths)
+    {
+        max_length = max(max_length, length);
+    }
+
+    if(max_length > 0)
+    {
+        bytes.resize(max_length);
+        loader->loadFill(bytes.data(), max_length, baseaddr);
+
+        for(auto length : lengths)
+        {
+            if(addr + length - 1 > space->getHighest() || addr + length - 1 < addr)
+            {
+                continue;
+            }
+
+            string key = string(1, KEY_RELOCATABLE) + context_key + string((const char *)bytes.data(), length);
+            shared_ptr<const CACHED_TRANSLATION> translation = cache->find(key);
+
+            if(translation == nullptr)
+            {
+                key[0] = KEY_ABSOLUTE;
+                key.append((const char *)&addr, sizeof(addr));
+                translation = cache->find(key);
+            }
+
+            if(translation != nullptr)
+            {
+                cache->recordHit();
+                replay(*translation, addr, emit);
+                return translation->length;
+            }
+        }
+    }
+
+    cache->recordMiss();
+
+    // full translation. The context following the instruction is compared before and after as
+    // instructions that commit context (globalset) to inst_next have side effects a cache hit
+    // would skip
+    PcodeRecorder at_addr;
+    int4 length = 0;
+    vector<string> following_context;
+
+    try
+    {
+        for(int4 i = 1; i <= MAX_CONTEXT_SNAPSHOT; i++)
+        {
+            following_context.push_back(contextKey(Address(space, space->wrapOffset(addr + i))));
+        }
+
+        length = Sleigh::oneInstruction(at_addr, baseaddr);
+    }
+    catch(...)
+    {
+        // not cached, translate again so the caller sees the original exception
+        return Sleigh::oneInstruction(emit, baseaddr);
+    }
+
+    shared_ptr<CACHED_TRANSLATION> translation(new CACHED_TRANSLATION());
+    translation->length = length;
+
+    bool cacheable = length > 0 && length <= MAX_CONTEXT_SNAPSHOT &&
+        addr + length - 1 <= space->getHighest() && addr + length - 1 >= addr &&
+        contextKey(Address(space, space->wrapOffset(addr + length))) == following_context[length - 1];
+
+    if(cacheable)
+    {
+        bytes.resize(length);
+        loader->loadFill(bytes.data(), length, baseaddr);
+
+        // probe at the address with every bit flipped so any use of the address shows up
+        uintb probe_addr = addr ^ space->getHighest();
+        PcodeRecorder at_probe;
+        int4 probe_length = -1;
+
+        try
+        {
+            if(probe_addr + length - 1 <= space->getHighest() && probe_addr + length - 1 >= probe_addr)
+            {
+                probe_length = probeInstruction(Address(space, probe_addr), bytes, context_key, at_probe);
+            }
+        }
+        catch(...)
+        {
+            probe_length = -1;
+        }
+
+        string key = string(1, KEY_RELOCATABLE) + context_key + string((const char *)bytes.data(), length);
+
+        if(probe_length != length || !relocate_translation(at_addr, at_probe, addr, probe_addr, *translation))
+        {
+            absolute_translation(at_addr, *translation);
+            key[0] = KEY_ABSOLUTE;
+            key.append((const char *)&addr, sizeof(addr));
+        }
+
+        cache->insert(key, translation);
+    }
+
+    // hand the original translation to the emulator
+    for(auto &op : at_addr.ops)
+    {
+        emit.dump(op.address, op.opcode, op.has_output ? (VarnodeData *)&op.output : (VarnodeData *)0, (VarnodeData *)op.inputs.data(), op.inputs.size());
+    }
+
+    return length;
+}
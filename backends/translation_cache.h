@@ -0,0 +1,110 @@
+//--------------------------------------------------------------------------------------
+// File: translation_cache.h
+//
+// Cache of decoded instructions and their p-code shared by every worker
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include "sleigh.hh"
+
+using namespace ghidra;
+
+// Every worker has its own translator and so its own AddrSpace objects, cached varnodes
+// refer to spaces by index
+typedef struct _CACHED_VARNODE
+{
+    int4 space_index;
+    uintb offset; // relative to the instruction address if relative is set
+    uint4 size;
+    bool relative;
+} CACHED_VARNODE, *PCACHED_VARNODE;
+
+typedef struct _CACHED_OP
+{
+    OpCode opcode;
+    CACHED_VARNODE address; // address of the instruction the op came from, differs for delay slots
+    bool has_output;
+    CACHED_VARNODE output;
+    vector<CACHED_VARNODE> inputs;
+} CACHED_OP, *PCACHED_OP;
+
+typedef struct _CACHED_TRANSLATION
+{
+    int4 length; // instruction length in bytes, including delay slots
+    vector<CACHED_OP> ops;
+} CACHED_TRANSLATION, *PCACHED_TRANSLATION;
+
+// Translations keyed by (context words, instruction bytes) when the p-code doesn't use the
+// instruction address, or by (context words, instruction bytes, address) when it does.
+// Entries are immutable once inserted so readers only hold the lock for the lookup
+class TranslationCache
+{
+    boost::shared_mutex lock;
+    boost::unordered_map<string, shared_ptr<const CACHED_TRANSLATION>> translations;
+    vector<int4> lengths; // distinct instruction lengths cached, lookups try each
+    boost::atomic<unsigned long long> hits;
+    boost::atomic<unsigned long long> misses;
+
+public:
+    TranslationCache(void) : hits(0), misses(0) {}
+
+    shared_ptr<const CACHED_TRANSLATION> find(const string &key);
+    void insert(const string &key, shared_ptr<const CACHED_TRANSLATION> translation);
+    vector<int4> getLengths(void);
+
+    void recordHit(void) { hits++; }
+    void recordMiss(void) { misses++; }
+    unsigned long long getHits(void) const { return hits; }
+    unsigned long long getMisses(void) const { return misses; }
+};
+
+// Serves raw instruction bytes at a single address to the probe translator
+class ProbeLoadImage : public LoadImage
+{
+    uintb base;
+    vector<uint1> bytes;
+
+public:
+    ProbeLoadImage(void) : LoadImage("probe"), base(0) {}
+    void setBytes(uintb addr, const vector<uint1> &instruction) { base = addr; bytes = instruction; }
+    virtual void loadFill(uint1 *ptr, int4 size, const Address &addr);
+    virtual string getArchType(void) const { return "probe"; }
+    virtual void adjustVma(long adjust) { }
+};
+
+// Sleigh translator that serves oneInstruction() from the shared cache.
+// On a miss the instruction is translated normally and, to find out whether the p-code depends
+// on where the instruction lives, translated again at a second address by a private probe
+// translator. Op addresses are stored relative to the instruction, any other varnode that
+// differs between the two makes the entry valid only at its own address
+class CachingSleigh : public Sleigh
+{
+    LoadImage *loader;
+    ContextDatabase *context;
+    DocumentStorage *docstorage;
+    TranslationCache *cache;
+
+    // lazily created on the first miss
+    mutable ProbeLoadImage probe_loader;
+    mutable unique_ptr<ContextInternal> probe_context;
+    mutable unique_ptr<Sleigh> probe;
+
+    string contextKey(const Address &addr) const;
+    int4 probeInstruction(const Address &addr, const vector<uint1> &bytes, const string &expected_context, PcodeEmit &emit) const;
+    void replay(const CACHED_TRANSLATION &translation, uintb base, PcodeEmit &emit) const;
+
+public:
+    CachingSleigh(LoadImage *ld, ContextDatabase *c_db, DocumentStorage *store, TranslationCache *translation_cache);
+
+    void resetCaching(LoadImage *ld, ContextDatabase *c_db);
+    virtual int4 oneInstruction(PcodeEmit &emit, const Address &baseaddr) const;
+};
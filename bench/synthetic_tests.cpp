@@ -0,0 +1,141 @@
+//--------------------------------------------------------------------------------------
+// File: synthetic_tests.cpp
+//
+// Generates 6502 unit tests in the ProcessorTests json format so the benchmarks
+// don't depend on an external test corpus
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "synthetic_tests.h"
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// Instructions whose effect is easy to compute. Flags are left out of the tests so the
+// expected state never depends on how the processor module models P
+typedef enum _SYNTHETIC_OP
+{
+    OP_NOP, OP_INX, OP_DEX, OP_INY, OP_DEY,
+    OP_TAX, OP_TAY, OP_TXA, OP_TYA,
+    OP_LDA_IMM, OP_LDX_IMM, OP_LDY_IMM,
+    OP_LDA_ZP, OP_STA_ZP,
+    OP_COUNT
+} SYNTHETIC_OP;
+
+static const unsigned char opcodes[OP_COUNT] = {
+    0xEA, 0xE8, 0xCA, 0xC8, 0x88,
+    0xAA, 0xA8, 0x8A, 0x98,
+    0xA9, 0xA2, 0xA0,
+    0xA5, 0x85
+};
+
+static json make_state(unsigned int pc, unsigned int s, unsigned int a, unsigned int x, unsigned int y, const map<unsigned int, unsigned int> &ram)
+{
+    json state;
+    json ram_list = json::array();
+
+    state["pc"] = pc;
+    state["s"] = s;
+    state["a"] = a;
+    state["x"] = x;
+    state["y"] = y;
+
+    for(auto &[address, value] : ram)
+    {
+        ram_list.push_back({address, value});
+    }
+    state["ram"] = ram_list;
+
+    return state;
+}
+
+int write_synthetic_tests(const string &filename, unsigned int num_tests, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::ofstream out(filename, std::ios::trunc);
+
+    if(!out)
+    {
+        cout << "[-] Failed to open " << filename << " for writing!" << endl;
+        return -1;
+    }
+
+    out << "[\n";
+
+    for(unsigned int i = 0; i < num_tests; i++)
+    {
+        SYNTHETIC_OP op = (SYNTHETIC_OP)(rng() % OP_COUNT);
+        // keep clear of the zero page and the end of the address space
+        unsigned int pc = 0x200 + rng() % 0xFD00;
+        unsigned int s = rng() & 0xFF;
+        unsigned int a = rng() & 0xFF;
+        unsigned int x = rng() & 0xFF;
+        unsigned int y = rng() & 0xFF;
+        unsigned int operand = rng() & 0xFF;
+        unsigned int zp_value = rng() & 0xFF;
+        unsigned int length = op >= OP_LDA_IMM ? 2 : 1;
+        map<unsigned int, unsigned int> initial_ram;
+        map<unsigned int, unsigned int> final_ram;
+        unsigned int fa = a, fx = x, fy = y;
+        json test;
+
+        initial_ram[pc] = opcodes[op];
+        if(length == 2)
+        {
+            initial_ram[pc + 1] = operand;
+        }
+        if(op == OP_LDA_ZP || op == OP_STA_ZP)
+        {
+            initial_ram[operand] = zp_value;
+        }
+        final_ram = initial_ram;
+
+        switch(op)
+        {
+        case OP_NOP: break;
+        case OP_INX: fx = (x + 1) & 0xFF; break;
+        case OP_DEX: fx = (x - 1) & 0xFF; break;
+        case OP_INY: fy = (y + 1) & 0xFF; break;
+        case OP_DEY: fy = (y - 1) & 0xFF; break;
+        case OP_TAX: fx = a; break;
+        case OP_TAY: fy = a; break;
+        case OP_TXA: fa = x; break;
+        case OP_TYA: fa = y; break;
+        case OP_LDA_IMM: fa = operand; break;
+        case OP_LDX_IMM: fx = operand; break;
+        case OP_LDY_IMM: fy = operand; break;
+        case OP_LDA_ZP: fa = zp_value; break;
+        case OP_STA_ZP: final_ram[operand] = a; break;
+        default: break;
+        }
+
+        char name[16];
+        snprintf(name, sizeof(name), length == 2 ? "%02x %02x" : "%02x", opcodes[op], operand);
+
+        test["name"] = name;
+        test["initial"] = make_state(pc, s, a, x, y, initial_ram);
+        test["final"] = make_state(pc + length, s, fa, fx, fy, final_ram);
+
+        out << test.dump() << (i + 1 < num_tests ? ",\n" : "\n");
+    }
+
+    out << "]\n";
+
+    if(!out)
+    {
+        cout << "[-] Failed to write " << filename << "!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+map<string, string> synthetic_register_map(void)
+{
+    return {{"pc", "PC"}, {"s", "S"}, {"a", "A"}, {"x", "X"}, {"y", "Y"}};
+}
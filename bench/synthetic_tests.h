@@ -0,0 +1,21 @@
+//--------------------------------------------------------------------------------------
+// File: synthetic_tests.h
+//
+// Generates 6502 unit tests in the ProcessorTests json format so the benchmarks
+// don't depend on an external test corpus
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <map>
+#include <string>
+using namespace std;
+
+// write num_tests single instruction tests to filename. The same seed always produces the
+// same file
+int write_synthetic_tests(const string &filename, unsigned int num_tests, unsigned int seed);
+
+// test register -> Ghidra 6502 register, what --register-map would load for these tests
+map<string, string> synthetic_register_map(void);
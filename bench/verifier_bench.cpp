@@ -0,0 +1,370 @@
+//--------------------------------------------------------------------------------------
+// File: verifier_bench.cpp
+//
+// Benchmarks the verifier's own speed: json loading, emulator setup and execution,
+// state comparison and end to end throughput across thread counts
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/chrono.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread/thread.hpp>
+#include "../state.h"
+#include "../backends/json.h"
+#include "../backends/sla_emulator.h"
+#include "synthetic_tests.h"
+
+using namespace std;
+
+typedef boost::chrono::steady_clock BENCH_CLOCK;
+
+int parallelize_test(TEST_PARAMS &test_params);
+
+// discards everything written to it, parallelize_test() output is not part of the benchmark
+class NullBuffer : public std::streambuf
+{
+protected:
+    virtual int overflow(int c) { return c; }
+};
+
+static double elapsed_ns(BENCH_CLOCK::time_point start)
+{
+    return boost::chrono::duration_cast<boost::chrono::nanoseconds>(BENCH_CLOCK::now() - start).count();
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void bench_test_params(TEST_PARAMS &test_params, const string &sla_filename, const string &test_filename)
+{
+    test_params.sla_filename = sla_filename;
+    test_params.test_files = {test_filename};
+    test_params.json_filename = test_filename;
+    test_params.program_counter = "PC";
+    test_params.register_map = synthetic_register_map();
+    test_params.max_failures = 0xFFFFFFFF; // failures are counted, never abort the benchmark
+    test_params.start_test = 0;
+    test_params.end_test = 0xFFFFFFFF;
+    test_params.num_threads = 1;
+    test_params.pin_threads = false;
+    test_params.translation_cache = true;
+    test_params.verbose = false;
+    test_params.ordered_results = false;
+    test_params.word_size = 0;
+}
+
+// single threaded phase timings. Returns the metrics, empty on failure
+static map<string, double> bench_phases(TEST_PARAMS test_params)
+{
+    map<string, double> metrics;
+    vector<TEST_CASE> tests;
+    vector<TEST_STATE> emulator_states;
+    SlaTranslator translator;
+    string exception_type;
+    string exception_message;
+    unsigned int failures = 0;
+
+    // loader
+    if(get_test_registers(test_params) != 0)
+    {
+        return {};
+    }
+
+    auto start = BENCH_CLOCK::now();
+    if(get_tests(test_params, [&](TEST_CASE &test_case) { tests.push_back(std::move(test_case)); return true; }) != 0 || tests.empty())
+    {
+        return {};
+    }
+    metrics["load_ns_per_test"] = elapsed_ns(start) / tests.size();
+
+    // one time setup: parsing the .sla, then the first test which builds the worker's context
+    start = BENCH_CLOCK::now();
+    if(translator.load(test_params.sla_filename) != 0 || translator.validateRegisters(test_params) != 0)
+    {
+        return {};
+    }
+    metrics["sla_load_ms"] = elapsed_ns(start) / 1e6;
+
+    emulator_states.resize(tests.size());
+    for(unsigned int i = 0; i < tests.size(); i++)
+    {
+        prepare_readback(tests[i].final_state, emulator_states[i]);
+    }
+
+    start = BENCH_CLOCK::now();
+    if(sla_emulate(test_params, translator, tests[0].initial_state, emulator_states[0], exception_type, exception_message) != 0)
+    {
+        return {};
+    }
+    double first_test_ns = elapsed_ns(start);
+
+    // steady state execution
+    start = BENCH_CLOCK::now();
+    for(unsigned int i = 1; i < tests.size(); i++)
+    {
+        sla_emulate(test_params, translator, tests[i].initial_state, emulator_states[i], exception_type, exception_message);
+    }
+    double emulate_ns = tests.size() > 1 ? elapsed_ns(start) / (tests.size() - 1) : first_test_ns;
+
+    metrics["emulate_ns_per_test"] = emulate_ns;
+    metrics["emulator_setup_us"] = (first_test_ns - emulate_ns) / 1e3;
+
+    // comparator
+    start = BENCH_CLOCK::now();
+    for(unsigned int i = 0; i < tests.size(); i++)
+    {
+        vector<STATE_DIFF> diffs;
+
+        if(compare_state(test_params, tests[i].final_state, emulator_states[i], diffs) != 0)
+        {
+            failures++;
+        }
+    }
+    metrics["compare_ns_per_test"] = elapsed_ns(start) / tests.size();
+    metrics["failures"] = failures;
+
+    return metrics;
+}
+
+// end to end through parallelize_test() with console output discarded
+static double bench_throughput(TEST_PARAMS test_params, unsigned int num_threads, unsigned int num_tests)
+{
+    NullBuffer null_buffer;
+    std::streambuf *console = cout.rdbuf(&null_buffer);
+    int result = 0;
+
+    test_params.num_threads = num_threads;
+
+    auto start = BENCH_CLOCK::now();
+    result = parallelize_test(test_params);
+    double seconds = elapsed_ns(start) / 1e9;
+
+    cout.rdbuf(console);
+
+    if(result != 0)
+    {
+        return -1;
+    }
+
+    return num_tests / seconds;
+}
+
+// "metric value" per line
+static int read_baseline(const string &baseline_filename, map<string, double> &baseline)
+{
+    std::ifstream in(baseline_filename);
+    string metric;
+    double value = 0;
+
+    if(!in)
+    {
+        cout << "[-] Failed to open baseline " << baseline_filename << "!" << endl;
+        return -1;
+    }
+
+    while(in >> metric >> value)
+    {
+        baseline[metric] = value;
+    }
+
+    return 0;
+}
+
+static int write_baseline(const string &baseline_filename, const map<string, double> &metrics)
+{
+    std::ofstream out(baseline_filename, std::ios::trunc);
+
+    for(auto &[metric, value] : metrics)
+    {
+        out << metric << " " << std::fixed << std::setprecision(3) << value << "\n";
+    }
+
+    if(!out)
+    {
+        cout << "[-] Failed to write baseline " << baseline_filename << "!" << endl;
+        return -1;
+    }
+
+    cout << "[*] Wrote baseline " << baseline_filename << endl;
+
+    return 0;
+}
+
+// returns the number of metrics that regressed by more than tolerance percent.
+// Throughput metrics are better when higher, everything else when lower
+static unsigned int compare_baseline(const map<string, double> &metrics, const map<string, double> &baseline, double tolerance)
+{
+    unsigned int regressions = 0;
+
+    cout << "[*] Compared to baseline:" << endl;
+    for(auto &[metric, value] : metrics)
+    {
+        auto found = baseline.find(metric);
+        if(found == baseline.end() || found->second == 0 || metric == "failures" || metric == "peak_rss_kb")
+        {
+            continue;
+        }
+
+        bool higher_is_better = metric.compare(0, 10, "throughput") == 0;
+        double change = (value - found->second) / found->second * 100.0;
+        bool regressed = higher_is_better ? change < -tolerance : change > tolerance;
+
+        cout << "\t" << (regressed ? "[-] " : "[+] ") << std::left << std::setw(28) << metric << std::right <<
+            std::showpos << std::fixed << std::setprecision(1) << change << "%" << std::noshowpos << endl;
+
+        if(regressed)
+        {
+            regressions++;
+        }
+    }
+
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    boost::program_options::options_description desc{"Ghidra Processor Module Verifier Benchmarks"};
+    boost::program_options::variables_map args;
+    string sla_filename;
+    string test_filename = "bench_tests.json";
+    string baseline_filename;
+    string save_baseline_filename;
+    unsigned int num_tests = 20000;
+    unsigned int seed = 1;
+    double tolerance = 10.0;
+    vector<unsigned int> thread_counts;
+    TEST_PARAMS test_params;
+    map<string, double> metrics;
+
+    cout << "Ghidra Processor Module Verifier (Benchmarks)" << endl;
+
+    try
+    {
+        desc.add_options()
+            ("sla-file,s", boost::program_options::value<string>(&sla_filename), "Path to the compiled 6502 .sla. Required unless only generating")
+            ("tests,n", boost::program_options::value<unsigned int>(&num_tests), "Number of synthetic tests. Optional. 20000 if not specified")
+            ("seed", boost::program_options::value<unsigned int>(&seed), "Seed for the synthetic tests. Optional. 1 if not specified")
+            ("test-file", boost::program_options::value<string>(&test_filename), "Where to write the synthetic tests. Optional. bench_tests.json if not specified")
+            ("generate-only", "Write the synthetic tests and exit. Optional.")
+            ("threads,t", boost::program_options::value<vector<unsigned int>>(&thread_counts)->multitoken(), "Thread counts to sweep. Optional. Powers of two up to one per CPU if not specified")
+            ("baseline", boost::program_options::value<string>(&baseline_filename), "Baseline to compare against, exits with an error on regressions. Optional.")
+            ("save-baseline", boost::program_options::value<string>(&save_baseline_filename), "Write this run's results as a baseline. Optional.")
+            ("tolerance", boost::program_options::value<double>(&tolerance), "Allowed regression in percent. Optional. 10 if not specified")
+            ("help,h", "Help screen");
+
+        store(parse_command_line(argc, argv, desc), args);
+        notify(args);
+
+        if(args.count("help"))
+        {
+            cout << desc << endl;
+            return 0;
+        }
+
+        if(args.count("sla-file") == 0 && args.count("generate-only") == 0)
+        {
+            cout << "Sla filename is required!" << endl;
+            return -1;
+        }
+    }
+    catch (const boost::program_options::error &ex)
+    {
+        cout << "[-] Error parsing command line: " << ex.what() << endl;
+        return -1;
+    }
+
+    if(write_synthetic_tests(test_filename, num_tests, seed) != 0)
+    {
+        return -1;
+    }
+    cout << "[*] Generated " << num_tests << " synthetic tests in " << test_filename << endl;
+
+    if(args.count("generate-only"))
+    {
+        return 0;
+    }
+
+    if(thread_counts.empty())
+    {
+        unsigned int cpus = max(1u, boost::thread::hardware_concurrency());
+
+        for(unsigned int threads = 1; threads < cpus; threads *= 2)
+        {
+            thread_counts.push_back(threads);
+        }
+        thread_counts.push_back(cpus);
+    }
+
+    bench_test_params(test_params, sla_filename, test_filename);
+
+    metrics = bench_phases(test_params);
+    if(metrics.empty())
+    {
+        cout << "[-] Phase benchmark failed!" << endl;
+        return -1;
+    }
+
+    for(auto threads : thread_counts)
+    {
+        double tests_per_second = bench_throughput(test_params, threads, num_tests);
+        if(tests_per_second < 0)
+        {
+            cout << "[-] Throughput benchmark failed with " << threads << " threads!" << endl;
+            return -1;
+        }
+
+        metrics["throughput_" + to_string(threads) + "_threads"] = tests_per_second;
+    }
+
+    metrics["peak_rss_kb"] = peak_rss_kb();
+
+    cout << "[*] Results:" << endl;
+    for(auto &[metric, value] : metrics)
+    {
+        cout << "\t" << std::left << std::setw(28) << metric << std::right << std::fixed << std::setprecision(1) << value << endl;
+    }
+
+    if(metrics["failures"] != 0)
+    {
+        cout << "[*] " << metrics["failures"] << " synthetic tests failed, check the .sla is the 6502" << endl;
+    }
+
+    if(!save_baseline_filename.empty() && write_baseline(save_baseline_filename, metrics) != 0)
+    {
+        return -1;
+    }
+
+    if(!baseline_filename.empty())
+    {
+        map<string, double> baseline;
+
+        if(read_baseline(baseline_filename, baseline) != 0)
+        {
+            return -1;
+        }
+
+        unsigned int regressions = compare_baseline(metrics, baseline, tolerance);
+        if(regressions != 0)
+        {
+            cout << "[-] " << regressions << " metric(s) regressed by more than " << tolerance << "%" << endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -15,33 +15,51 @@
 #include <exception>
 #include <boost/unordered_map.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <glob.h>
 #include <boost/asio/post.hpp>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/bind.hpp>
 #include "state.h"
-#include "sla_util.h"
 #include "backends/json.h"
 #include "backends/sla_emulator.h"
+#include "backends/trace.h"
+#include "result_writers.h"
+#include "shard.h"
+#include "sla_util.h"
 
 using namespace std;
 
+int merge_command(int argc, char *argv[]);
+int expand_test_files(const vector<string> &test_args, vector<string> &test_files);
 void default_test_params(TEST_PARAMS &test_params);
 void display_test_params(TEST_PARAMS &test_params);
-int parse_register_mapping(string register_mapping_filename, map<std::string, std::string>& register_mapping);
 int parallelize_test(TEST_PARAMS &test_params);
+int trace_test(TEST_PARAMS &test_params);
 
 int main(int argc, char *argv[])
 {
     boost::program_options::options_description desc{"Ghidra Processor Module Verifier"};
     boost::program_options::variables_map args;
     TEST_PARAMS test_params;
+    vector<string> test_args;
+    vector<string> sla_files;
+    string ldefs;
+    string shard;
     int result = 0;
 
     default_test_params(test_params);
 
     cout << "Ghidra Processor Module Verifier (Verifier)" << endl;
 
+    if(argc > 1 && string(argv[1]) == "merge")
+    {
+        return merge_command(argc - 1, argv + 1);
+    }
+
     //
     // command line arg parsing
     //
@@ -49,14 +67,31 @@ int main(int argc, char *argv[])
     try
     {
         desc.add_options()
-            ("sla-file,s",boost::program_options::value<string>(&test_params.sla_filename), "Path to the compiled processor .sla. Required")
-            ("json-test,j", boost::program_options::value<string>(&test_params.json_filename), "Path to json test file. Required")
+            ("sla-file,s",boost::program_options::value<vector<string>>(&sla_files)->multitoken()->composing(), "Path to the compiled processor .sla. Required. A second .sla is a baseline, only tests whose outcome differs between the two are reported")
+            ("matrix", "Run every test file on every --sla-file, each .sla a variant rather than a baseline, and report the results as one matrix. Optional.")
+            ("ldefs", boost::program_options::value<string>(&ldefs), "Path to a Ghidra .ldefs, the .sla of each of its languages is a --matrix variant. Optional.")
+            ("json-test,j", boost::program_options::value<vector<string>>(&test_args)->multitoken()->composing(), "Json test files or test packs. Accepts several paths, directories, globs and @file lists. Required")
             ("program-counter,p", boost::program_options::value<string>(&test_params.program_counter), "Name of the program counter register. Required")
             ("start-test", boost::program_options::value<unsigned int>(&test_params.start_test), "First test to start with. Optional. 0 if not specified")
             ("end-test", boost::program_options::value<unsigned int>(&test_params.end_test), "Last test to end with. Optional. MAX_INT if not specified")
-            ("num-threads,t", boost::program_options::value<unsigned int>(&test_params.num_threads), "How many threads to use. Optional. 1 if not specified")
+            ("num-threads,t", boost::program_options::value<unsigned int>(&test_params.num_threads), "How many threads to use. Optional. One per CPU if not specified or 0")
+            ("pin-threads", "Bind each worker thread to its own CPU. Optional.")
             ("max-failures", boost::program_options::value<unsigned int>(&test_params.max_failures), "Maximum numberof test failures allowed before aborting test. Optional. 10 if not specified")
             ("register-map", boost::program_options::value<string>(&test_params.register_map_filename), "Path to file containing mapping of test registers to Ghidra processor module registers. Optional.")
+            ("verbose,v", "Print a line for every passing test, not just failures. Optional.")
+            ("ordered", "Write results in test order instead of completion order. Optional.")
+            ("results", boost::program_options::value<string>(&test_params.results_filename), "Path to write a record for every test to. Optional.")
+            ("results-format", boost::program_options::value<string>(&test_params.results_format), "Format of the results file, jsonl or junit. Optional. junit for .xml files, jsonl otherwise")
+            ("no-translation-cache", "Translate every instruction from scratch instead of reusing translations of identical instruction bytes. Optional.")
+            ("shard", boost::program_options::value<string>(&shard), "Run only shard i of N (i/N, 1 based) of the files, or of each file's tests if there are fewer files than shards. Optional.")
+            ("summary", boost::program_options::value<string>(&test_params.summary_filename), "Path to write a compact run summary to, shard summaries are combined with verifier merge. Optional.")
+            ("result-cache", boost::program_options::value<string>(&test_params.result_cache_filename), "Path to a cache of test outcomes. Tests whose instruction translates to the same p-code as in an earlier run are not emulated again. Optional.")
+            ("isolate", "Run the tests in worker processes, a test that crashes the emulator is reported as a crash and its worker replaced. Optional.")
+            ("checkpoint", boost::program_options::value<string>(&test_params.checkpoint_filename), "Path to save --isolate progress to while the run is going. Optional.")
+            ("resume", "Continue an interrupted --isolate run from its --checkpoint file. Optional.")
+            ("bus-access", "Also compare every RAM read and write an instruction makes, and their order, with the tests' cycles. Optional.")
+            ("trace", boost::program_options::value<string>(&test_params.trace_filename), "Path to a recorded execution trace (.vtr) to verify instead of test files. Optional.")
+            ("trace-segment", boost::program_options::value<unsigned long long>(&test_params.trace_segment_steps), "Steps of the --trace verified from each checkpoint, segments run in parallel. Optional. 100000 if not specified")
             ("help,h", "Help screen");
 
         store(parse_command_line(argc, argv, desc), args);
@@ -68,13 +103,126 @@ int main(int argc, char *argv[])
             return 0;
         }
 
-        if(args.count("sla-file") == 0)
+        if(args.count("pin-threads"))
+        {
+            test_params.pin_threads = true;
+        }
+
+        if(args.count("verbose"))
         {
-            cout << "Sla filename is required!" << endl;
+            test_params.verbose = true;
+        }
+
+        if(args.count("ordered"))
+        {
+            test_params.ordered_results = true;
+        }
+
+        if(args.count("no-translation-cache"))
+        {
+            test_params.translation_cache = false;
+        }
+
+        if(args.count("isolate"))
+        {
+            test_params.isolate = true;
+        }
+
+        if(args.count("resume"))
+        {
+            test_params.resume = true;
+        }
+
+        if(args.count("bus-access"))
+        {
+            test_params.bus_access = true;
+        }
+
+        if(!test_params.isolate && (args.count("checkpoint") || test_params.resume))
+        {
+            cout << "--checkpoint and --resume need --isolate!" << endl;
             return -1;
         }
 
-        if(args.count("json-test") == 0)
+        if(test_params.resume && args.count("checkpoint") == 0)
+        {
+            cout << "--resume needs a --checkpoint file!" << endl;
+            return -1;
+        }
+
+        if(args.count("matrix") || args.count("ldefs"))
+        {
+            // every .sla is a variant named after its file, or after its language in the .ldefs
+            for(auto &sla_file : sla_files)
+            {
+                string name = boost::filesystem::path(sla_file).stem().string();
+
+                if(find(test_params.matrix_names.begin(), test_params.matrix_names.end(), name) != test_params.matrix_names.end())
+                {
+                    name = sla_file;
+                }
+
+                test_params.matrix_sla_files.push_back(sla_file);
+                test_params.matrix_names.push_back(name);
+            }
+
+            if(!ldefs.empty() && sla_read_ldefs(ldefs, test_params.matrix_sla_files, test_params.matrix_names) != 0)
+            {
+                return -1;
+            }
+
+            if(test_params.matrix_sla_files.empty())
+            {
+                cout << "--matrix needs sla files or an --ldefs file!" << endl;
+                return -1;
+            }
+
+            if(test_params.isolate)
+            {
+                cout << "--matrix can't be combined with --isolate!" << endl;
+                return -1;
+            }
+
+            test_params.sla_filename = test_params.matrix_sla_files[0];
+        }
+        else
+        {
+            if(sla_files.size() > 2)
+            {
+                cout << "At most two sla files, the module to test and a baseline! Did you mean --matrix?" << endl;
+                return -1;
+            }
+
+            if(sla_files.size() == 2)
+            {
+                test_params.baseline_sla_filename = sla_files[1];
+            }
+
+            if(sla_files.empty())
+            {
+                cout << "Sla filename is required!" << endl;
+                return -1;
+            }
+
+            test_params.sla_filename = sla_files[0];
+        }
+
+        if(!test_params.trace_filename.empty())
+        {
+            // a trace is one continuous execution, not a set of tests to spread out or compare
+            if(args.count("json-test") || !test_params.matrix_sla_files.empty() || !test_params.baseline_sla_filename.empty() ||
+               test_params.isolate || test_params.bus_access || args.count("shard") || args.count("summary") || args.count("result-cache"))
+            {
+                cout << "--trace can't be combined with --json-test, --matrix, a baseline, --isolate, --bus-access, --shard, --summary or --result-cache!" << endl;
+                return -1;
+            }
+
+            if(test_params.trace_segment_steps == 0)
+            {
+                test_params.trace_segment_steps = TRACE_SEGMENT_STEPS;
+            }
+        }
+        else if(args.count("json-test") == 0)
         {
             cout << "JSON test filename is required!" << endl;
             return -1;
@@ -92,13 +240,34 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    result = sla_get_word_size(test_params.sla_filename, test_params.word_size);
+    if(!test_params.trace_filename.empty())
+    {
+        // results name the trace as the file every step came from
+        test_params.test_files.push_back(test_params.trace_filename);
+    }
+
+    result = expand_test_files(test_args, test_params.test_files);
     if(result != 0)
     {
-        cout << "[-] Failed to get word size from " << test_params.sla_filename << "!" << endl;
-        return result;
+        return -1;
+    }
+
+    if(test_params.test_files.empty())
+    {
+        cout << "[-] No test files found!" << endl;
+        return -1;
     }
 
+    if(!shard.empty())
+    {
+        if(parse_shard(shard, test_params) != 0)
+        {
+            return -1;
+        }
+        shard_test_files(test_params);
+    }
+    test_params.json_filename = test_params.test_files[0];
+
     result = parse_register_mapping(test_params.register_map_filename, test_params.register_map);
     if(result != 0)
     {
@@ -108,13 +277,19 @@ int main(int argc, char *argv[])
 
     if(test_params.num_threads == 0)
     {
-        cout << "[-] Number of threads must be positive!" << endl;
+        test_params.num_threads = max(1u, boost::thread::hardware_concurrency());
+    }
+
+    test_params.results_format = get_results_format(test_params.results_filename, test_params.results_format);
+    if(test_params.results_format != "jsonl" && test_params.results_format != "junit")
+    {
+        cout << "[-] Results format must be jsonl or junit!" << endl;
         return -1;
     }
 
     display_test_params(test_params);
 
-    result = parallelize_test(test_params);
+    result = test_params.trace_filename.empty() ? parallelize_test(test_params) : trace_test(test_params);
     if(result != 0)
     {
         cout << "[-] Test failed: " << result << endl;
@@ -124,6 +299,41 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+// verifier merge <summary files>: combine the --summary files of every shard of a run
+int merge_command(int argc, char *argv[])
+{
+    boost::program_options::options_description desc{"verifier merge <summary files>"};
+    boost::program_options::positional_options_description positional;
+    boost::program_options::variables_map args;
+    vector<string> summary_files;
+    string output_filename;
+
+    try
+    {
+        desc.add_options()
+            ("summary", boost::program_options::value<vector<string>>(&summary_files)->multitoken(), "Summary files written by --summary, one per shard. Required")
+            ("output,o", boost::program_options::value<string>(&output_filename), "Path to write the merged summary to. Optional.")
+            ("help,h", "Help screen");
+        positional.add("summary", -1);
+
+        store(boost::program_options::command_line_parser(argc, argv).options(desc).positional(positional).run(), args);
+        notify(args);
+
+        if(args.count("help") || argc == 1)
+        {
+            cout << desc << endl;
+            return 0;
+        }
+    }
+    catch (const boost::program_options::error &ex)
+    {
+        cout << "[-] Error parsing command line: " << ex.what() << endl;
+        return -1;
+    }
+
+    return merge_summaries(summary_files, output_filename);
+}
+
 // default test params for optional params if not specified at the command line
 void default_test_params(TEST_PARAMS &test_params)
 {
@@ -131,76 +341,167 @@ void default_test_params(TEST_PARAMS &test_params)
     test_params.start_test = 0;
     test_params.end_test = 0xFFFFFFFF; // if not set will be reduced to num of submitted tests
     test_params.word_size = 0;
-    test_params.num_threads = 1;
+    test_params.num_threads = 0;
+    test_params.pin_threads = false;
+    test_params.translation_cache = true;
+    test_params.verbose = false;
+    test_params.ordered_results = false;
 }
 
 // default test params for optional params if not specified at the command line
 void display_test_params(TEST_PARAMS &test_params)
 {
     cout << "[*] Settings:" << endl;
-    cout << "\t[*] Compiled SLA file: " << test_params.sla_filename << endl;
-    cout << "\t[*] JSON Test file: " << test_params.json_filename << endl;
+    if(!test_params.matrix_sla_files.empty())
+    {
+        cout << "\t[*] Matrix variants: " << test_params.matrix_sla_files.size() << endl;
+        for(unsigned int i = 0; i < test_params.matrix_sla_files.size(); i++)
+        {
+            cout << "\t\t[*] " << test_params.matrix_names[i] << ": " << test_params.matrix_sla_files[i] << endl;
+        }
+    }
+    else
+    {
+        cout << "\t[*] Compiled SLA file: " << test_params.sla_filename << endl;
+    }
+    if(!test_params.baseline_sla_filename.empty())
+    {
+        cout << "\t[*] Baseline SLA file: " << test_params.baseline_sla_filename << " (only divergent tests are reported)" << endl;
+    }
+    if(!test_params.trace_filename.empty())
+    {
+        cout << "\t[*] Trace file: " << test_params.trace_filename << " (checkpoint every " << test_params.trace_segment_steps << " steps)" << endl;
+    }
+    else if(test_params.test_files.size() == 1)
+    {
+        cout << "\t[*] JSON Test file: " << test_params.json_filename << endl;
+    }
+    else
+    {
+        cout << "\t[*] JSON Test files: " << test_params.test_files.size() << endl;
+    }
     cout << "\t[*] Program counter register: " << test_params.program_counter << endl;
-    cout << "\t[*] Word size: " << test_params.word_size << endl;
     cout << "\t[*] Register Mapping Count: " << test_params.register_map.size() << endl;
     cout << "\t[*] Max allowed failures: " << test_params.max_failures << endl;
     cout << "\t[*] Start test: " << test_params.start_test << endl;
+    cout << "\t[*] Threads: " << test_params.num_threads << (test_params.pin_threads ? " (pinned)" : "") << endl;
+    if(test_params.isolate)
+    {
+        cout << "\t[*] Isolated: " << test_params.num_threads << " worker processes" << endl;
+    }
+    if(!test_params.checkpoint_filename.empty())
+    {
+        cout << "\t[*] Checkpoint file: " << test_params.checkpoint_filename << (test_params.resume ? " (resuming)" : "") << endl;
+    }
+    if(!test_params.results_filename.empty())
+    {
+        cout << "\t[*] Results file: " << test_params.results_filename << " (" << test_params.results_format << ")" << endl;
+    }
+    if(test_params.bus_access)
+    {
+        cout << "\t[*] Bus accesses: compared with the tests' cycles" << endl;
+    }
+    cout << "\t[*] Translation cache: " << (test_params.translation_cache ? "enabled" : "disabled") << endl;
+    if(!test_params.result_cache_filename.empty())
+    {
+        cout << "\t[*] Result cache: " << test_params.result_cache_filename << endl;
+    }
+    if(test_params.shard_count > 1)
+    {
+        cout << "\t[*] Shard: " << test_params.shard_index + 1 << "/" << test_params.shard_count << (test_params.shard_by_file ? " of the test files" : " of each file's tests") << endl;
+    }
+    if(!test_params.summary_filename.empty())
+    {
+        cout << "\t[*] Summary file: " << test_params.summary_filename << endl;
+    }
     cout << "\t[*] Register Mapping Count: " << test_params.register_map.size() << endl;
 }
 
-int parse_register_mapping(string register_map_filename, map<std::string, std::string>& register_map)
+// Expand the --json-test arguments into the list of test files. Each argument is a file,
+// a directory (every .json and .vpk in it, optionally .gz or .zst compressed), a glob or @path to a file listing one argument
+// per line. Directories and globs expand in sorted order
+int expand_test_files(const vector<string> &test_args, vector<string> &test_files)
 {
-    string line;
-    string test_reg;
-    string ghidra_reg;
-    unsigned int equal_pos = 0;
-    unsigned int num_reg_mappings = 0;
-
-    if(register_map_filename == "")
+    for(auto &test_arg : test_args)
     {
-        // nothing to do
-        return 0;
-    }
-
-    boost::filesystem::ifstream file_handler(register_map_filename);
-
-    while (getline(file_handler, line))
-    {
-        if(line.length() == 0)
+        if(test_arg.size() > 1 && test_arg[0] == '@')
         {
-            // empty line
-            continue;
+            vector<string> listed;
+            string line;
+            boost::filesystem::ifstream list_file(test_arg.substr(1));
+
+            if(!list_file)
+            {
+                cout << "[-] Failed to open test file list " << test_arg.substr(1) << "!" << endl;
+                return -1;
+            }
+
+            while(getline(list_file, line))
+            {
+                boost::algorithm::trim(line);
+                if(line.length() == 0 || line[0] == '#')
+                {
+                    continue;
+                }
+
+                listed.push_back(line);
+            }
+
+            if(expand_test_files(listed, test_files) != 0)
+            {
+                return -1;
+            }
         }
-
-        if(line[0] == '#' || line[0] == '=')
+        else if(boost::filesystem::is_directory(test_arg))
         {
-            // skip comments, invalid
-            continue;
+            vector<string> found;
+
+            for(auto &entry : boost::filesystem::directory_iterator(test_arg))
+            {
+                boost::filesystem::path name = entry.path();
+                string extension = boost::algorithm::to_lower_copy(name.extension().string());
+
+                // ea.json.gz and ea.vpk.zst are picked up too
+                if(extension == ".gz" || extension == ".zst")
+                {
+                    extension = boost::algorithm::to_lower_copy(name.stem().extension().string());
+                }
+
+                if(boost::filesystem::is_regular_file(entry.path()) && (extension == ".json" || extension == ".vpk"))
+                {
+                    found.push_back(entry.path().string());
+                }
+            }
+
+            sort(found.begin(), found.end());
+            test_files.insert(test_files.end(), found.begin(), found.end());
         }
-
-        equal_pos = line.find("=");
-        if(equal_pos == string::npos)
+        else if(test_arg.find_first_of("*?[") != string::npos)
         {
-            // didn't have =
-            continue;
+            glob_t matches;
+
+            if(glob(test_arg.c_str(), 0, nullptr, &matches) != 0)
+            {
+                cout << "[-] No test files match " << test_arg << "!" << endl;
+                return -1;
+            }
+
+            // glob() sorts its results
+            for(size_t i = 0; i < matches.gl_pathc; i++)
+            {
+                test_files.push_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
         }
-
-        if(equal_pos == line.length() - 1)
+        else if(boost::filesystem::is_regular_file(test_arg))
         {
-            // line ends with = sign
-            continue;
+            test_files.push_back(test_arg);
+        }
+        else
+        {
+            cout << "[-] Test file " << test_arg << " does not exist!" << endl;
+            return -1;
         }
-
-        test_reg = line.substr(0, equal_pos);
-        ghidra_reg = line.substr(equal_pos + 1, line.length());
-
-        register_map[test_reg] = ghidra_reg;
-    }
-
-    num_reg_mappings = register_map.size();
-    if(num_reg_mappings == 0)
-    {
-        return -1;
     }
 
     return 0;
@@ -0,0 +1,229 @@
+//--------------------------------------------------------------------------------------
+// File: profiler.cpp
+//
+// Low overhead per-phase timing of the hot path. Built with make PROFILE=1, otherwise
+// every macro compiles out to nothing
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "profiler.h"
+
+#ifdef VERIFIER_PROFILE
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <boost/chrono.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+// slowest tests kept per thread and reported
+#define PROFILE_SLOWEST_TESTS 10
+
+// opcodes reported
+#define PROFILE_SLOWEST_OPCODES 10
+
+typedef struct _PROFILE_TEST
+{
+    unsigned int file_index;
+    unsigned int test_id;
+    uint64_t ticks;
+} PROFILE_TEST, *PPROFILE_TEST;
+
+// Everything one thread records. Only its own thread writes to it, so nothing on the hot
+// path is shared or locked. Threads register their data once, the report reads it after
+// the workers are joined
+typedef struct _PROFILE_THREAD
+{
+    uint64_t phase_ticks[PHASE_COUNT];
+    uint64_t phase_calls[PHASE_COUNT];
+    uint64_t opcode_ticks[256];
+    uint64_t opcode_tests[256];
+    vector<uint32_t> test_ticks; // per test latency, clamped
+    vector<PROFILE_TEST> slowest; // sorted, slowest first
+
+    _PROFILE_THREAD() : phase_ticks(), phase_calls(), opcode_ticks(), opcode_tests() {}
+} PROFILE_THREAD, *PPROFILE_THREAD;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "sla load",
+    "register discovery",
+    "test loading",
+    "  waiting on workers",
+    "emulator setup",
+    "emulator reset",
+    "initial state",
+    "execute",
+    "  decode",
+    "final state readback",
+    "compare",
+    "result cache key",
+    "result handoff",
+    "result output"
+};
+
+static boost::mutex profile_lock;
+static vector<shared_ptr<PROFILE_THREAD>> profile_threads;
+static unsigned int profile_generation = 1;
+static uint64_t start_ticks = 0;
+static boost::chrono::steady_clock::time_point start_time;
+
+// the calling thread's data for the current run, registered on first use
+static PROFILE_THREAD &profile_thread(void)
+{
+    static thread_local shared_ptr<PROFILE_THREAD> data;
+    static thread_local unsigned int generation = 0;
+
+    if(generation != profile_generation)
+    {
+        boost::lock_guard<boost::mutex> guard(profile_lock);
+
+        data.reset(new PROFILE_THREAD());
+        profile_threads.push_back(data);
+        generation = profile_generation;
+    }
+
+    return *data;
+}
+
+void profile_add(PROFILE_PHASE phase, uint64_t ticks)
+{
+    PROFILE_THREAD &data = profile_thread();
+
+    data.phase_ticks[phase] += ticks;
+    data.phase_calls[phase]++;
+}
+
+void profile_test(unsigned int file_index, unsigned int test_id, int opcode, uint64_t ticks)
+{
+    PROFILE_THREAD &data = profile_thread();
+
+    data.test_ticks.push_back((uint32_t)min(ticks, (uint64_t)UINT32_MAX));
+
+    if(opcode >= 0 && opcode < 256)
+    {
+        data.opcode_ticks[opcode] += ticks;
+        data.opcode_tests[opcode]++;
+    }
+
+    if(data.slowest.size() < PROFILE_SLOWEST_TESTS || ticks > data.slowest.back().ticks)
+    {
+        PROFILE_TEST test = {file_index, test_id, ticks};
+        auto position = upper_bound(data.slowest.begin(), data.slowest.end(), test,
+            [](const PROFILE_TEST &a, const PROFILE_TEST &b) { return a.ticks > b.ticks; });
+
+        data.slowest.insert(position, test);
+        if(data.slowest.size() > PROFILE_SLOWEST_TESTS)
+        {
+            data.slowest.pop_back();
+        }
+    }
+}
+
+// start a new run, data from threads of earlier runs is dropped
+void profile_reset(void)
+{
+    boost::lock_guard<boost::mutex> guard(profile_lock);
+
+    profile_threads.clear();
+    profile_generation++;
+    start_ticks = profile_ticks();
+    start_time = boost::chrono::steady_clock::now();
+}
+
+void profile_report(TEST_PARAMS &test_params)
+{
+    boost::lock_guard<boost::mutex> guard(profile_lock);
+    uint64_t phase_ticks[PHASE_COUNT] = {};
+    uint64_t phase_calls[PHASE_COUNT] = {};
+    uint64_t opcode_ticks[256] = {};
+    uint64_t opcode_tests[256] = {};
+    vector<uint32_t> test_ticks;
+    vector<PROFILE_TEST> slowest;
+
+    // ticks to nanoseconds, calibrated against the steady clock over the whole run
+    double elapsed_ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::steady_clock::now() - start_time).count();
+    uint64_t elapsed_ticks = profile_ticks() - start_ticks;
+    double ns_per_tick = elapsed_ticks ? elapsed_ns / elapsed_ticks : 1.0;
+
+    for(auto &data : profile_threads)
+    {
+        for(int i = 0; i < PHASE_COUNT; i++)
+        {
+            phase_ticks[i] += data->phase_ticks[i];
+            phase_calls[i] += data->phase_calls[i];
+        }
+
+        for(int i = 0; i < 256; i++)
+        {
+            opcode_ticks[i] += data->opcode_ticks[i];
+            opcode_tests[i] += data->opcode_tests[i];
+        }
+
+        test_ticks.insert(test_ticks.end(), data->test_ticks.begin(), data->test_ticks.end());
+        slowest.insert(slowest.end(), data->slowest.begin(), data->slowest.end());
+    }
+
+    cout << "[*] Profile (" << profile_threads.size() << " threads, times summed over threads):" << endl;
+    cout << "\t" << left << setw(24) << "phase" << right << setw(12) << "calls" << setw(14) << "total ms" << setw(12) << "avg ns" << endl;
+    for(int i = 0; i < PHASE_COUNT; i++)
+    {
+        if(phase_calls[i] == 0)
+        {
+            continue;
+        }
+
+        double total_ns = phase_ticks[i] * ns_per_tick;
+
+        cout << "\t" << left << setw(24) << phase_names[i] << right << setw(12) << phase_calls[i] <<
+            setw(14) << fixed << setprecision(1) << total_ns / 1e6 << setw(12) << setprecision(0) << total_ns / phase_calls[i] << endl;
+    }
+
+    if(test_ticks.empty())
+    {
+        return;
+    }
+
+    sort(test_ticks.begin(), test_ticks.end());
+    auto percentile = [&](double p) { return test_ticks[min(test_ticks.size() - 1, (size_t)(p * test_ticks.size()))] * ns_per_tick; };
+
+    cout << "[*] Test latency (ns): p50 " << fixed << setprecision(0) << percentile(0.50) << " p90 " << percentile(0.90) <<
+        " p99 " << percentile(0.99) << " p99.9 " << percentile(0.999) << " max " << test_ticks.back() * ns_per_tick << endl;
+
+    sort(slowest.begin(), slowest.end(), [](const PROFILE_TEST &a, const PROFILE_TEST &b) { return a.ticks > b.ticks; });
+    cout << "[*] Slowest tests:" << endl;
+    for(unsigned int i = 0; i < slowest.size() && i < PROFILE_SLOWEST_TESTS; i++)
+    {
+        cout << "\t" << test_params.test_files[slowest[i].file_index] << " " << slowest[i].test_id << ": " <<
+            fixed << setprecision(0) << slowest[i].ticks * ns_per_tick << " ns" << endl;
+    }
+
+    vector<int> opcodes;
+    for(int i = 0; i < 256; i++)
+    {
+        if(opcode_tests[i] != 0)
+        {
+            opcodes.push_back(i);
+        }
+    }
+
+    sort(opcodes.begin(), opcodes.end(), [&](int a, int b)
+    {
+        return (double)opcode_ticks[a] / opcode_tests[a] > (double)opcode_ticks[b] / opcode_tests[b];
+    });
+
+    cout << "[*] Slowest opcodes (first instruction byte, average ns):" << endl;
+    for(unsigned int i = 0; i < opcodes.size() && i < PROFILE_SLOWEST_OPCODES; i++)
+    {
+        int opcode = opcodes[i];
+
+        cout << "\t" << hex << setw(2) << setfill('0') << opcode << dec << setfill(' ') << ": " <<
+            fixed << setprecision(0) << opcode_ticks[opcode] * ns_per_tick / opcode_tests[opcode] << " ns over " << opcode_tests[opcode] << " tests" << endl;
+    }
+}
+
+#endif
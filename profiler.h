@@ -0,0 +1,78 @@
+//--------------------------------------------------------------------------------------
+// File: profiler.h
+//
+// Low overhead per-phase timing of the hot path. Built with make PROFILE=1, otherwise
+// every macro compiles out to nothing
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "state.h"
+
+typedef enum _PROFILE_PHASE
+{
+    PHASE_SLA_LOAD, // parsing the .sla, once per run
+    PHASE_REGISTERS, // resolving the test registers, once per run
+    PHASE_LOAD, // loader thread, reading the test files
+    PHASE_LOAD_WAIT, // loader thread, blocked on a full scheduler (inside PHASE_LOAD)
+    PHASE_CONTEXT_INIT, // building a worker's translator and emulator, once per worker
+    PHASE_RESET, // clearing the emulator between tests
+    PHASE_STATE_LOAD, // writing the initial state into the emulator
+    PHASE_EXECUTE, // executeInstruction(), decode and p-code
+    PHASE_DECODE, // instruction decode and p-code generation (inside PHASE_EXECUTE)
+    PHASE_READBACK, // reading the final state out of the emulator
+    PHASE_COMPARE, // comparing against the expected state
+    PHASE_FINGERPRINT, // result cache key, the reset and state load it does are counted in theirs
+    PHASE_SUBMIT, // handing the result to the writer thread
+    PHASE_OUTPUT, // writer thread, formatting and writing results
+    PHASE_COUNT
+} PROFILE_PHASE;
+
+#ifdef VERIFIER_PROFILE
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t profile_ticks(void) { return __rdtsc(); }
+#else
+#include <boost/chrono.hpp>
+static inline uint64_t profile_ticks(void)
+{
+    return boost::chrono::duration_cast<boost::chrono::nanoseconds>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+void profile_add(PROFILE_PHASE phase, uint64_t ticks);
+void profile_test(unsigned int file_index, unsigned int test_id, int opcode, uint64_t ticks);
+void profile_reset(void);
+void profile_report(TEST_PARAMS &test_params);
+
+// times the enclosing scope
+class ProfileScope
+{
+    PROFILE_PHASE phase;
+    uint64_t start;
+
+public:
+    ProfileScope(PROFILE_PHASE profile_phase) : phase(profile_phase), start(profile_ticks()) {}
+    ~ProfileScope(void) { profile_add(phase, profile_ticks() - start); }
+};
+
+#define PROFILE_SCOPE(phase) ProfileScope profile_scope_##phase(phase)
+#define PROFILE_TEST_START(name) uint64_t name = profile_ticks()
+#define PROFILE_TEST_END(name, file_index, test_id, opcode) profile_test(file_index, test_id, opcode, profile_ticks() - name)
+#define PROFILE_RESET() profile_reset()
+#define PROFILE_REPORT(test_params) profile_report(test_params)
+
+#else
+
+#define PROFILE_SCOPE(phase)
+#define PROFILE_TEST_START(name)
+#define PROFILE_TEST_END(name, file_index, test_id, opcode)
+#define PROFILE_RESET()
+#define PROFILE_REPORT(test_params)
+
+#endif
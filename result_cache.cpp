@@ -0,0 +1,345 @@
+//--------------------------------------------------------------------------------------
+// File: result_cache.cpp
+//
+// On disk cache of test outcomes keyed by what the outcome depends on, so a rerun after
+// a .sla change only emulates the tests whose instruction now translates differently
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "result_cache.h"
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <boost/filesystem.hpp>
+
+#define FNV128_OFFSET_HIGH 0x6c62272e07bb0142ULL
+#define FNV128_OFFSET_LOW 0x62b821756295c58dULL
+#define FNV128_PRIME_HIGH 0x0000000001000000ULL
+#define FNV128_PRIME_LOW 0x000000000000013bULL
+
+ResultHasher::ResultHasher(void)
+{
+    state = ((unsigned __int128)FNV128_OFFSET_HIGH << 64) | FNV128_OFFSET_LOW;
+}
+
+void ResultHasher::add(const void *data, size_t length)
+{
+    static const unsigned __int128 prime = ((unsigned __int128)FNV128_PRIME_HIGH << 64) | FNV128_PRIME_LOW;
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    for(size_t i = 0; i < length; i++)
+    {
+        state ^= bytes[i];
+        state *= prime;
+    }
+}
+
+void ResultHasher::add(const string &value)
+{
+    add<uint32_t>(value.size());
+    add(value.data(), value.size());
+}
+
+// only what is present, registers a test doesn't list don't change the key
+void ResultHasher::addState(const TEST_STATE &state)
+{
+    add(state.register_mask);
+    for(unsigned int i = 0; i < MAX_TEST_REGISTERS; i++)
+    {
+        if(state.register_mask & (1ULL << i))
+        {
+            add(state.registers[i]);
+        }
+    }
+
+    add<uint64_t>(state.memory.size());
+    add(state.memory.addresses.data(), state.memory.size() * sizeof(unsigned long long));
+    add(state.memory.values.data(), state.memory.size());
+}
+
+RESULT_KEY ResultHasher::getKey(void) const
+{
+    RESULT_KEY key;
+
+    key.high = (unsigned long long)(state >> 64);
+    key.low = (unsigned long long)state;
+
+    return key;
+}
+
+void put_bytes(string &out, const void *data, size_t length)
+{
+    out.append((const char *)data, length);
+}
+
+bool get_bytes(const char *&ptr, const char *end, void *data, size_t length)
+{
+    if((size_t)(end - ptr) < length)
+    {
+        return false;
+    }
+
+    memcpy(data, ptr, length);
+    ptr += length;
+
+    return true;
+}
+
+void put_string(string &out, const string &value)
+{
+    put_value<uint32_t>(out, value.size());
+    out += value;
+}
+
+bool get_string(const char *&ptr, const char *end, string &value)
+{
+    uint32_t length = 0;
+
+    if(!get_value(ptr, end, length) || (size_t)(end - ptr) < length)
+    {
+        return false;
+    }
+
+    value.assign(ptr, length);
+    ptr += length;
+
+    return true;
+}
+
+void encode_outcome(string &out, const TEST_RESULT &result)
+{
+    put_value<uint32_t>(out, result.status);
+    put_string(out, result.error);
+    put_string(out, result.exception_type);
+    put_string(out, result.exception_message);
+
+    put_value<uint32_t>(out, result.diffs.size());
+    for(auto &diff : result.diffs)
+    {
+        put_value<uint32_t>(out, diff.kind);
+        put_value<uint32_t>(out, diff.register_index);
+        put_value<uint64_t>(out, diff.address);
+        put_value<uint32_t>(out, diff.expected);
+        put_value<uint32_t>(out, diff.actual);
+    }
+
+    if(result.status == TEST_PASS)
+    {
+        return;
+    }
+
+    const TEST_STATE &state = result.emulator_state;
+
+    put_bytes(out, state.registers, sizeof(state.registers));
+    put_value<uint64_t>(out, state.register_mask);
+    put_value<uint32_t>(out, state.memory.size());
+    put_bytes(out, state.memory.addresses.data(), state.memory.size() * sizeof(unsigned long long));
+    put_bytes(out, state.memory.values.data(), state.memory.size());
+}
+
+// fills in a fresh result, may stop partway through a corrupt entry
+static bool decode_outcome_fields(const char *&ptr, const char *end, TEST_RESULT &result)
+{
+    uint32_t status = 0;
+    uint32_t count = 0;
+
+    if(!get_value(ptr, end, status) || status > TEST_CRASH || !get_string(ptr, end, result.error) ||
+       !get_string(ptr, end, result.exception_type) || !get_string(ptr, end, result.exception_message) ||
+       !get_value(ptr, end, count))
+    {
+        return false;
+    }
+
+    result.status = (TEST_STATUS)status;
+    result.diffs.clear();
+    for(uint32_t i = 0; i < count; i++)
+    {
+        STATE_DIFF diff;
+        uint32_t kind = 0;
+        uint64_t address = 0;
+
+        if(!get_value(ptr, end, kind) || kind > DIFF_WRITE_ORDER || !get_value(ptr, end, diff.register_index) ||
+           !get_value(ptr, end, address) || !get_value(ptr, end, diff.expected) || !get_value(ptr, end, diff.actual))
+        {
+            return false;
+        }
+
+        diff.kind = (DIFF_KIND)kind;
+        diff.address = address;
+        result.diffs.push_back(diff);
+    }
+
+    if(result.status == TEST_PASS)
+    {
+        return true;
+    }
+
+    TEST_STATE &state = result.emulator_state;
+    uint64_t mask = 0;
+
+    if(!get_bytes(ptr, end, state.registers, sizeof(state.registers)) || !get_value(ptr, end, mask) || !get_value(ptr, end, count) ||
+       (size_t)(end - ptr) < count * (sizeof(unsigned long long) + 1))
+    {
+        return false;
+    }
+
+    state.register_mask = mask;
+    state.memory.addresses.resize(count);
+    state.memory.values.resize(count);
+
+    return get_bytes(ptr, end, state.memory.addresses.data(), count * sizeof(unsigned long long)) &&
+        get_bytes(ptr, end, state.memory.values.data(), count);
+}
+
+// a truncated or corrupt entry leaves result as it was, the test is then emulated instead
+bool decode_outcome(const char *&ptr, const char *end, TEST_RESULT &result)
+{
+    TEST_RESULT decoded;
+
+    if(!decode_outcome_fields(ptr, end, decoded))
+    {
+        return false;
+    }
+
+    result.status = decoded.status;
+    result.error = std::move(decoded.error);
+    result.exception_type = std::move(decoded.exception_type);
+    result.exception_message = std::move(decoded.exception_message);
+    result.diffs = std::move(decoded.diffs);
+    result.emulator_state = std::move(decoded.emulator_state);
+
+    return true;
+}
+
+// Load every record and reopen the file for appending. A record cut short by an
+// interrupted run is dropped, a cache from another verifier version is started over
+int ResultCache::open(const string &cache_filename)
+{
+    vector<char> contents;
+    size_t valid = 0;
+    uint32_t version = 0;
+
+    filename = cache_filename;
+
+    if(boost::filesystem::exists(filename))
+    {
+        std::ifstream in(filename, std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    const char *ptr = contents.data();
+    const char *end = contents.data() + contents.size();
+
+    if(contents.size() >= RESULT_CACHE_MAGIC_SIZE + sizeof(version) && memcmp(ptr, RESULT_CACHE_MAGIC, RESULT_CACHE_MAGIC_SIZE) == 0)
+    {
+        ptr += RESULT_CACHE_MAGIC_SIZE;
+        get_value(ptr, end, version);
+    }
+
+    if(version == RESULT_CACHE_VERSION)
+    {
+        valid = ptr - contents.data();
+
+        while(ptr != end)
+        {
+            RESULT_KEY key;
+            uint32_t length = 0;
+
+            if(!get_value(ptr, end, key) || !get_value(ptr, end, length) || (size_t)(end - ptr) < length)
+            {
+                break;
+            }
+
+            entries[key].assign(ptr, length);
+            ptr += length;
+            valid = ptr - contents.data();
+        }
+    }
+    else if(!contents.empty())
+    {
+        cout << "[*] " << filename << " is not a result cache of this verifier version, starting a new one" << endl;
+    }
+
+    if(valid == 0)
+    {
+        out.open(filename, std::ios::binary | std::ios::trunc);
+        out.write(RESULT_CACHE_MAGIC, RESULT_CACHE_MAGIC_SIZE);
+        version = RESULT_CACHE_VERSION;
+        out.write((const char *)&version, sizeof(version));
+    }
+    else
+    {
+        if(valid != contents.size())
+        {
+            boost::system::error_code error;
+            boost::filesystem::resize_file(filename, valid, error);
+        }
+
+        out.open(filename, std::ios::binary | std::ios::app);
+    }
+
+    if(!out)
+    {
+        cout << "[-] Failed to open result cache " << filename << "!" << endl;
+        return -1;
+    }
+
+    cout << "[*] Result cache: " << entries.size() << " results in " << filename << endl;
+
+    return 0;
+}
+
+bool ResultCache::find(const RESULT_KEY &key, TEST_RESULT &result) const
+{
+    auto found = entries.find(key);
+
+    if(found == entries.end())
+    {
+        return false;
+    }
+
+    const char *ptr = found->second.data();
+
+    return decode_outcome(ptr, ptr + found->second.size(), result);
+}
+
+void ResultCache::add(const TEST_RESULT &result)
+{
+    string record;
+
+    if(result.cached)
+    {
+        reused++;
+        return;
+    }
+
+    if(!result.cacheable)
+    {
+        return;
+    }
+
+    put_value(record, result.cache_key);
+    put_value<uint32_t>(record, 0);
+    encode_outcome(record, result);
+
+    uint32_t length = record.size() - sizeof(RESULT_KEY) - sizeof(uint32_t);
+    memcpy(&record[sizeof(RESULT_KEY)], &length, sizeof(length));
+
+    out.write(record.data(), record.size());
+    added++;
+}
+
+int ResultCache::close(void)
+{
+    out.close();
+
+    if(out.fail())
+    {
+        cout << "[-] Failed to write result cache " << filename << "!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+//--------------------------------------------------------------------------------------
+// File: result_cache.h
+//
+// On disk cache of test outcomes keyed by what the outcome depends on, so a rerun after
+// a .sla change only emulates the tests whose instruction now translates differently
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <boost/unordered_map.hpp>
+#include "state.h"
+#include "test_results.h"
+
+#define RESULT_CACHE_MAGIC "VRCACHE\0"
+#define RESULT_CACHE_MAGIC_SIZE 8
+
+// bump whenever emulation or comparison changes in a way that changes outcomes
+#define RESULT_CACHE_VERSION 1
+
+// FNV-1a, 128 bit so distinct tests never share a key in practice
+class ResultHasher
+{
+    unsigned __int128 state;
+
+public:
+    ResultHasher(void);
+
+    void add(const void *data, size_t length);
+    template<typename T> void add(const T &value) { add(&value, sizeof(value)); }
+    void add(const string &value);
+    void addState(const TEST_STATE &state);
+    RESULT_KEY getKey(void) const;
+};
+
+// Append only file: RESULT_CACHE_MAGIC, uint32 RESULT_CACHE_VERSION, then records of
+// 16 byte key, uint32 length and an outcome in encode_outcome() format.
+// Loaded once before the workers start and read only afterwards, so lookups take no lock.
+// Outcomes of the run are appended by the result writer thread
+class ResultCache
+{
+    boost::unordered_map<RESULT_KEY, string, RESULT_KEY_HASH> entries; // encoded outcomes
+    std::ofstream out;
+    string filename;
+
+    // writer thread only
+    unsigned int reused;
+    unsigned int added;
+
+public:
+    ResultCache(void) : reused(0), added(0) {}
+
+    int open(const string &cache_filename);
+    bool find(const RESULT_KEY &key, TEST_RESULT &result) const; // fills in the outcome
+    void add(const TEST_RESULT &result); // counts a reused result, stores a new one
+    int close(void);
+
+    unsigned int getReused(void) const { return reused; }
+    unsigned int getAdded(void) const { return added; }
+};
+
+// A result's outcome: status, messages, diffs and, unless it passed, the emulator state.
+// Shared by the cache file and the --isolate result pipes
+void encode_outcome(string &out, const TEST_RESULT &result);
+bool decode_outcome(const char *&ptr, const char *end, TEST_RESULT &result);
+
+void put_bytes(string &out, const void *data, size_t length);
+bool get_bytes(const char *&ptr, const char *end, void *data, size_t length);
+
+template<typename T>
+void put_value(string &out, const T &value)
+{
+    put_bytes(out, &value, sizeof(value));
+}
+
+template<typename T>
+bool get_value(const char *&ptr, const char *end, T &value)
+{
+    return get_bytes(ptr, end, &value, sizeof(value));
+}
+
+void put_string(string &out, const string &value);
+bool get_string(const char *&ptr, const char *end, string &value);
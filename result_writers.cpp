@@ -0,0 +1,301 @@
+//--------------------------------------------------------------------------------------
+// File: result_writers.cpp
+//
+// Machine readable result files (JSON Lines and JUnit XML)
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "result_writers.h"
+#include <iomanip>
+#include <sstream>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+
+// width of the zero padded counts in the JUnit testsuite element
+#define JUNIT_COUNT_WIDTH 10
+
+static const char *status_names[] = {"pass", "fail", "error", "crash"};
+
+int ResultWriter::open(const string &filename)
+{
+    // the buffer has to be installed before the file is opened
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(filename, std::ios::binary | std::ios::trunc);
+
+    if(!out)
+    {
+        cout << "[-] Failed to open results file " << filename << "!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ResultWriter::close(void)
+{
+    out.close();
+
+    if(out.fail())
+    {
+        cout << "[-] Failed to write results file " << test_params.results_filename << "!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *result_status_name(TEST_STATUS status)
+{
+    return status_names[status];
+}
+
+static nlohmann::ordered_json diff_records(TEST_PARAMS &test_params, const vector<STATE_DIFF> &state_diffs)
+{
+    nlohmann::ordered_json diffs = nlohmann::ordered_json::array();
+
+    for(auto &diff : state_diffs)
+    {
+        nlohmann::ordered_json entry;
+
+        switch(diff.kind)
+        {
+        case DIFF_REGISTER:
+            entry["kind"] = "register";
+            entry["register"] = test_params.registers[diff.register_index];
+            entry["expected"] = diff.expected;
+            break;
+        case DIFF_MISSING_REGISTER:
+            entry["kind"] = "missing_register";
+            entry["register"] = test_params.registers[diff.register_index];
+            entry["expected"] = diff.expected;
+            break;
+        case DIFF_UNEXPECTED_REGISTER:
+            entry["kind"] = "unexpected_register";
+            entry["register"] = test_params.registers[diff.register_index];
+            break;
+        case DIFF_MEMORY:
+            entry["kind"] = "memory";
+            entry["address"] = diff.address;
+            entry["expected"] = diff.expected;
+            break;
+        case DIFF_MISSING_MEMORY:
+            entry["kind"] = "missing_memory";
+            entry["address"] = diff.address;
+            entry["expected"] = diff.expected;
+            break;
+        case DIFF_UNEXPECTED_WRITE:
+            entry["kind"] = "unexpected_write";
+            entry["address"] = diff.address;
+            break;
+        case DIFF_MISSING_READ:
+        case DIFF_MISSING_WRITE:
+            entry["kind"] = diff.kind == DIFF_MISSING_READ ? "missing_read" : "missing_write";
+            entry["address"] = diff.address;
+            entry["expected"] = diff.expected;
+            break;
+        case DIFF_SPURIOUS_READ:
+        case DIFF_SPURIOUS_WRITE:
+            entry["kind"] = diff.kind == DIFF_SPURIOUS_READ ? "spurious_read" : "spurious_write";
+            entry["address"] = diff.address;
+            break;
+        case DIFF_READ_ORDER:
+        case DIFF_WRITE_ORDER:
+            // actual is the position the emulator made the access at
+            entry["kind"] = diff.kind == DIFF_READ_ORDER ? "read_order" : "write_order";
+            entry["address"] = diff.address;
+            entry["expected"] = diff.expected;
+            entry["cycle"] = diff.register_index;
+            break;
+        }
+        entry["actual"] = diff.actual;
+
+        diffs.push_back(entry);
+    }
+
+    return diffs;
+}
+
+// the JSON Lines record of a test, also kept for failures in the run summary
+nlohmann::ordered_json result_record(TEST_PARAMS &test_params, const TEST_RESULT &result)
+{
+    static const char *divergence_names[] = {"none", "fixed", "regressed", "changed"};
+    nlohmann::ordered_json record;
+
+    if(!test_params.matrix_names.empty())
+    {
+        record["variant"] = test_params.matrix_names[result.variant];
+    }
+    record["file"] = test_params.test_files[result.file_index];
+    record["test_id"] = result.test_id;
+    record["name"] = result.name;
+    record["status"] = status_names[result.status];
+    record["duration_us"] = result.duration_ns / 1000.0;
+    record["diffs"] = diff_records(test_params, result.diffs);
+    record["exception"] = result.exception_type.empty() ? nlohmann::ordered_json() : nlohmann::ordered_json(result.exception_type);
+    record["exception_message"] = result.exception_message.empty() ? nlohmann::ordered_json() : nlohmann::ordered_json(result.exception_message);
+    record["error"] = result.error.empty() ? nlohmann::ordered_json() : nlohmann::ordered_json(result.error);
+    record["cached"] = result.cached;
+
+    if(result.baseline != nullptr)
+    {
+        const TEST_RESULT &baseline = *result.baseline;
+        nlohmann::ordered_json entry;
+
+        entry["status"] = status_names[baseline.status];
+        entry["diffs"] = diff_records(test_params, baseline.diffs);
+        entry["exception"] = baseline.exception_type.empty() ? nlohmann::ordered_json() : nlohmann::ordered_json(baseline.exception_type);
+        entry["error"] = baseline.error.empty() ? nlohmann::ordered_json() : nlohmann::ordered_json(baseline.error);
+
+        record["divergence"] = divergence_names[result.divergence];
+        record["baseline"] = entry;
+    }
+
+    return record;
+}
+
+void JsonLinesWriter::write(const TEST_RESULT &result)
+{
+    out << result_record(test_params, result).dump() << '\n';
+}
+
+static string xml_escape(const string &text)
+{
+    string escaped;
+
+    escaped.reserve(text.size());
+    for(char c : text)
+    {
+        switch(c)
+        {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        case '\'': escaped += "&apos;"; break;
+        default:
+            // control characters aren't allowed in XML 1.0
+            if((unsigned char)c < 0x20 && c != '\n' && c != '\t' && c != '\r')
+            {
+                escaped += '?';
+            }
+            else
+            {
+                escaped += c;
+            }
+            break;
+        }
+    }
+
+    return escaped;
+}
+
+static void write_junit_counts(ostream &out, unsigned int tests, unsigned int failures, unsigned int errors)
+{
+    out << "tests=\"" << std::setfill('0') << std::setw(JUNIT_COUNT_WIDTH) << tests << "\" ";
+    out << "failures=\"" << std::setw(JUNIT_COUNT_WIDTH) << failures << "\" ";
+    out << "errors=\"" << std::setw(JUNIT_COUNT_WIDTH) << errors << "\"" << std::setfill(' ');
+}
+
+void JUnitWriter::begin(void)
+{
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    out << "<testsuites>\n";
+    out << "  <testsuite name=\"verifier\" ";
+    counts_position = out.tellp();
+    write_junit_counts(out, 0, 0, 0);
+    out << ">\n";
+}
+
+void JUnitWriter::write(const TEST_RESULT &result)
+{
+    string suite = boost::filesystem::path(test_params.test_files[result.file_index]).filename().string();
+
+    if(!test_params.matrix_names.empty())
+    {
+        suite = test_params.matrix_names[result.variant] + "." + suite;
+    }
+    double seconds = result.duration_ns / 1e9;
+    std::ostringstream name;
+
+    name << result.test_id;
+    if(!result.name.empty())
+    {
+        name << ": " << result.name;
+    }
+
+    out << "    <testcase classname=\"" << xml_escape(suite) << "\" name=\"" << xml_escape(name.str()) << "\" time=\"" << std::fixed << std::setprecision(9) << seconds << "\"";
+
+    if(result.status == TEST_PASS && result.exception_type.empty())
+    {
+        out << "/>\n";
+        return;
+    }
+
+    out << ">\n";
+
+    if(result.status == TEST_FAIL)
+    {
+        std::ostringstream details;
+
+        print_diffs(test_params, result.diffs, details);
+        out << "      <failure type=\"StateMismatch\" message=\"" << result.diffs.size() << " difference(s)\">" << xml_escape(details.str()) << "</failure>\n";
+    }
+    else if(result.status == TEST_ERROR)
+    {
+        out << "      <error type=\"" << xml_escape(result.exception_type.empty() ? "Error" : result.exception_type) << "\" message=\"" << xml_escape(result.error) << "\"/>\n";
+    }
+    else if(result.status == TEST_CRASH)
+    {
+        out << "      <error type=\"Crash\" message=\"" << xml_escape(result.error) << "\"/>\n";
+    }
+
+    if(!result.exception_type.empty())
+    {
+        out << "      <system-out>" << xml_escape(result.exception_type + ": " + result.exception_message) << "</system-out>\n";
+    }
+
+    out << "    </testcase>\n";
+}
+
+void JUnitWriter::end(unsigned int passed, unsigned int failed, unsigned int errors)
+{
+    out << "  </testsuite>\n";
+    out << "</testsuites>\n";
+
+    // patch the placeholders, the replacement is exactly as wide
+    out.seekp(counts_position);
+    write_junit_counts(out, passed + failed + errors, failed, errors);
+    out.seekp(0, std::ios::end);
+}
+
+string get_results_format(const string &results_filename, const string &results_format)
+{
+    if(!results_format.empty())
+    {
+        return results_format;
+    }
+
+    if(boost::algorithm::iends_with(results_filename, ".xml"))
+    {
+        return "junit";
+    }
+
+    return "jsonl";
+}
+
+unique_ptr<ResultWriter> create_result_writer(TEST_PARAMS &test_params)
+{
+    if(test_params.results_format == "jsonl")
+    {
+        return unique_ptr<ResultWriter>(new JsonLinesWriter(test_params));
+    }
+
+    if(test_params.results_format == "junit")
+    {
+        return unique_ptr<ResultWriter>(new JUnitWriter(test_params));
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,73 @@
+//--------------------------------------------------------------------------------------
+// File: result_writers.h
+//
+// Machine readable result files (JSON Lines and JUnit XML)
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "test_results.h"
+
+// results files are written through a buffer this large
+#define RESULT_FILE_BUFFER_SIZE (1 << 20)
+
+// Streams one record per test to a results file as tests complete. Only ever called from
+// the result writer thread, so the workers never wait on file I/O
+class ResultWriter
+{
+protected:
+    TEST_PARAMS &test_params;
+    vector<char> buffer;
+    std::ofstream out;
+
+public:
+    ResultWriter(TEST_PARAMS &params) : test_params(params), buffer(RESULT_FILE_BUFFER_SIZE) {}
+    virtual ~ResultWriter(void) {}
+
+    int open(const string &filename);
+    virtual void begin(void) {}
+    virtual void write(const TEST_RESULT &result) = 0;
+    virtual void end(unsigned int passed, unsigned int failed, unsigned int errors) {}
+    int close(void);
+};
+
+// one json object per line
+class JsonLinesWriter : public ResultWriter
+{
+public:
+    JsonLinesWriter(TEST_PARAMS &params) : ResultWriter(params) {}
+    virtual void write(const TEST_RESULT &result);
+};
+
+// One testsuite for the run, the test file (variant.file in a matrix) is the testcase's classname so results stream
+// in completion order even when files overlap. The suite's counts are only known at the
+// end, they are written as fixed width placeholders and patched in place
+class JUnitWriter : public ResultWriter
+{
+    std::streampos counts_position;
+
+public:
+    JUnitWriter(TEST_PARAMS &params) : ResultWriter(params) {}
+    virtual void begin(void);
+    virtual void write(const TEST_RESULT &result);
+    virtual void end(unsigned int passed, unsigned int failed, unsigned int errors);
+};
+
+// "pass", "fail", "error" or "crash"
+const char *result_status_name(TEST_STATUS status);
+
+// the JSON Lines record of a test, differential runs add "divergence" and the "baseline"
+// outcome, matrix runs lead with the "variant"
+nlohmann::ordered_json result_record(TEST_PARAMS &test_params, const TEST_RESULT &result);
+
+// "jsonl" or "junit", picked from the file extension when not given
+string get_results_format(const string &results_filename, const string &results_format);
+
+// writer for test_params.results_format, null if the format is unknown
+unique_ptr<ResultWriter> create_result_writer(TEST_PARAMS &test_params);
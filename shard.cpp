@@ -0,0 +1,505 @@
+//--------------------------------------------------------------------------------------
+// File: shard.cpp
+//
+// Splitting a run across processes (--shard) and merging their run summaries
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "shard.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+int parse_shard(const string &shard, TEST_PARAMS &test_params)
+{
+    unsigned int index = 0;
+    unsigned int count = 0;
+    char separator = 0;
+    char extra = 0;
+
+    if(sscanf(shard.c_str(), "%u%c%u%c", &index, &separator, &count, &extra) != 3 || separator != '/' ||
+       index == 0 || count == 0 || index > count)
+    {
+        cout << "[-] Invalid shard " << shard << ", expected i/N with 1 <= i <= N!" << endl;
+        return -1;
+    }
+
+    test_params.shard_index = index - 1;
+    test_params.shard_count = count;
+
+    return 0;
+}
+
+void shard_test_files(TEST_PARAMS &test_params)
+{
+    vector<string> files;
+
+    test_params.shard_by_file = false;
+    if(test_params.shard_count <= 1 || test_params.test_files.size() < test_params.shard_count)
+    {
+        return;
+    }
+
+    for(unsigned int i = test_params.shard_index; i < test_params.test_files.size(); i += test_params.shard_count)
+    {
+        files.push_back(test_params.test_files[i]);
+    }
+
+    test_params.test_files = files;
+    test_params.shard_by_file = true;
+}
+
+unsigned int unsharded_file_index(const TEST_PARAMS &test_params, unsigned int file_index)
+{
+    if(!test_params.shard_by_file)
+    {
+        return file_index;
+    }
+
+    return file_index * test_params.shard_count + test_params.shard_index;
+}
+
+nlohmann::ordered_json summary_run(const TEST_PARAMS &test_params)
+{
+    nlohmann::ordered_json run;
+
+    run["sla_file"] = test_params.sla_filename;
+    if(!test_params.matrix_sla_files.empty())
+    {
+        run["sla_files"] = test_params.matrix_sla_files;
+        run["variants"] = test_params.matrix_names;
+    }
+    if(!test_params.baseline_sla_filename.empty())
+    {
+        run["baseline_sla_file"] = test_params.baseline_sla_filename;
+    }
+    if(test_params.bus_access)
+    {
+        run["bus_access"] = true;
+    }
+    run["program_counter"] = test_params.program_counter;
+    run["start_test"] = test_params.start_test;
+    run["end_test"] = test_params.end_test;
+    run["max_failures"] = test_params.max_failures;
+    run["shard_count"] = test_params.shard_count;
+    run["shard_by_file"] = test_params.shard_by_file;
+
+    return run;
+}
+
+// one line of json, only failures carry details so the file stays small
+int write_summary(const string &filename, const RUN_SUMMARY &summary)
+{
+    nlohmann::ordered_json doc;
+    nlohmann::ordered_json files = nlohmann::ordered_json::array();
+
+    for(auto &file : summary.files)
+    {
+        nlohmann::ordered_json entry;
+
+        entry["index"] = file.index;
+        if(summary.run.contains("variants"))
+        {
+            entry["variant"] = file.variant;
+        }
+        entry["file"] = file.file;
+        entry["loaded"] = file.loaded;
+        entry["passed"] = file.counts.passed;
+        entry["failed"] = file.counts.failed;
+        entry["errors"] = file.counts.errors;
+        if(summary.run.contains("baseline_sla_file"))
+        {
+            entry["fixed"] = file.counts.fixed;
+            entry["regressed"] = file.counts.regressed;
+            entry["changed"] = file.counts.changed;
+        }
+        files.push_back(entry);
+    }
+
+    doc["version"] = SUMMARY_VERSION;
+    doc["run"] = summary.run;
+    doc["shard"] = summary.shard_index;
+    doc["result"] = summary.result;
+    doc["aborted"] = summary.aborted;
+    doc["submitted"] = summary.submitted;
+    doc["completed"] = summary.completed;
+    doc["files"] = files;
+    doc["failures"] = summary.failures;
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    out << doc.dump() << '\n';
+    out.close();
+
+    if(!out)
+    {
+        cout << "[-] Failed to write summary file " << filename << "!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+int read_summary(const string &filename, RUN_SUMMARY &summary)
+{
+    std::ifstream in(filename);
+    nlohmann::ordered_json doc;
+
+    if(!in)
+    {
+        cout << "[-] Failed to open summary file " << filename << "!" << endl;
+        return -1;
+    }
+
+    try
+    {
+        in >> doc;
+
+        if(doc.at("version").get<unsigned int>() != SUMMARY_VERSION)
+        {
+            cout << "[-] Unsupported summary version in " << filename << "!" << endl;
+            return -1;
+        }
+
+        summary.run = doc.at("run");
+        summary.shard_index = doc.at("shard").get<unsigned int>();
+        summary.shard_count = summary.run.at("shard_count").get<unsigned int>();
+        summary.result = doc.at("result").get<int>();
+        summary.aborted = doc.at("aborted").get<bool>();
+        summary.submitted = doc.at("submitted").get<unsigned long long>();
+        summary.completed = doc.at("completed").get<unsigned long long>();
+
+        summary.files.clear();
+        for(auto &entry : doc.at("files"))
+        {
+            FILE_SUMMARY file;
+
+            file.index = entry.at("index").get<unsigned int>();
+            file.variant = entry.value("variant", 0u);
+            file.file = entry.at("file").get<string>();
+            file.loaded = entry.at("loaded").get<unsigned int>();
+            file.counts.passed = entry.at("passed").get<unsigned int>();
+            file.counts.failed = entry.at("failed").get<unsigned int>();
+            file.counts.errors = entry.at("errors").get<unsigned int>();
+            file.counts.fixed = entry.value("fixed", 0u);
+            file.counts.regressed = entry.value("regressed", 0u);
+            file.counts.changed = entry.value("changed", 0u);
+            summary.files.push_back(file);
+        }
+
+        summary.failures.clear();
+        for(auto &record : doc.at("failures"))
+        {
+            summary.failures.push_back(record);
+        }
+    }
+    catch(nlohmann::json::exception &e)
+    {
+        cout << "[-] " << filename << " is not a valid summary file: " << e.what() << endl;
+        return -1;
+    }
+
+    if(summary.shard_count == 0 || summary.shard_index >= summary.shard_count)
+    {
+        cout << "[-] " << filename << " has an invalid shard number!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+// same lines print_diffs() writes, from a JSON Lines record
+static void print_record_diffs(const nlohmann::ordered_json &record)
+{
+    for(auto &diff : record.value("diffs", nlohmann::ordered_json::array()))
+    {
+        string kind = diff.value("kind", "");
+
+        if(kind == "register")
+        {
+            cout << "!! REGISTER ERROR: " << diff.value("register", "") << " " << diff.value("expected", 0u) << " " << diff.value("actual", 0u) << endl;
+        }
+        else if(kind == "missing_register")
+        {
+            cout << "!! MISSING REGISTER: " << diff.value("register", "") << " " << diff.value("expected", 0u) << endl;
+        }
+        else if(kind == "unexpected_register")
+        {
+            cout << "!! UNEXPECTED REGISTER: " << diff.value("register", "") << " " << diff.value("actual", 0u) << endl;
+        }
+        else if(kind == "memory")
+        {
+            cout << "!! MEMORY ERROR: " << diff.value("address", 0ull) << " " << diff.value("expected", 0u) << " " << diff.value("actual", 0u) << endl;
+        }
+        else if(kind == "missing_memory")
+        {
+            cout << "!! MISSING MEMORY: " << diff.value("address", 0ull) << " " << diff.value("expected", 0u) << endl;
+        }
+        else if(kind == "unexpected_write")
+        {
+            cout << "!! UNEXPECTED WRITE: " << diff.value("address", 0ull) << " " << diff.value("actual", 0u) << endl;
+        }
+        else if(kind == "missing_read" || kind == "missing_write")
+        {
+            cout << (kind == "missing_read" ? "!! MISSING READ: " : "!! MISSING WRITE: ") << diff.value("address", 0ull) << " " << diff.value("expected", 0u) << endl;
+        }
+        else if(kind == "spurious_read" || kind == "spurious_write")
+        {
+            cout << (kind == "spurious_read" ? "!! SPURIOUS READ: " : "!! SPURIOUS WRITE: ") << diff.value("address", 0ull) << " " << diff.value("actual", 0u) << endl;
+        }
+        else if(kind == "read_order" || kind == "write_order")
+        {
+            // actual is the position the emulator made the access at
+            cout << (kind == "read_order" ? "!! READ ORDER: " : "!! WRITE ORDER: ") << diff.value("address", 0ull) << " " << diff.value("expected", 0u) <<
+                " expected as access " << diff.value("cycle", 0u) << ", made as access " << diff.value("actual", 0u) << endl;
+        }
+    }
+}
+
+int merge_summaries(const vector<string> &filenames, const string &output_filename)
+{
+    vector<RUN_SUMMARY> shards;
+    vector<bool> seen;
+    map<pair<unsigned int, unsigned int>, FILE_SUMMARY> files; // by unsharded index and variant
+    map<string, unsigned int> file_indexes;
+    RUN_SUMMARY merged;
+    int result = 0;
+
+    for(auto &filename : filenames)
+    {
+        RUN_SUMMARY summary;
+
+        if(read_summary(filename, summary) != 0)
+        {
+            return -1;
+        }
+
+        if(!shards.empty() && summary.run != shards[0].run)
+        {
+            cout << "[-] " << filename << " is from a different run than " << filenames[0] << "!" << endl;
+            return -1;
+        }
+
+        if(seen.empty())
+        {
+            seen.resize(summary.shard_count, false);
+        }
+
+        if(seen[summary.shard_index])
+        {
+            cout << "[-] Shard " << summary.shard_index + 1 << "/" << summary.shard_count << " was given more than once!" << endl;
+            return -1;
+        }
+        seen[summary.shard_index] = true;
+
+        shards.push_back(std::move(summary));
+    }
+
+    if(shards.empty())
+    {
+        cout << "[-] No summary files to merge!" << endl;
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < seen.size(); i++)
+    {
+        if(!seen[i])
+        {
+            cout << "[-] Missing shard " << i + 1 << "/" << seen.size() << "!" << endl;
+            result = -1;
+        }
+    }
+
+    if(result != 0)
+    {
+        return result;
+    }
+
+    // sharded by test every shard lists every file, the counts add up
+    merged.run = shards[0].run;
+    merged.shard_index = 0;
+    merged.shard_count = 1;
+    merged.result = 0;
+    merged.aborted = false;
+    merged.submitted = 0;
+    merged.completed = 0;
+
+    for(auto &shard : shards)
+    {
+        for(auto &file : shard.files)
+        {
+            auto found = files.find(make_pair(file.index, file.variant));
+
+            if(found == files.end())
+            {
+                files[make_pair(file.index, file.variant)] = file;
+                continue;
+            }
+
+            if(found->second.file != file.file)
+            {
+                cout << "[-] Shards disagree on test file " << file.index << " (" << found->second.file << ", " << file.file << ")!" << endl;
+                return -1;
+            }
+
+            found->second.loaded += file.loaded;
+            found->second.counts.passed += file.counts.passed;
+            found->second.counts.failed += file.counts.failed;
+            found->second.counts.errors += file.counts.errors;
+            found->second.counts.fixed += file.counts.fixed;
+            found->second.counts.regressed += file.counts.regressed;
+            found->second.counts.changed += file.counts.changed;
+        }
+
+        if(shard.result != 0)
+        {
+            cout << "[-] Shard " << shard.shard_index + 1 << "/" << shard.shard_count << " failed to load or record its tests!" << endl;
+            merged.result = -1;
+        }
+
+        if(shard.aborted)
+        {
+            cout << "[-] Shard " << shard.shard_index + 1 << "/" << shard.shard_count << " stopped at --max-failures, not all of its tests ran" << endl;
+            merged.aborted = true;
+        }
+
+        merged.submitted += shard.submitted;
+        merged.completed += shard.completed;
+        merged.failures.insert(merged.failures.end(), shard.failures.begin(), shard.failures.end());
+    }
+
+    // failures in test order, as an ordered single run would list them
+    for(auto &[key, file] : files)
+    {
+        file_indexes[file.file] = key.first;
+        merged.files.push_back(file);
+    }
+
+    vector<string> variants = merged.run.value("variants", vector<string>());
+    map<string, unsigned int> variant_indexes;
+
+    for(unsigned int i = 0; i < variants.size(); i++)
+    {
+        variant_indexes[variants[i]] = i;
+    }
+
+    stable_sort(merged.failures.begin(), merged.failures.end(), [&](const nlohmann::ordered_json &a, const nlohmann::ordered_json &b)
+    {
+        unsigned int file_a = file_indexes[a.value("file", "")];
+        unsigned int file_b = file_indexes[b.value("file", "")];
+
+        if(file_a != file_b)
+        {
+            return file_a < file_b;
+        }
+
+        // a matrix run deals each variant the file's tests in turn
+        unsigned int variant_a = variant_indexes[a.value("variant", "")];
+        unsigned int variant_b = variant_indexes[b.value("variant", "")];
+
+        if(variant_a != variant_b)
+        {
+            return variant_a < variant_b;
+        }
+
+        return a.value("test_id", 0u) < b.value("test_id", 0u);
+    });
+
+    for(auto &record : merged.failures)
+    {
+        cout << "[-] ";
+        if(!variants.empty())
+        {
+            cout << record.value("variant", "") << " ";
+        }
+        if(file_indexes.size() > 1)
+        {
+            cout << record.value("file", "") << " ";
+        }
+        cout << record.value("test_id", 0u) << ") ";
+
+        string status = record.value("status", "");
+        string divergence = record.value("divergence", "");
+
+        // a differential run, only divergent tests were recorded
+        if(!divergence.empty())
+        {
+            string baseline = record.at("baseline").value("status", "");
+
+            transform(divergence.begin(), divergence.end(), divergence.begin(), ::toupper);
+            cout << divergence << " (baseline " << baseline << ", now " << status << ")" << endl;
+            print_record_diffs(record);
+            continue;
+        }
+
+        if(status == "error" || status == "crash")
+        {
+            cout << (status == "error" ? "ERROR: " : "CRASH: ") << record.value("error", nlohmann::ordered_json("")).get<string>() << endl;
+            continue;
+        }
+
+        cout << "FAIL" << endl;
+        print_record_diffs(record);
+    }
+
+    bool differential = merged.run.contains("baseline_sla_file");
+    FILE_COUNTS totals = {};
+
+    for(auto &file : merged.files)
+    {
+        bool passed = file.counts.failed == 0 && file.counts.errors == 0 && file.counts.passed == file.loaded;
+
+        cout << (passed ? "[+] " : "[-] ");
+        if(file.variant < variants.size())
+        {
+            cout << variants[file.variant] << " ";
+        }
+        cout << file.file << ": Loaded " << file.loaded << " test cases, " <<
+            file.counts.passed << " passed, " << file.counts.failed << " failed, " << file.counts.errors << " errors";
+        if(differential)
+        {
+            cout << ", " << file.counts.fixed << " fixed, " << file.counts.regressed << " regressed, " << file.counts.changed << " changed";
+        }
+        cout << endl;
+
+        totals.failed += file.counts.failed;
+        totals.errors += file.counts.errors;
+        totals.fixed += file.counts.fixed;
+        totals.regressed += file.counts.regressed;
+        totals.changed += file.counts.changed;
+    }
+
+    cout << "Shards " << shards.size() << endl;
+    cout << "Test files " << file_indexes.size() << endl;
+    cout << "Cases submitted " << merged.submitted << endl;
+    cout << "Completed cases " << merged.completed << endl;
+    cout << "Fail cases " << totals.failed << endl;
+    cout << "Error cases " << totals.errors << endl;
+    if(differential)
+    {
+        cout << "Fixed cases " << totals.fixed << endl;
+        cout << "Regressed cases " << totals.regressed << endl;
+        cout << "Changed cases " << totals.changed << endl;
+    }
+
+    if(!output_filename.empty())
+    {
+        merged.run["shard_count"] = 1;
+        merged.run["shard_by_file"] = false;
+
+        if(write_summary(output_filename, merged) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if(merged.result != 0)
+    {
+        cout << "[-] Failed to load unit tests!" << endl;
+    }
+
+    return merged.result;
+}
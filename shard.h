@@ -0,0 +1,61 @@
+//--------------------------------------------------------------------------------------
+// File: shard.h
+//
+// Splitting a run across processes (--shard) and merging their run summaries
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "state.h"
+#include "test_results.h"
+
+#define SUMMARY_VERSION 1
+
+// one test file's line of a run summary, in a matrix one line per variant and test file
+typedef struct _FILE_SUMMARY
+{
+    unsigned int index; // position in the unsharded file list
+    string file;
+    unsigned int loaded;
+    FILE_COUNTS counts;
+    unsigned int variant = 0; // matrix mode, index into the run's "variants"
+} FILE_SUMMARY, *PFILE_SUMMARY;
+
+// What a run, or one shard of it, did. Written by --summary, combined by verifier merge
+typedef struct _RUN_SUMMARY
+{
+    nlohmann::ordered_json run; // settings every shard of a run has in common
+    unsigned int shard_index;
+    unsigned int shard_count;
+    int result; // parallelize_test() return value
+    bool aborted; // stopped at --max-failures
+    unsigned long long submitted;
+    unsigned long long completed;
+    vector<FILE_SUMMARY> files;
+    vector<nlohmann::ordered_json> failures; // JSON Lines records of the tests that didn't pass, the divergent ones in differential mode
+} RUN_SUMMARY, *PRUN_SUMMARY;
+
+// parse "i/N", 1 <= i <= N, into test_params
+int parse_shard(const string &shard, TEST_PARAMS &test_params);
+
+// With at least as many files as shards each shard runs every shard_count'th file,
+// otherwise every shard runs every shard_count'th test of each file
+void shard_test_files(TEST_PARAMS &test_params);
+
+// position of test_files[file_index] in the unsharded file list
+unsigned int unsharded_file_index(const TEST_PARAMS &test_params, unsigned int file_index);
+
+// settings every shard of the run must agree on
+nlohmann::ordered_json summary_run(const TEST_PARAMS &test_params);
+
+int write_summary(const string &filename, const RUN_SUMMARY &summary);
+int read_summary(const string &filename, RUN_SUMMARY &summary);
+
+// check the shards make up one complete run, print the combined summary and optionally
+// write it to output_filename. Returns what a single run would have returned
+int merge_summaries(const vector<string> &filenames, const string &output_filename);
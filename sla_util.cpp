@@ -6,82 +6,109 @@
 // Copyright (c) Oberoi Security Solutions. All rights reserved.
 // Licensed under the Apache 2.0 License.
 //--------------------------------------------------------------------------------------
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/xml_parser.hpp>
-#include <boost/foreach.hpp>
+#include <cstdlib>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include "sleigh.hh"
+#include "sla_util.h"
 
-#define SLEIGH_VERSION 3
+using namespace ghidra;
 
-using namespace std;
-namespace pt = boost::property_tree;
+// enough of the file to hold the XML declaration and the <sleigh> tag
+#define SLA_HEADER_SIZE 512
 
-int sla_get_word_size(string sla_filename, unsigned int& word_size)
+int sla_get_format(const string &sla_filename, SLA_FORMAT &format, int &version)
 {
-    string default_space;
-    string space_name;
-    int sleigh_version = 0;
-    int size = 0;;
+    char buffer[SLA_HEADER_SIZE];
+    size_t tag = 0;
+    size_t tag_end = 0;
+    size_t version_pos = 0;
 
-    // Create empty property tree object
-    pt::ptree tree;
-
-    // Parse the XML into the property tree.
-    try
+    ifstream f(sla_filename, ios::binary);
+    if(!f)
     {
-        pt::read_xml(sla_filename, tree);
-    } catch(...)
-    {
-        cout << "[-] Exception when opening .sla!" << endl;
+        cout << "[-] Failed to open " << sla_filename << "!" << endl;
         return -1;
     }
 
-    sleigh_version = tree.get("sleigh.<xmlattr>.version", 0);
-    if(sleigh_version != SLEIGH_VERSION)
+    f.read(buffer, sizeof(buffer));
+    string header(buffer, f.gcount());
+
+    // compressed: "sla" then the format version byte
+    if(header.size() >= 4 && header.compare(0, 3, "sla") == 0)
     {
-        cout << "[-] Invalid sleigh version (" << sleigh_version << ")!" << endl;
-        cout << "[-] Is the .sla file correct?" << endl;
-        return -1;
+        format = SLA_FORMAT_COMPRESSED;
+        version = (unsigned char)header[3];
+        return 0;
     }
 
-    default_space = tree.get("sleigh.spaces.<xmlattr>.defaultspace", "");
-    if(default_space == "")
+    // XML: <sleigh version="3" ...>
+    tag = header.find("<sleigh");
+    if(tag == string::npos)
     {
-        cout << "[-] Failed to parse sleigh default space!" << endl;
+        cout << "[-] " << sla_filename << " is not a .sla file!" << endl;
         return -1;
     }
 
-    BOOST_FOREACH(pt::ptree::value_type &v, tree.get_child("sleigh.spaces"))
+    format = SLA_FORMAT_XML;
+    version = 0;
+
+    tag_end = header.find('>', tag);
+    version_pos = header.find("version=\"", tag);
+    if(version_pos != string::npos && version_pos < tag_end)
     {
-        if(v.first != "space")
-        {
-            continue;
-        }
-        else
-        {
-            space_name = v.second.get("<xmlattr>.name", "");
+        version = atoi(header.c_str() + version_pos + 9);
+    }
+
+    return 0;
+}
 
-            if(space_name != default_space)
+int sla_read_ldefs(const string &ldefs_filename, vector<string> &sla_files, vector<string> &names)
+{
+    DocumentStorage docstorage;
+    boost::filesystem::path directory = boost::filesystem::path(ldefs_filename).parent_path();
+
+    try
+    {
+        const Element *root = docstorage.openDocument(ldefs_filename)->getRoot();
+
+        for(const Element *language : root->getChildren())
+        {
+            if(language->getName() != "language")
             {
                 continue;
             }
 
-            // fopund the default space
-            size = v.second.get("<xmlattr>.size", 0);
-            if(size == 0)
+            // languages that only differ in their compiler specs share a .sla
+            string sla_file = (directory / language->getAttributeValue("slafile")).string();
+            if(find(sla_files.begin(), sla_files.end(), sla_file) != sla_files.end())
             {
                 continue;
             }
-            else
-            {
-                // got the word size
-                word_size = size;
-                return 0;
-            }
+
+            sla_files.push_back(sla_file);
+            names.push_back(language->getAttributeValue("id"));
         }
     }
+    catch(DecoderError &e)
+    {
+        cout << "[-] Failed to parse " << ldefs_filename << ": " << e.explain << endl;
+        return -1;
+    }
+    catch(LowlevelError &e)
+    {
+        cout << "[-] Failed to parse " << ldefs_filename << ": " << e.explain << endl;
+        return -1;
+    }
+
+    if(sla_files.empty())
+    {
+        cout << "[-] " << ldefs_filename << " has no languages!" << endl;
+        return -1;
+    }
 
-    return -1;
+    return 0;
 }
@@ -6,6 +6,21 @@
 // Copyright (c) Oberoi Security Solutions. All rights reserved.
 // Licensed under the Apache 2.0 License.
 //--------------------------------------------------------------------------------------
+#pragma once
 
-// read the word_size from the .sla XML
-int sla_get_word_size(string sla_filename, unsigned int& word_size);
+#include <string>
+#include <vector>
+using namespace std;
+
+typedef enum _SLA_FORMAT
+{
+    SLA_FORMAT_XML, // Ghidra 11.0 and earlier, sleigh version 3
+    SLA_FORMAT_COMPRESSED // Ghidra 11.1 and later, "sla" + format version + zlib stream
+} SLA_FORMAT;
+
+// identify a .sla from its first bytes without parsing it
+int sla_get_format(const string &sla_filename, SLA_FORMAT &format, int &version);
+
+// The .sla of every <language> in a Ghidra .ldefs, relative to the .ldefs' directory, and the
+// language id each is named after. Languages sharing a .sla are only listed once
+int sla_read_ldefs(const string &ldefs_filename, vector<string> &sla_files, vector<string> &names);
@@ -8,62 +8,390 @@
 //--------------------------------------------------------------------------------------
 
 #include "state.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <numeric>
+#include <boost/filesystem/fstream.hpp>
 
 // print the state structure
-int print_state(TEST_STATE &a)
+int print_state(TEST_PARAMS &test_params, const TEST_STATE &a, ostream &out)
 {
-    cout << "\tRegisters:" << endl;
-    for (auto& [register_name, value] : a.registers)
+    out << "\tRegisters:" << endl;
+    for (unsigned int i = 0; i < test_params.registers.size(); i++)
     {
-        cout << "\t\t" << register_name << ": " << value << endl;
+        if(a.register_mask & (1ULL << i))
+        {
+            out << "\t\t" << test_params.registers[i] << ": " << a.registers[i] << endl;
+        }
     }
 
-    cout << "\tRAM:" << endl;
-    for (auto& [address, value] : a.memory)
+    out << "\tRAM:" << endl;
+    for (size_t i = 0; i < a.memory.size(); i++)
     {
-        cout << "\t\t" << address << ": " << (unsigned int)value << endl;
+        out << "\t\t" << a.memory.addresses[i] << ": " << (unsigned int)a.memory.values[i] << endl;
     }
 
     return 0;
 }
 
-// Compare states
-// return 0 if a and b are equal
-int compare_state(TEST_STATE &a, TEST_STATE &b)
+// append a byte, sort_memory() must be called before the state is used
+void add_memory(TEST_STATE &state, unsigned long long address, unsigned char value)
 {
-    int result = 0;
+    state.memory.addresses.push_back(address);
+    state.memory.values.push_back(value);
+}
 
-    // TODO: check the opposite conditions as well.
-    // It is not sufficient to check that all of a's registers are equal to b's
-    // We need to check all of b's registers are equal to a's
-    // Same for memory
+// sort memory by address. If an address was added more than once the last value wins
+void sort_memory(TEST_STATE &state)
+{
+    TEST_MEMORY &memory = state.memory;
+    TEST_MEMORY sorted;
+    vector<size_t> order(memory.size());
 
-    // validate registers
-    for (auto& [register_name, value] : a.registers)
+    // test files almost always list memory in ascending order
+    if(adjacent_find(memory.addresses.begin(), memory.addresses.end(), greater_equal<unsigned long long>()) == memory.addresses.end())
+    {
+        return;
+    }
+
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return memory.addresses[x] < memory.addresses[y]; });
+
+    sorted.addresses.reserve(memory.size());
+    sorted.values.reserve(memory.size());
+    for (auto i : order)
+    {
+        if(!sorted.empty() && sorted.addresses.back() == memory.addresses[i])
+        {
+            sorted.values.back() = memory.values[i];
+            continue;
+        }
+
+        sorted.addresses.push_back(memory.addresses[i]);
+        sorted.values.push_back(memory.values[i]);
+    }
+
+    memory = std::move(sorted);
+}
+
+// returns the byte at address, or -1 if the state doesn't have it
+int find_memory(const TEST_STATE &state, unsigned long long address)
+{
+    auto found = lower_bound(state.memory.addresses.begin(), state.memory.addresses.end(), address);
+    if(found == state.memory.addresses.end() || *found != address)
     {
-        unsigned int reg_a = value;
-        unsigned int reg_b = b.registers[register_name];
+        return -1;
+    }
+
+    return state.memory.values[found - state.memory.addresses.begin()];
+}
+
+// set up a state to receive the registers and memory the expected state lists, values are
+// filled in by the emulator
+void prepare_readback(const TEST_STATE &expected, TEST_STATE &readback)
+{
+    readback.register_mask = expected.register_mask;
+    readback.memory.addresses = expected.memory.addresses;
+    readback.memory.values.assign(expected.memory.size(), 0);
+}
+
+// Cheap check for the common case of identical states. Registers are compared in fixed size
+// blocks without branches so the compiler vectorizes them, memory is two memcmp()s.
+// Registers outside the masks are ignored. A false result only means the full diff has to run
+static bool states_equal(TEST_PARAMS &test_params, const TEST_STATE &expected, const TEST_STATE &actual)
+{
+    size_t memory_size = expected.memory.size();
+
+    if(expected.register_mask != actual.register_mask || memory_size != actual.memory.size())
+    {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < test_params.registers.size(); i += COMPARE_BLOCK_SIZE)
+    {
+        unsigned int differs[COMPARE_BLOCK_SIZE];
+        unsigned int any = 0;
+
+        for (unsigned int j = 0; j < COMPARE_BLOCK_SIZE; j++)
+        {
+            differs[j] = (expected.registers[i + j] ^ actual.registers[i + j]) & test_params.register_masks[i + j];
+        }
 
-        if(reg_a != reg_b)
+        for (unsigned int j = 0; j < COMPARE_BLOCK_SIZE; j++)
         {
-            cout << "!! REGISTER ERROR: " << register_name << " " << reg_a << " " << reg_b << endl;
-            result = -1;
+            any |= differs[j];
+        }
+
+        if(any != 0)
+        {
+            return false;
         }
     }
 
-    // validate memory
-    for (auto& [address, value] : a.memory)
+    return memory_size == 0 ||
+        (memcmp(expected.memory.values.data(), actual.memory.values.data(), memory_size) == 0 &&
+         memcmp(expected.memory.addresses.data(), actual.memory.addresses.data(), memory_size * sizeof(unsigned long long)) == 0);
+}
+
+// Compare the expected state against the actual state in both directions, every difference
+// is appended to diffs. Registers are compared at their width in the .sla
+// return 0 if the states are equal
+int compare_state(TEST_PARAMS &test_params, const TEST_STATE &expected, const TEST_STATE &actual, vector<STATE_DIFF> &diffs)
+{
+    size_t first_diff = diffs.size();
+    const TEST_MEMORY &a = expected.memory;
+    const TEST_MEMORY &b = actual.memory;
+    size_t i = 0;
+    size_t j = 0;
+
+    if(states_equal(test_params, expected, actual))
     {
-        unsigned int mem_a = value;
-        unsigned int mem_b = b.memory[address];
+        return 0;
+    }
 
-        if(mem_a != mem_b)
+    // registers
+    for (unsigned int index = 0; index < test_params.registers.size(); index++)
+    {
+        bool in_expected = expected.register_mask & (1ULL << index);
+        bool in_actual = actual.register_mask & (1ULL << index);
+        unsigned int reg_a = expected.registers[index] & test_params.register_masks[index];
+        unsigned int reg_b = actual.registers[index] & test_params.register_masks[index];
+
+        if(in_expected && in_actual)
+        {
+            if(reg_a != reg_b)
+            {
+                diffs.push_back({DIFF_REGISTER, index, 0, reg_a, reg_b});
+            }
+        }
+        else if(in_expected)
+        {
+            diffs.push_back({DIFF_MISSING_REGISTER, index, 0, reg_a, 0});
+        }
+        else if(in_actual)
         {
-            cout << "!! MEMORY ERROR: " << address << " " << mem_a << " " << mem_b << endl;
-            result = -1;
+            diffs.push_back({DIFF_UNEXPECTED_REGISTER, index, 0, 0, reg_b});
         }
     }
 
-    return result;
+    // memory, merge the two sorted address lists
+    while(i < a.size() || j < b.size())
+    {
+        if(j == b.size() || (i < a.size() && a.addresses[i] < b.addresses[j]))
+        {
+            diffs.push_back({DIFF_MISSING_MEMORY, 0, a.addresses[i], a.values[i], 0});
+            i++;
+        }
+        else if(i == a.size() || b.addresses[j] < a.addresses[i])
+        {
+            // for emulator states these are addresses the instruction wrote
+            diffs.push_back({DIFF_UNEXPECTED_WRITE, 0, b.addresses[j], 0, b.values[j]});
+            j++;
+        }
+        else
+        {
+            if(a.values[i] != b.values[j])
+            {
+                diffs.push_back({DIFF_MEMORY, 0, a.addresses[i], a.values[i], b.values[j]});
+            }
+            i++;
+            j++;
+        }
+    }
+
+    return diffs.size() == first_diff ? 0 : -1;
+}
+
+static bool same_access(const BUS_ACCESS &a, const BUS_ACCESS &b)
+{
+    return a.address == b.address && a.value == b.value && a.write == b.write;
+}
+
+// Compare the RAM accesses an instruction made with the test's cycles. Accesses only one
+// side made are reported one by one. If both made the same accesses in a different order,
+// the first access out of place is reported
+int compare_bus(const vector<BUS_ACCESS> &expected, const BUS_ACCESS *actual, size_t count, vector<STATE_DIFF> &diffs)
+{
+    size_t first_diff = diffs.size();
+    vector<size_t> positions; // expected access -> position of the matching actual access
+    vector<bool> matched;
+    size_t i = 0;
+
+    // nearly always the same accesses in the same order
+    while(i < expected.size() && i < count && same_access(expected[i], actual[i]))
+    {
+        i++;
+    }
+
+    if(i == expected.size() && i == count)
+    {
+        return 0;
+    }
+
+    positions.assign(expected.size(), count);
+    matched.assign(count, false);
+    for(size_t j = 0; j < expected.size(); j++)
+    {
+        const BUS_ACCESS &access = expected[j];
+
+        for(size_t k = 0; k < count; k++)
+        {
+            if(!matched[k] && same_access(access, actual[k]))
+            {
+                matched[k] = true;
+                positions[j] = k;
+                break;
+            }
+        }
+
+        if(positions[j] == count)
+        {
+            diffs.push_back({access.write ? DIFF_MISSING_WRITE : DIFF_MISSING_READ, 0, access.address, access.value, 0});
+        }
+    }
+
+    for(size_t k = 0; k < count; k++)
+    {
+        if(!matched[k])
+        {
+            diffs.push_back({actual[k].write ? DIFF_SPURIOUS_WRITE : DIFF_SPURIOUS_READ, 0, actual[k].address, 0, actual[k].value});
+        }
+    }
+
+    if(diffs.size() == first_diff)
+    {
+        diffs.push_back({expected[i].write ? DIFF_WRITE_ORDER : DIFF_READ_ORDER, (unsigned int)i, expected[i].address, expected[i].value,
+            (unsigned int)positions[i]});
+    }
+
+    return -1;
+}
+
+void print_diffs(TEST_PARAMS &test_params, const vector<STATE_DIFF> &diffs, ostream &out)
+{
+    for (auto &diff : diffs)
+    {
+        switch(diff.kind)
+        {
+        case DIFF_REGISTER:
+            out << "!! REGISTER ERROR: " << test_params.registers[diff.register_index] << " " << diff.expected << " " << diff.actual << endl;
+            break;
+        case DIFF_MISSING_REGISTER:
+            out << "!! MISSING REGISTER: " << test_params.registers[diff.register_index] << " " << diff.expected << endl;
+            break;
+        case DIFF_UNEXPECTED_REGISTER:
+            out << "!! UNEXPECTED REGISTER: " << test_params.registers[diff.register_index] << " " << diff.actual << endl;
+            break;
+        case DIFF_MEMORY:
+            out << "!! MEMORY ERROR: " << diff.address << " " << diff.expected << " " << diff.actual << endl;
+            break;
+        case DIFF_MISSING_MEMORY:
+            out << "!! MISSING MEMORY: " << diff.address << " " << diff.expected << endl;
+            break;
+        case DIFF_UNEXPECTED_WRITE:
+            out << "!! UNEXPECTED WRITE: " << diff.address << " " << diff.actual << endl;
+            break;
+        case DIFF_MISSING_READ:
+            out << "!! MISSING READ: " << diff.address << " " << diff.expected << endl;
+            break;
+        case DIFF_MISSING_WRITE:
+            out << "!! MISSING WRITE: " << diff.address << " " << diff.expected << endl;
+            break;
+        case DIFF_SPURIOUS_READ:
+            out << "!! SPURIOUS READ: " << diff.address << " " << diff.actual << endl;
+            break;
+        case DIFF_SPURIOUS_WRITE:
+            out << "!! SPURIOUS WRITE: " << diff.address << " " << diff.actual << endl;
+            break;
+        case DIFF_READ_ORDER:
+            out << "!! READ ORDER: " << diff.address << " " << diff.expected << " expected as access " << diff.register_index << ", made as access " << diff.actual << endl;
+            break;
+        case DIFF_WRITE_ORDER:
+            out << "!! WRITE ORDER: " << diff.address << " " << diff.expected << " expected as access " << diff.register_index << ", made as access " << diff.actual << endl;
+            break;
+        }
+    }
+}
+
+// add a register to the test register layout, returns its index or -1 if there are too many
+int add_test_register(TEST_PARAMS &test_params, const string &register_name)
+{
+    auto found = test_params.register_indexes.find(register_name);
+    if(found != test_params.register_indexes.end())
+    {
+        return found->second;
+    }
+
+    if(test_params.registers.size() >= MAX_TEST_REGISTERS)
+    {
+        return -1;
+    }
+
+    // compared at full width until the .sla says otherwise
+    test_params.register_masks[test_params.registers.size()] = 0xFFFFFFFF;
+    test_params.register_indexes[register_name] = test_params.registers.size();
+    test_params.registers.push_back(register_name);
+
+    return test_params.registers.size() - 1;
+}
+
+// parse the test register -> Ghidra register mapping file
+int parse_register_mapping(string register_map_filename, map<std::string, std::string>& register_map)
+{
+    string line;
+    string test_reg;
+    string ghidra_reg;
+    unsigned int equal_pos = 0;
+    unsigned int num_reg_mappings = 0;
+
+    if(register_map_filename == "")
+    {
+        // nothing to do
+        return 0;
+    }
+
+    boost::filesystem::ifstream file_handler(register_map_filename);
+
+    while (getline(file_handler, line))
+    {
+        if(line.length() == 0)
+        {
+            // empty line
+            continue;
+        }
+
+        if(line[0] == '#' || line[0] == '=')
+        {
+            // skip comments, invalid
+            continue;
+        }
+
+        equal_pos = line.find("=");
+        if(equal_pos == string::npos)
+        {
+            // didn't have =
+            continue;
+        }
+
+        if(equal_pos == line.length() - 1)
+        {
+            // line ends with = sign
+            continue;
+        }
+
+        test_reg = line.substr(0, equal_pos);
+        ghidra_reg = line.substr(equal_pos + 1, line.length());
+
+        register_map[test_reg] = ghidra_reg;
+    }
+
+    num_reg_mappings = register_map.size();
+    if(num_reg_mappings == 0)
+    {
+        return -1;
+    }
+
+    return 0;
 }
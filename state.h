@@ -11,19 +11,48 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <iostream>
 using namespace std;
 
+// maximum number of distinct registers a test file may use
+#define MAX_TEST_REGISTERS 64
+
+// registers compared per step of the all-equal fast path, divides MAX_TEST_REGISTERS
+#define COMPARE_BLOCK_SIZE 8
+
 typedef struct _TEST_PARAMS
 {
     // passed in params
-    string json_filename;
+    vector<std::string> test_files; // every test file of the run, in order
+    string json_filename; // test file currently being loaded
     string sla_filename;
+    string baseline_sla_filename; // second --sla-file, differential mode compares against it, empty for none
+    vector<std::string> matrix_sla_files; // matrix mode, the .sla of every variant, sla_filename is the first. Empty otherwise
+    vector<std::string> matrix_names; // matrix mode, name of every variant in the report
     string register_map_filename;
     string program_counter; // program program_counter
     unsigned int max_failures; // maximum number of failures allowed before aborting test
     unsigned int start_test; // what test number to start on
     unsigned int end_test; // what test number to end on
-    unsigned int num_threads; // how many threads to use
+    unsigned int num_threads; // how many threads to use, 0 for one per CPU
+    bool pin_threads; // bind each worker thread to its own CPU
+    bool translation_cache; // share decoded instructions between tests
+    bool verbose; // print a line for every passing test
+    bool ordered_results; // write results in test id order
+    string results_filename; // machine readable results, empty for none
+    string results_format; // "jsonl" or "junit"
+    string summary_filename; // compact run summary for verifier merge, empty for none
+    unsigned int shard_index = 0; // this process runs shard shard_index of shard_count, 0 based
+    unsigned int shard_count = 1; // 1 if not sharded
+    bool shard_by_file = false; // test_files was cut down to this shard's files, otherwise every file's tests are sharded
+    bool isolate = false; // run the tests in worker processes, a crash only loses the test it was running
+    string checkpoint_filename; // --isolate progress, empty for none
+    bool resume = false; // continue from checkpoint_filename if it exists
+    string result_cache_filename; // outcomes reused across runs, empty for none
+    string trace_filename; // trace mode, the recorded execution to verify instead of test files. Empty otherwise
+    unsigned long long trace_segment_steps = 0; // trace mode, steps between checkpoints
+    bool bus_access = false; // also compare the RAM accesses of every instruction with the tests' cycles
 
     // obtained via sla file
     unsigned int word_size;
@@ -31,13 +60,92 @@ typedef struct _TEST_PARAMS
     // parsed from register mapping file
     map<std::string, std::string> register_map; // mapping of test registers to Ghidra processor module registers
 
+    // resolved at startup from the tests and validated against the .sla
+    vector<std::string> registers; // Ghidra names of the test registers, position is the register index
+    map<std::string, unsigned int> register_indexes; // Ghidra register name -> register index
+    unsigned int register_masks[MAX_TEST_REGISTERS] = {}; // bits compared for each register, narrowed to its size in the .sla
+
 } TEST_PARAMS, *PTEST_PARAMS;
 
+// Sparse memory as parallel arrays sorted by address, each address appears once.
+// Loaders append with add_memory() and call sort_memory() when the state is complete
+typedef struct _TEST_MEMORY
+{
+    vector<unsigned long long> addresses;
+    vector<unsigned char> values;
+
+    size_t size(void) const { return addresses.size(); }
+    bool empty(void) const { return addresses.empty(); }
+} TEST_MEMORY, *PTEST_MEMORY;
+
 typedef struct _TEST_STATE
 {
-    map<std::string, unsigned int> registers;
-    map<unsigned long long, unsigned char> memory;
+    unsigned int registers[MAX_TEST_REGISTERS]; // indexed by register index
+    unsigned long long register_mask; // bit n set if register n is present
+    TEST_MEMORY memory;
+
+    _TEST_STATE() : registers(), register_mask(0) {}
 } TEST_STATE, *PTEST_STATE;
 
-int print_state(TEST_STATE &a);
-int compare_state(TEST_STATE &a, TEST_STATE &b);
+// one byte of RAM read or written, in the order the accesses happen
+typedef struct _BUS_ACCESS
+{
+    unsigned long long address;
+    unsigned char value;
+    bool write;
+} BUS_ACCESS, *PBUS_ACCESS;
+
+typedef struct _TEST_CASE
+{
+    unsigned int test_id; // index of the test in the test file
+    unsigned int file_index; // index into test_params.test_files
+    unsigned long long sequence; // position in the whole run, ordered output follows it
+    unsigned int variant = 0; // matrix mode, the .sla the test runs on, index into test_params.matrix_sla_files
+    string name; // name given by the test file, may be empty
+    TEST_STATE initial_state;
+    TEST_STATE final_state;
+    vector<BUS_ACCESS> cycles; // the test's memory cycles, only loaded with bus_access
+} TEST_CASE, *PTEST_CASE;
+
+typedef enum _DIFF_KIND
+{
+    DIFF_REGISTER, // register differs
+    DIFF_MISSING_REGISTER, // expected register the actual state doesn't have
+    DIFF_UNEXPECTED_REGISTER, // register the expected state doesn't list
+    DIFF_MEMORY, // expected memory differs
+    DIFF_MISSING_MEMORY, // expected memory the actual state doesn't have
+    DIFF_UNEXPECTED_WRITE, // memory written that the expected state doesn't list
+    DIFF_MISSING_READ, // bus access the test's cycles list but the emulator didn't make
+    DIFF_MISSING_WRITE,
+    DIFF_SPURIOUS_READ, // bus access the emulator made that the test's cycles don't list
+    DIFF_SPURIOUS_WRITE,
+    DIFF_READ_ORDER, // the same bus accesses were made in a different order
+    DIFF_WRITE_ORDER
+} DIFF_KIND;
+
+// one difference between an expected and an actual state
+typedef struct _STATE_DIFF
+{
+    DIFF_KIND kind;
+    unsigned int register_index; // register diffs only. Order diffs, the access's position in the test's cycles
+    unsigned long long address; // memory and bus diffs only
+    unsigned int expected; // masked to the register's width, 0 if missing
+    unsigned int actual; // masked to the register's width, 0 if missing. Order diffs, the position the emulator made the access at
+} STATE_DIFF, *PSTATE_DIFF;
+
+// true if this shard runs test test_id of a file
+inline bool test_in_shard(const TEST_PARAMS &test_params, unsigned int test_id)
+{
+    return test_params.shard_by_file || test_id % test_params.shard_count == test_params.shard_index;
+}
+
+int print_state(TEST_PARAMS &test_params, const TEST_STATE &a, ostream &out = cout);
+void add_memory(TEST_STATE &state, unsigned long long address, unsigned char value);
+void sort_memory(TEST_STATE &state);
+int find_memory(const TEST_STATE &state, unsigned long long address);
+void prepare_readback(const TEST_STATE &expected, TEST_STATE &readback);
+int compare_state(TEST_PARAMS &test_params, const TEST_STATE &expected, const TEST_STATE &actual, vector<STATE_DIFF> &diffs);
+int compare_bus(const vector<BUS_ACCESS> &expected, const BUS_ACCESS *actual, size_t count, vector<STATE_DIFF> &diffs);
+void print_diffs(TEST_PARAMS &test_params, const vector<STATE_DIFF> &diffs, ostream &out = cout);
+int add_test_register(TEST_PARAMS &test_params, const string &register_name);
+int parse_register_mapping(string register_map_filename, map<std::string, std::string>& register_map);
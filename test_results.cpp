@@ -0,0 +1,447 @@
+//--------------------------------------------------------------------------------------
+// File: test_results.cpp
+//
+// Hands test results from the worker threads to a single writer thread
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include "test_results.h"
+#include "result_writers.h"
+#include "result_cache.h"
+#include "profiler.h"
+#include <iostream>
+
+// how long the writer sleeps when every queue is empty
+#define RESULT_IDLE_SLEEP_US 500
+
+ResultPipeline::ResultPipeline(TEST_PARAMS &params, unsigned int num_workers) :
+    test_params(params), finishing(false), file_result(0), next_sequence(0), totals(), listed(),
+    file_counts(params.test_files.size() * max(params.matrix_sla_files.size(), (size_t)1), FILE_COUNTS())
+{
+    for(unsigned int i = 0; i < num_workers; i++)
+    {
+        queues.emplace_back(new RESULT_QUEUE(RESULT_QUEUE_SIZE));
+    }
+}
+
+ResultPipeline::~ResultPipeline(void)
+{
+    finish();
+}
+
+int ResultPipeline::open(void)
+{
+    if(!test_params.result_cache_filename.empty())
+    {
+        result_cache.reset(new ResultCache());
+        if(result_cache->open(test_params.result_cache_filename) != 0)
+        {
+            result_cache.reset();
+            return -1;
+        }
+    }
+
+    if(test_params.results_filename.empty())
+    {
+        return 0;
+    }
+
+    result_file = create_result_writer(test_params);
+    if(result_file == nullptr)
+    {
+        cout << "[-] Unknown results format " << test_params.results_format << "!" << endl;
+        return -1;
+    }
+
+    if(result_file->open(test_params.results_filename) != 0)
+    {
+        result_file.reset();
+        return -1;
+    }
+
+    result_file->begin();
+
+    return 0;
+}
+
+void ResultPipeline::restore(const vector<FILE_COUNTS> &counts, const vector<nlohmann::ordered_json> &records, unsigned long long first_sequence)
+{
+    for(unsigned int i = 0; i < counts.size() && i < file_counts.size(); i++)
+    {
+        file_counts[i] = counts[i];
+        totals.passed += counts[i].passed;
+        totals.failed += counts[i].failed;
+        totals.errors += counts[i].errors;
+        totals.fixed += counts[i].fixed;
+        totals.regressed += counts[i].regressed;
+        totals.changed += counts[i].changed;
+    }
+
+    failure_records = records;
+    next_sequence = first_sequence;
+}
+
+void ResultPipeline::start(void)
+{
+    last_progress = boost::chrono::steady_clock::now();
+    writer = boost::thread(&ResultPipeline::writerLoop, this);
+}
+
+// called by worker n only. Waits while the writer is behind
+void ResultPipeline::submit(unsigned int worker, unique_ptr<TEST_RESULT> result)
+{
+    TEST_RESULT *raw = result.release();
+
+    while(!queues[worker]->push(raw))
+    {
+        boost::this_thread::yield();
+    }
+}
+
+void ResultPipeline::finish(void)
+{
+    if(!writer.joinable())
+    {
+        return;
+    }
+
+    finishing = true;
+    writer.join();
+}
+
+// take everything currently queued, true if anything was found
+bool ResultPipeline::drain(void)
+{
+    TEST_RESULT *raw = nullptr;
+    bool found = false;
+
+    for(auto &queue : queues)
+    {
+        while(queue->pop(raw))
+        {
+            accept(unique_ptr<TEST_RESULT>(raw));
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+void ResultPipeline::writerLoop(void)
+{
+    while(1)
+    {
+        // read the flag before draining so results submitted just before finish() aren't lost
+        bool last_pass = finishing;
+
+        if(!last_pass)
+        {
+            writeProgress();
+        }
+
+        if(drain())
+        {
+            continue;
+        }
+
+        if(last_pass)
+        {
+            break;
+        }
+
+        boost::this_thread::sleep_for(boost::chrono::microseconds(RESULT_IDLE_SLEEP_US));
+    }
+
+    // tests that never ran (an aborted run) leave gaps, write what is left in order
+    for(auto &[test_id, result] : pending)
+    {
+        write(*result);
+    }
+    pending.clear();
+
+    if(result_file != nullptr)
+    {
+        const FILE_COUNTS &counts = test_params.baseline_sla_filename.empty() ? totals : listed;
+
+        result_file->end(counts.passed, counts.failed, counts.errors);
+        file_result = result_file->close();
+    }
+
+    if(result_cache != nullptr && result_cache->close() != 0)
+    {
+        file_result = -1;
+    }
+
+    cout.flush();
+}
+
+void ResultPipeline::writeProgress(void)
+{
+    auto now = boost::chrono::steady_clock::now();
+
+    if(progress == nullptr || now - last_progress < boost::chrono::milliseconds(PROGRESS_INTERVAL_MS))
+    {
+        return;
+    }
+
+    last_progress = now;
+
+    string line = progress();
+    if(!line.empty())
+    {
+        cout << line << endl;
+    }
+}
+
+void ResultPipeline::accept(unique_ptr<TEST_RESULT> result)
+{
+    if(!test_params.ordered_results)
+    {
+        write(*result);
+        return;
+    }
+
+    unsigned long long sequence = result->sequence;
+    pending[sequence] = std::move(result);
+
+    // release the run of results that is now complete
+    auto next = pending.begin();
+    while(next != pending.end() && next->first == next_sequence)
+    {
+        write(*next->second);
+        next = pending.erase(next);
+        next_sequence++;
+    }
+}
+
+// "[+] 12) " for a single file, "[+] ea.json 12) " in a batch, "[+] 65c02 ea.json 12) " in a matrix
+void ResultPipeline::writeTestName(const TEST_RESULT &result)
+{
+    cout << (result.status == TEST_PASS ? "[+] " : "[-] ");
+
+    if(!test_params.matrix_names.empty())
+    {
+        cout << test_params.matrix_names[result.variant] << " ";
+    }
+
+    if(test_params.test_files.size() > 1)
+    {
+        cout << test_params.test_files[result.file_index] << " ";
+    }
+
+    cout << result.test_id << ") ";
+}
+
+void ResultPipeline::write(const TEST_RESULT &result)
+{
+    PROFILE_SCOPE(PHASE_OUTPUT);
+
+    bool reported = is_reported(test_params, result);
+
+    // in differential mode the results file only lists the divergent tests too
+    if(result_file != nullptr && (reported || test_params.baseline_sla_filename.empty()))
+    {
+        result_file->write(result);
+        count_result(result.status, result.divergence, listed);
+    }
+
+    if(result_cache != nullptr)
+    {
+        result_cache->add(result);
+        if(result.baseline != nullptr)
+        {
+            result_cache->add(*result.baseline);
+        }
+    }
+
+    if(reported && !test_params.summary_filename.empty())
+    {
+        failure_records.push_back(result_record(test_params, result));
+    }
+
+    count_result(result.status, result.divergence, totals);
+    count_result(result.status, result.divergence, file_counts[result.variant * test_params.test_files.size() + result.file_index]);
+
+    if(!test_params.baseline_sla_filename.empty())
+    {
+        writeDivergence(result);
+        return;
+    }
+
+    switch(result.status)
+    {
+    case TEST_PASS:
+        if(test_params.verbose)
+        {
+            writeTestName(result);
+            cout << "SUCCESS" << "\n";
+        }
+        break;
+
+    case TEST_FAIL:
+        writeTestName(result);
+        cout << "FAIL" << "\n";
+        print_diffs(test_params, result.diffs);
+
+        cout << "Initial State:" << "\n";
+        print_state(test_params, result.initial_state);
+        cout << "\n";
+
+        cout << "Final (Expected) State:" << "\n";
+        print_state(test_params, result.expected_state);
+        cout << "\n";
+
+        cout << "Emulator:" << "\n";
+        print_state(test_params, result.emulator_state);
+        cout << "\n";
+        break;
+
+    case TEST_ERROR:
+        writeTestName(result);
+        cout << "ERROR: " << result.error << "\n";
+        break;
+
+    case TEST_CRASH:
+        writeTestName(result);
+        cout << "CRASH: " << result.error << "\n";
+        break;
+    }
+}
+
+// "pass", "FAIL" and its diffs or "ERROR: ..." for one side of a divergence
+static void write_outcome(TEST_PARAMS &test_params, const TEST_RESULT &result)
+{
+    switch(result.status)
+    {
+    case TEST_PASS:
+        cout << "pass" << "\n";
+        break;
+
+    case TEST_FAIL:
+        cout << "FAIL" << "\n";
+        print_diffs(test_params, result.diffs);
+        break;
+
+    case TEST_ERROR:
+        cout << "ERROR: " << result.error << "\n";
+        break;
+
+    case TEST_CRASH:
+        cout << "CRASH: " << result.error << "\n";
+        break;
+    }
+}
+
+// differential mode, tests with the same outcome on both .sla files are only listed with --verbose
+void ResultPipeline::writeDivergence(const TEST_RESULT &result)
+{
+    if(result.baseline == nullptr)
+    {
+        // never got as far as the baseline, a crash or a corrupt test
+        writeTestName(result);
+        write_outcome(test_params, result);
+        return;
+    }
+
+    switch(result.divergence)
+    {
+    case DIVERGENCE_NONE:
+        if(test_params.verbose)
+        {
+            writeTestName(result);
+            cout << "UNCHANGED (" << result_status_name(result.status) << ")" << "\n";
+        }
+        return;
+
+    case DIVERGENCE_FIXED:
+        writeTestName(result);
+        cout << "FIXED" << "\n";
+        break;
+
+    case DIVERGENCE_REGRESSED:
+        writeTestName(result);
+        cout << "REGRESSED" << "\n";
+        break;
+
+    case DIVERGENCE_CHANGED:
+        writeTestName(result);
+        cout << "CHANGED" << "\n";
+        break;
+    }
+
+    cout << "Baseline: ";
+    write_outcome(test_params, *result.baseline);
+    cout << "Current: ";
+    write_outcome(test_params, result);
+
+    cout << "Initial State:" << "\n";
+    print_state(test_params, result.initial_state);
+    cout << "\n";
+
+    cout << "Final (Expected) State:" << "\n";
+    print_state(test_params, result.expected_state);
+    cout << "\n";
+
+    if(result.baseline->status == TEST_FAIL)
+    {
+        cout << "Baseline Emulator:" << "\n";
+        print_state(test_params, result.baseline->emulator_state);
+        cout << "\n";
+    }
+
+    if(result.status == TEST_FAIL)
+    {
+        cout << "Emulator:" << "\n";
+        print_state(test_params, result.emulator_state);
+        cout << "\n";
+    }
+}
+
+bool is_reported(const TEST_PARAMS &test_params, const TEST_RESULT &result)
+{
+    if(test_params.baseline_sla_filename.empty() || result.baseline == nullptr)
+    {
+        return result.status != TEST_PASS;
+    }
+
+    return result.divergence != DIVERGENCE_NONE;
+}
+
+void count_result(TEST_STATUS status, DIVERGENCE divergence, FILE_COUNTS &counts)
+{
+    switch(status)
+    {
+    case TEST_PASS:
+        counts.passed++;
+        break;
+
+    case TEST_FAIL:
+        counts.failed++;
+        break;
+
+    case TEST_ERROR:
+    case TEST_CRASH:
+        counts.errors++;
+        break;
+    }
+
+    switch(divergence)
+    {
+    case DIVERGENCE_NONE:
+        break;
+
+    case DIVERGENCE_FIXED:
+        counts.fixed++;
+        break;
+
+    case DIVERGENCE_REGRESSED:
+        counts.regressed++;
+        break;
+
+    case DIVERGENCE_CHANGED:
+        counts.changed++;
+        break;
+    }
+}
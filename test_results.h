@@ -0,0 +1,167 @@
+//--------------------------------------------------------------------------------------
+// File: test_results.h
+//
+// Hands test results from the worker threads to a single writer thread
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/thread/thread.hpp>
+#include <nlohmann/json.hpp>
+#include "state.h"
+
+// results each worker can have waiting for the writer before it has to wait
+#define RESULT_QUEUE_SIZE 1024
+
+// minimum time between progress lines
+#define PROGRESS_INTERVAL_MS 1000
+
+typedef enum _TEST_STATUS
+{
+    TEST_PASS,
+    TEST_FAIL, // emulator state differs from the expected state
+    TEST_ERROR, // the test could not be run
+    TEST_CRASH // the worker process running the test died, --isolate only
+} TEST_STATUS;
+
+// differential mode, how a test's outcome compares to its outcome on the baseline .sla
+typedef enum _DIVERGENCE
+{
+    DIVERGENCE_NONE, // same outcome on both
+    DIVERGENCE_FIXED, // passes, failed on the baseline
+    DIVERGENCE_REGRESSED, // fails, passed on the baseline
+    DIVERGENCE_CHANGED // fails on both but differently
+} DIVERGENCE;
+
+// identifies a test's outcome in the --result-cache, see result_cache.h
+typedef struct _RESULT_KEY
+{
+    unsigned long long high;
+    unsigned long long low;
+
+    bool operator==(const _RESULT_KEY &other) const { return high == other.high && low == other.low; }
+} RESULT_KEY, *PRESULT_KEY;
+
+struct RESULT_KEY_HASH
+{
+    size_t operator()(const RESULT_KEY &key) const { return key.low; }
+};
+
+// Outcome of one test. The states are only kept for tests that didn't pass
+typedef struct _TEST_RESULT
+{
+    unsigned int test_id;
+    unsigned int file_index;
+    unsigned int variant = 0; // matrix mode only
+    unsigned long long sequence;
+    string name; // name given by the test file, may be empty
+    TEST_STATUS status;
+    string error; // TEST_ERROR and TEST_CRASH only
+    string exception_type; // exception raised while executing the instruction, empty if none
+    string exception_message;
+    unsigned long long duration_ns; // emulation and comparison
+    vector<STATE_DIFF> diffs;
+    TEST_STATE initial_state;
+    TEST_STATE expected_state;
+    TEST_STATE emulator_state;
+    RESULT_KEY cache_key = {}; // valid if cacheable
+    bool cacheable = false; // the outcome may be stored in the result cache
+    bool cached = false; // the outcome came from the result cache, the test wasn't emulated
+    DIVERGENCE divergence = DIVERGENCE_NONE; // differential mode only
+    unique_ptr<_TEST_RESULT> baseline; // differential mode, the outcome on the baseline .sla
+} TEST_RESULT, *PTEST_RESULT;
+
+class ResultWriter;
+class ResultCache;
+
+// outcome counts for one test file
+typedef struct _FILE_COUNTS
+{
+    unsigned int passed;
+    unsigned int failed;
+    unsigned int errors; // crashes included
+    unsigned int fixed; // differential mode only
+    unsigned int regressed;
+    unsigned int changed;
+} FILE_COUNTS, *PFILE_COUNTS;
+
+// A result the report lists: one that didn't pass or, in differential mode, one whose
+// outcome differs from the baseline. Only these spend the --max-failures budget
+bool is_reported(const TEST_PARAMS &test_params, const TEST_RESULT &result);
+void count_result(TEST_STATUS status, DIVERGENCE divergence, FILE_COUNTS &counts);
+
+// Every worker owns a single producer/single consumer queue so submitting a result never
+// takes a lock. One writer thread drains the queues and does all of the formatting and
+// output, workers never touch cout. Progress lines are printed by the writer too, between
+// results, so they never land inside a failure report.
+// With ordered_results set the writer holds results back in a reorder buffer and writes
+// them in the order the loader read them, file by file and test by test. Both the console and the --results file see the same order
+class ResultPipeline
+{
+    typedef boost::lockfree::spsc_queue<TEST_RESULT *> RESULT_QUEUE;
+
+    TEST_PARAMS &test_params;
+    vector<unique_ptr<RESULT_QUEUE>> queues;
+    boost::thread writer;
+    boost::atomic<bool> finishing;
+    unique_ptr<ResultWriter> result_file; // --results, null if not requested
+    unique_ptr<ResultCache> result_cache; // --result-cache, null if not requested
+    int file_result;
+
+    // writer thread only
+    unsigned long long next_sequence; // next result to write when ordering
+    map<unsigned long long, unique_ptr<TEST_RESULT>> pending;
+    FILE_COUNTS totals; // every file
+    FILE_COUNTS listed; // differential mode, the tests the --results file lists
+    vector<FILE_COUNTS> file_counts; // indexed by variant * number of files + file index
+    vector<nlohmann::ordered_json> failure_records; // kept for the --summary file
+    std::function<string(void)> progress; // null if no progress lines
+    boost::chrono::steady_clock::time_point last_progress;
+
+    void writerLoop(void);
+    void writeProgress(void);
+    bool drain(void);
+    void accept(unique_ptr<TEST_RESULT> result);
+    void writeTestName(const TEST_RESULT &result);
+    void write(const TEST_RESULT &result);
+    void writeDivergence(const TEST_RESULT &result);
+
+public:
+    ResultPipeline(TEST_PARAMS &params, unsigned int num_workers);
+    ~ResultPipeline(void);
+
+    int open(void); // opens the --results file and loads the --result-cache, if any
+    void start(void);
+
+    // Before start(). The writer prints the line this returns at most once per
+    // PROGRESS_INTERVAL_MS while the run goes on, an empty line prints nothing
+    void setProgress(std::function<string(void)> line) { progress = line; }
+    void submit(unsigned int worker, unique_ptr<TEST_RESULT> result);
+    void finish(void); // waits until every submitted result is written
+
+    // Continue a run from a checkpoint, before start(). The counts and failure records are
+    // those of every test before first_sequence, which are not written again
+    void restore(const vector<FILE_COUNTS> &counts, const vector<nlohmann::ordered_json> &records, unsigned long long first_sequence);
+
+    // valid after finish()
+    unsigned int getPassed(void) const { return totals.passed; }
+    unsigned int getFailed(void) const { return totals.failed; }
+    unsigned int getErrors(void) const { return totals.errors; }
+    const FILE_COUNTS &getTotals(void) const { return totals; }
+    const FILE_COUNTS &getFileCounts(unsigned int file_index, unsigned int variant = 0) const
+    {
+        return file_counts[variant * test_params.test_files.size() + file_index];
+    }
+    int getFileResult(void) const { return file_result; }
+    const ResultCache *getResultCache(void) const { return result_cache.get(); } // read only for the workers
+    const vector<nlohmann::ordered_json> &getFailureRecords(void) const { return failure_records; }
+};
@@ -0,0 +1,92 @@
+//--------------------------------------------------------------------------------------
+// File: test_run.h
+//
+// Progress and cancellation shared by the worker threads and the thread driving the run
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// Workers publish completions and failures here and check isCancelled() between tests.
+// The driving thread sleeps in wait() and is woken as soon as the last worker exits or
+// the run is cancelled, there is no polling.
+// The failure budget is exact: once max_failures failures are recorded the run is
+// cancelled and later failures from tests already in flight are not counted
+class TestRun
+{
+    boost::atomic<unsigned int> completed;
+    boost::atomic<unsigned int> failures;
+    boost::atomic<bool> cancelled;
+    unsigned int max_failures;
+
+    // guards active_workers, signalled when the run finishes or is cancelled
+    boost::mutex lock;
+    boost::condition_variable changed;
+    unsigned int active_workers;
+
+public:
+    TestRun(unsigned int failure_budget, unsigned int num_workers) :
+        completed(0), failures(0), cancelled(false), max_failures(failure_budget), active_workers(num_workers) {}
+
+    bool isCancelled(void) const { return cancelled.load(boost::memory_order_relaxed); }
+
+    void cancel(void)
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        cancelled = true;
+        changed.notify_all();
+    }
+
+    void addCompletions(unsigned int count) { completed.fetch_add(count, boost::memory_order_relaxed); }
+
+    // returns false if the budget was already spent and the failure was not counted
+    bool recordFailure(void)
+    {
+        unsigned int current = failures.load();
+
+        do
+        {
+            if(current >= max_failures)
+            {
+                return false;
+            }
+        } while(!failures.compare_exchange_weak(current, current + 1));
+
+        if(current + 1 >= max_failures)
+        {
+            cancel();
+        }
+
+        return true;
+    }
+
+    void workerDone(void)
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        active_workers--;
+        changed.notify_all();
+    }
+
+    // returns once every worker has exited or the run was cancelled
+    void wait(void)
+    {
+        boost::unique_lock<boost::mutex> guard(lock);
+
+        changed.wait(guard, [this]() { return active_workers == 0 || cancelled; });
+    }
+
+    // continue a run from a checkpoint, before any worker starts
+    void restore(unsigned int completions, unsigned int failure_count)
+    {
+        completed = completions;
+        failures = failure_count;
+    }
+
+    unsigned int getCompletions(void) const { return completed; }
+    unsigned int getFailures(void) const { return failures; }
+};
@@ -0,0 +1,190 @@
+//--------------------------------------------------------------------------------------
+// File: test_scheduler.h
+//
+// Work stealing scheduler used to hand chunks of tests from the loader to the worker threads
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+// Every worker has its own deque of chunks. The loader deals chunks out round robin, a worker
+// takes from the front of its own deque and, when that is empty, steals from the back of the
+// others so a worker stuck on slow opcodes doesn't hold up the rest.
+// The loader blocks while max_chunks are queued so it can't pull an entire test file into memory.
+// close() means no more chunks are coming, workers drain what is left.
+// cancel() aborts, waking everyone and dropping what is left
+template <typename T>
+class TestScheduler
+{
+    typedef struct _WORKER_QUEUE
+    {
+        boost::mutex lock;
+        std::deque<T> chunks;
+    } WORKER_QUEUE;
+
+    std::vector<std::unique_ptr<WORKER_QUEUE>> queues;
+
+    // guards everything below
+    boost::mutex lock;
+    boost::condition_variable not_full;
+    boost::condition_variable not_empty;
+    size_t capacity;
+    size_t queued; // chunks accepted but not yet taken
+    size_t pushed; // total number of tests ever accepted
+    size_t next_queue;
+    bool closed;
+    bool cancelled;
+
+    bool take(unsigned int worker, T &chunk)
+    {
+        // own deque first, oldest chunk
+        {
+            WORKER_QUEUE &own = *queues[worker];
+            boost::lock_guard<boost::mutex> guard(own.lock);
+
+            if(!own.chunks.empty())
+            {
+                chunk = std::move(own.chunks.front());
+                own.chunks.pop_front();
+                return true;
+            }
+        }
+
+        // steal the newest chunk from the next worker that has one
+        for(size_t i = 1; i < queues.size(); i++)
+        {
+            WORKER_QUEUE &victim = *queues[(worker + i) % queues.size()];
+            boost::lock_guard<boost::mutex> guard(victim.lock);
+
+            if(!victim.chunks.empty())
+            {
+                chunk = std::move(victim.chunks.back());
+                victim.chunks.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+public:
+    TestScheduler(unsigned int num_workers, size_t max_chunks) :
+        capacity(max_chunks), queued(0), pushed(0), next_queue(0), closed(false), cancelled(false)
+    {
+        for(unsigned int i = 0; i < num_workers; i++)
+        {
+            queues.emplace_back(new WORKER_QUEUE());
+        }
+    }
+
+    // returns false if the scheduler was cancelled and the chunk was not accepted
+    bool push(T &&chunk, size_t num_tests)
+    {
+        size_t target = 0;
+
+        {
+            boost::unique_lock<boost::mutex> guard(lock);
+
+            while(queued >= capacity && !cancelled)
+            {
+                not_full.wait(guard);
+            }
+
+            if(cancelled)
+            {
+                return false;
+            }
+
+            queued++;
+            pushed += num_tests;
+            target = next_queue;
+            next_queue = (next_queue + 1) % queues.size();
+        }
+
+        {
+            boost::lock_guard<boost::mutex> guard(queues[target]->lock);
+            queues[target]->chunks.push_back(std::move(chunk));
+        }
+
+        // wake a worker only once the chunk can be found
+        {
+            boost::lock_guard<boost::mutex> guard(lock);
+            not_empty.notify_one();
+        }
+
+        return true;
+    }
+
+    // returns false once the scheduler is closed and drained, or cancelled
+    bool pop(unsigned int worker, T &chunk)
+    {
+        while(1)
+        {
+            {
+                boost::unique_lock<boost::mutex> guard(lock);
+
+                while(queued == 0 && !closed && !cancelled)
+                {
+                    not_empty.wait(guard);
+                }
+
+                if(cancelled || queued == 0)
+                {
+                    return false;
+                }
+            }
+
+            if(take(worker, chunk))
+            {
+                boost::lock_guard<boost::mutex> guard(lock);
+                queued--;
+                not_full.notify_one();
+                return true;
+            }
+
+            // a chunk was accepted but the loader hasn't placed it yet, or another worker got
+            // to it first and hasn't accounted for it yet
+            boost::this_thread::yield();
+        }
+    }
+
+    void close(void)
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    void cancel(void)
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        cancelled = true;
+        for(auto &queue : queues)
+        {
+            boost::lock_guard<boost::mutex> queue_guard(queue->lock);
+            queue->chunks.clear();
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    bool isClosed(void)
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        return closed;
+    }
+
+    size_t getPushed(void)
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        return pushed;
+    }
+};
@@ -0,0 +1,98 @@
+//--------------------------------------------------------------------------------------
+// File: verifier_pack.cpp
+//
+// Converts a json test file into the binary test pack format read by the verifier, or a
+// json execution trace into the binary trace format
+//
+// Copyright (c) Oberoi Security Solutions. All rights reserved.
+// Licensed under the Apache 2.0 License.
+//--------------------------------------------------------------------------------------
+
+#include <iostream>
+#include <boost/program_options.hpp>
+#include "state.h"
+#include "backends/pack.h"
+#include "backends/trace.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    boost::program_options::options_description desc{"Ghidra Processor Module Verifier Test Packer"};
+    boost::program_options::variables_map args;
+    TEST_PARAMS test_params;
+    string pack_filename;
+    int result = 0;
+
+    test_params.start_test = 0;
+    test_params.end_test = 0xFFFFFFFF;
+
+    try
+    {
+        desc.add_options()
+            ("json-test,j", boost::program_options::value<string>(&test_params.json_filename), "Path to json test file. Required")
+            ("output,o", boost::program_options::value<string>(&pack_filename), "Path of the test pack to write. Required")
+            ("register-map", boost::program_options::value<string>(&test_params.register_map_filename), "Path to file containing mapping of test registers to Ghidra processor module registers. Optional.")
+            ("cycles", "Keep the tests' memory cycles for verifier --bus-access. Optional.")
+            ("trace", "The json file is an execution trace, write a .vtr for verifier --trace instead of a test pack. Optional.")
+            ("help,h", "Help screen");
+
+        store(parse_command_line(argc, argv, desc), args);
+        notify(args);
+
+        if(args.count("help") || argc == 1)
+        {
+            cout << desc << endl;
+            return 0;
+        }
+
+        if(args.count("json-test") == 0)
+        {
+            cout << "JSON test filename is required!" << endl;
+            return -1;
+        }
+
+        if(args.count("output") == 0)
+        {
+            cout << "Output filename is required!" << endl;
+            return -1;
+        }
+    }
+    catch (const boost::program_options::error &ex)
+    {
+        cout << "[-] Error parsing command line: " << ex.what() << endl;
+        return -1;
+    }
+
+    if(args.count("cycles"))
+    {
+        test_params.bus_access = true;
+    }
+
+    result = parse_register_mapping(test_params.register_map_filename, test_params.register_map);
+    if(result != 0)
+    {
+        cout << "[-] Failed to parse register map file (" << test_params.register_map_filename << ")!" << endl;
+        return -1;
+    }
+
+    if(args.count("trace"))
+    {
+        result = write_trace(test_params, pack_filename);
+        if(result != 0)
+        {
+            cout << "[-] Failed to convert trace " << test_params.json_filename << "!" << endl;
+        }
+
+        return result;
+    }
+
+    result = write_test_pack(test_params, pack_filename);
+    if(result != 0)
+    {
+        cout << "[-] Failed to pack " << test_params.json_filename << "!" << endl;
+        return result;
+    }
+
+    return 0;
+}